@@ -0,0 +1,1151 @@
+/*
+ * uhttpd - Tiny single-threaded httpd - Benchmarks and load generator
+ *
+ *   Copyright (C) 2026 agent <agent@local>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* The parser and the mime lookup are static, so the server and file
+ * handler sources are compiled into this unit with main() renamed. */
+#define main uh_main
+int uh_main(int argc, char **argv);
+#include "uhttpd.c"
+#undef main
+
+#include "uhttpd-file.c"
+
+#include <time.h>
+#include <inttypes.h>
+
+
+/* Every result is printed as one JSON object per line, so runs can be
+ * collected and compared across releases with standard tools. */
+
+static uint64_t uh_bench_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void uh_bench_json_str(const char *str)
+{
+	putchar('"');
+
+	for (; *str; str++)
+	{
+		if ((*str == '"') || (*str == '\\'))
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+
+	putchar('"');
+}
+
+
+/*
+ * Microbenchmarks
+ */
+
+static volatile int uh_bench_sink;
+
+static struct config uh_bench_conf;
+static struct listener uh_bench_server = { .conf = &uh_bench_conf };
+static struct client uh_bench_client = { .server = &uh_bench_server };
+
+static char uh_bench_docroot[PATH_MAX];
+
+#define UH_BENCH_DIRS	16
+#define UH_BENCH_FILES	16
+
+static const char uh_bench_reqhead[] =
+	"GET /cgi-bin/luci/admin/status/overview?stok=0123456789abcdef HTTP/1.1\r\n"
+	"Host: 192.168.1.1\r\n"
+	"Connection: keep-alive\r\n"
+	"Cache-Control: max-age=0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36\r\n"
+	"Referer: http://192.168.1.1/cgi-bin/luci\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Accept-Language: en-US,en;q=0.9\r\n"
+	"Cookie: sysauth=0123456789abcdef0123456789abcdef\r\n"
+	"If-None-Match: \"1a2b-3c4d-5e6f\"\r\n"
+	"\r\n";
+
+static const char uh_bench_encoded[] =
+	"/cgi-bin/luci/admin/network/wireless%20settings%2Fradio0"
+	"?name=%E2%82%AC%20uro&ssid=my%20network%26guests";
+
+static const char uh_bench_plain[] =
+	"/www/luci-static/resources/view/status page/€ uro & guests.js";
+
+static const char uh_bench_b64[] =
+	"YWRtaW5pc3RyYXRvcjpjb3JyZWN0IGhvcnNlIGJhdHRlcnkgc3RhcGxl";
+
+static const char *uh_bench_names[] = {
+	"/index.html", "/luci-static/bootstrap/cascade.css", "/js/app.min.js",
+	"/img/logo.png", "/backup.tar.gz", "/README", "/data/status.json",
+	"/fonts/icons.woff2", "/firmware.bin", "/unknown.xyz"
+};
+
+static void uh_bench_header_parse(int i)
+{
+	static char buf[sizeof(uh_bench_reqhead)];
+	struct client *cl = &uh_bench_client;
+
+	memcpy(buf, uh_bench_reqhead, sizeof(uh_bench_reqhead) - 1);
+	memset(&cl->request, 0, sizeof(cl->request));
+
+	cl->httpbuf.buf = cl->httpbuf.ptr = buf;
+	cl->httpbuf.len = sizeof(uh_bench_reqhead) - 1;
+	cl->httpbuf.scan = 0;
+	cl->httpbuf.hdrcount = 0;
+
+	uh_bench_sink = uh_http_header_parse(cl);
+}
+
+static void uh_bench_urldecode(int i)
+{
+	char buf[sizeof(uh_bench_encoded)];
+
+	uh_bench_sink = uh_urldecode(buf, sizeof(buf), uh_bench_encoded,
+								 sizeof(uh_bench_encoded) - 1);
+}
+
+static void uh_bench_urlencode(int i)
+{
+	char buf[sizeof(uh_bench_plain) * 3];
+
+	uh_bench_sink = uh_urlencode(buf, sizeof(buf), uh_bench_plain,
+								 sizeof(uh_bench_plain) - 1);
+}
+
+static void uh_bench_b64decode(int i)
+{
+	char buf[sizeof(uh_bench_b64)];
+
+	uh_bench_sink = uh_b64decode(buf, sizeof(buf),
+								 (const unsigned char *)uh_bench_b64,
+								 sizeof(uh_bench_b64) - 1);
+}
+
+static void uh_bench_strfind(int i)
+{
+	static char buf[UH_LIMIT_MSGHEAD];
+
+	/* a multipart boundary near the end of a full header buffer */
+	if (!buf[0])
+	{
+		memset(buf, '-', sizeof(buf));
+		memcpy(buf + sizeof(buf) - 64, "\r\n--boundary1234", 16);
+	}
+
+	uh_bench_sink = !!strfind(buf, sizeof(buf), "\r\n--boundary1234", 16);
+}
+
+static void uh_bench_path_hit(int i)
+{
+	uh_bench_sink = !!uh_path_lookup(&uh_bench_client, "/d0/f0.html");
+}
+
+static void uh_bench_path_miss(int i)
+{
+	char url[32];
+
+	/* cycling through more files than the cache holds misses every time */
+	snprintf(url, sizeof(url), "/d%d/f%d.html",
+			 (i / UH_BENCH_FILES) % UH_BENCH_DIRS, i % UH_BENCH_FILES);
+
+	uh_bench_sink = !!uh_path_lookup(&uh_bench_client, url);
+}
+
+static void uh_bench_mime_lookup(int i)
+{
+	uh_bench_sink = !!uh_file_mime_lookup(
+		uh_bench_names[i % array_size(uh_bench_names)]);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(int i);
+} uh_bench_micros[] = {
+	{ "header_parse",     uh_bench_header_parse },
+	{ "urldecode",        uh_bench_urldecode },
+	{ "urlencode",        uh_bench_urlencode },
+	{ "b64decode",        uh_bench_b64decode },
+	{ "strfind",          uh_bench_strfind },
+	{ "path_lookup_hit",  uh_bench_path_hit },
+	{ "path_lookup_miss", uh_bench_path_miss },
+	{ "mime_lookup",      uh_bench_mime_lookup },
+};
+
+static void uh_bench_docroot_walk(bool create)
+{
+	int i, j;
+	/* the docroot itself may take up to PATH_MAX, leave room for the
+	 * subdirectory and file names appended to it */
+	char path[PATH_MAX + sizeof("/d2147483647/f2147483647.html")];
+	FILE *f;
+
+	for (i = 0; i < UH_BENCH_DIRS; i++)
+	{
+		snprintf(path, sizeof(path), "%s/d%d", uh_bench_docroot, i);
+
+		if (create)
+			mkdir(path, 0755);
+
+		for (j = 0; j < UH_BENCH_FILES; j++)
+		{
+			snprintf(path, sizeof(path), "%s/d%d/f%d.html",
+					 uh_bench_docroot, i, j);
+
+			if (!create)
+				unlink(path);
+			else if ((f = fopen(path, "w")) != NULL)
+				fclose(f);
+		}
+
+		if (!create)
+		{
+			snprintf(path, sizeof(path), "%s/d%d", uh_bench_docroot, i);
+			rmdir(path);
+		}
+	}
+
+	if (!create)
+		rmdir(uh_bench_docroot);
+}
+
+static int uh_bench_micro(int argc, char **argv)
+{
+	int i, j, k, opt;
+	int iterations = 200000;
+	int rounds = 3;
+	uint64_t t, best;
+
+	while ((opt = getopt(argc, argv, "n:r:")) > 0)
+	{
+		switch (opt)
+		{
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+
+			case 'r':
+				rounds = atoi(optarg);
+				break;
+
+			default:
+				fprintf(stderr,
+					"Usage: uhttpd-bench micro [-n iterations] [-r rounds] "
+					"[name ...]\n");
+				return 1;
+		}
+	}
+
+	if ((iterations < 1) || (rounds < 1))
+	{
+		fprintf(stderr, "Error: Invalid iteration or round count\n");
+		return 1;
+	}
+
+	/* synthetic docroot for the path lookups */
+	snprintf(uh_bench_docroot, sizeof(uh_bench_docroot),
+			 "/tmp/uhttpd-bench.XXXXXX");
+
+	if (!mkdtemp(uh_bench_docroot) ||
+		!realpath(uh_bench_docroot, uh_bench_conf.docroot))
+	{
+		fprintf(stderr, "Error: Cannot create docroot: %s\n",
+				strerror(errno));
+		return 1;
+	}
+
+	uh_bench_docroot_walk(true);
+	uh_index_add("index.html");
+
+	for (i = 0; i < array_size(uh_bench_micros); i++)
+	{
+		if (optind < argc)
+		{
+			for (j = optind; j < argc; j++)
+				if (!strcmp(argv[j], uh_bench_micros[i].name))
+					break;
+
+			if (j == argc)
+				continue;
+		}
+
+		/* best of several rounds to filter scheduling noise */
+		for (best = 0, j = 0; j < rounds; j++)
+		{
+			t = uh_bench_nsec();
+
+			for (k = 0; k < iterations; k++)
+				uh_bench_micros[i].run(k);
+
+			t = uh_bench_nsec() - t;
+
+			if (!best || (t < best))
+				best = t;
+		}
+
+		printf("{\"bench\":\"micro\",\"name\":\"%s\",\"iterations\":%d,"
+			   "\"rounds\":%d,\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f}\n",
+			   uh_bench_micros[i].name, iterations, rounds,
+			   (double)best / iterations,
+			   best ? (double)iterations * 1000000000 / best : 0.0);
+	}
+
+	uh_bench_docroot_walk(false);
+
+	return 0;
+}
+
+
+/*
+ * Load generator
+ */
+
+#define UH_BENCH_BUFSIZE	16384
+
+enum uh_bench_state {
+	UH_BENCH_CONNECT,
+	UH_BENCH_HANDSHAKE,
+	UH_BENCH_SEND,
+	UH_BENCH_HEADER,
+	UH_BENCH_BODY,
+	UH_BENCH_CHUNK_SIZE,
+	UH_BENCH_CHUNK_DATA,
+	UH_BENCH_CHUNK_END,
+	UH_BENCH_TRAILER,
+};
+
+struct uh_bench_conn {
+	struct uloop_fd fd;
+#ifdef HAVE_TLS
+	SSL *tls;
+#endif
+	enum uh_bench_state state;
+	uint64_t start;
+	bool reused;
+	bool close;
+	bool delimited;
+	long remaining;
+	int status;
+	int reqlen;
+	int reqoff;
+	char req[UH_LIMIT_MSGHEAD];
+	int len;
+	char buf[UH_BENCH_BUFSIZE];
+};
+
+static struct {
+	char *url;
+	char host[256];
+	char port[8];
+	char *path;
+	bool tls;
+	bool keepalive;
+	bool revalidate;
+	char *headers[16];
+	int n_headers;
+	int connections;
+	int total;
+	int issued;
+	int completed;
+	int errors;
+	int retries;
+	int status[5];
+	uint64_t bytes;
+	uint32_t *latency;
+	int n_latency;
+	char validator[160];
+	struct addrinfo *addr;
+	pid_t pids[16];
+	int n_pids;
+#ifdef HAVE_TLS
+	SSL_CTX *ctx;
+	SSL_SESSION *session;
+#endif
+} uh_bench_load_state;
+
+#define L uh_bench_load_state
+
+static void uh_bench_conn_cb(struct uloop_fd *u, unsigned int events);
+static bool uh_bench_conn_open(struct uh_bench_conn *c);
+
+/* read and write syscalls issued by the server processes so far, the
+ * kernel accounts them in syscr/syscw; other syscalls such as accept
+ * or epoll_wait are not visible there */
+static int64_t uh_bench_syscalls(void)
+{
+	int i;
+	int64_t n = 0, v;
+	char path[64], line[64];
+	FILE *f;
+
+	for (i = 0; i < L.n_pids; i++)
+	{
+		snprintf(path, sizeof(path), "/proc/%d/io", L.pids[i]);
+
+		if (!(f = fopen(path, "r")))
+			return -1;
+
+		while (fgets(line, sizeof(line), f))
+			if ((sscanf(line, "syscr: %" SCNd64, &v) == 1) ||
+				(sscanf(line, "syscw: %" SCNd64, &v) == 1))
+				n += v;
+
+		fclose(f);
+	}
+
+	return n;
+}
+
+static bool uh_bench_parse_url(char *url)
+{
+	char *host, *end;
+	int len;
+
+	if (!strncmp(url, "http://", 7))
+	{
+		host = url + 7;
+		strcpy(L.port, "80");
+	}
+	else if (!strncmp(url, "https://", 8))
+	{
+		host = url + 8;
+		strcpy(L.port, "443");
+		L.tls = true;
+	}
+	else
+	{
+		return false;
+	}
+
+	if ((L.path = strchr(host, '/')) != NULL)
+	{
+		len = L.path - host;
+	}
+	else
+	{
+		L.path = "/";
+		len = strlen(host);
+	}
+
+	/* [v6]:port, host:port or host */
+	if ((host[0] == '[') && (end = memchr(host, ']', len)) != NULL)
+	{
+		snprintf(L.host, sizeof(L.host), "%.*s", (int)(end - host - 1),
+				 host + 1);
+		end++;
+	}
+	else
+	{
+		for (end = host; (end < host + len) && (*end != ':'); end++);
+		snprintf(L.host, sizeof(L.host), "%.*s", (int)(end - host), host);
+	}
+
+	if ((end < host + len) && (*end == ':'))
+		snprintf(L.port, sizeof(L.port), "%.*s",
+				 (int)(host + len - end - 1), end + 1);
+
+	return (L.host[0] != 0);
+}
+
+static void uh_bench_request(struct uh_bench_conn *c)
+{
+	int i;
+
+	c->reqoff = 0;
+	c->reqlen = snprintf(c->req, sizeof(c->req),
+		"GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: uhttpd-bench\r\n%s",
+		L.path, L.host, L.keepalive ? "" : "Connection: close\r\n");
+
+	for (i = 0; i < L.n_headers; i++)
+		c->reqlen += snprintf(c->req + c->reqlen, sizeof(c->req) - c->reqlen,
+							  "%s\r\n", L.headers[i]);
+
+	if (L.revalidate && L.validator[0])
+		c->reqlen += snprintf(c->req + c->reqlen, sizeof(c->req) - c->reqlen,
+							  "%s\r\n", L.validator);
+
+	c->reqlen += snprintf(c->req + c->reqlen, sizeof(c->req) - c->reqlen,
+						  "\r\n");
+
+	c->len = 0;
+	c->state = UH_BENCH_SEND;
+	c->start = uh_metrics_now();
+
+	L.issued++;
+}
+
+static int uh_bench_recv(struct uh_bench_conn *c, char *buf, int len)
+{
+#ifdef HAVE_TLS
+	int rv;
+
+	if (c->tls)
+	{
+		if ((rv = SSL_read(c->tls, buf, len)) > 0)
+			return rv;
+
+		switch (SSL_get_error(c->tls, rv))
+		{
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				errno = EAGAIN;
+				return -1;
+
+			case SSL_ERROR_ZERO_RETURN:
+				return 0;
+
+			default:
+				errno = EIO;
+				return -1;
+		}
+	}
+#endif
+
+	return recv(c->fd.fd, buf, len, 0);
+}
+
+static int uh_bench_send(struct uh_bench_conn *c, const char *buf, int len)
+{
+#ifdef HAVE_TLS
+	int rv;
+
+	if (c->tls)
+	{
+		if ((rv = SSL_write(c->tls, buf, len)) > 0)
+			return rv;
+
+		switch (SSL_get_error(c->tls, rv))
+		{
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				errno = EAGAIN;
+				return -1;
+
+			default:
+				errno = EIO;
+				return -1;
+		}
+	}
+#endif
+
+	return send(c->fd.fd, buf, len, MSG_NOSIGNAL);
+}
+
+static void uh_bench_conn_close(struct uh_bench_conn *c)
+{
+	uloop_fd_delete(&c->fd);
+
+#ifdef HAVE_TLS
+	if (c->tls)
+	{
+		SSL_free(c->tls);
+		c->tls = NULL;
+	}
+#endif
+
+	close(c->fd.fd);
+	c->fd.fd = -1;
+}
+
+static void uh_bench_reconnect(struct uh_bench_conn *c)
+{
+	uh_bench_conn_close(c);
+
+	while ((L.issued < L.total) && !uh_bench_conn_open(c))
+		if (++L.completed >= L.total)
+			uloop_end();
+}
+
+static void uh_bench_finish(struct uh_bench_conn *c, bool ok)
+{
+	if (ok)
+	{
+		L.latency[L.n_latency++] = uh_metrics_now() - c->start;
+
+		if ((c->status >= 100) && (c->status < 600))
+			L.status[c->status / 100 - 1]++;
+	}
+	else
+	{
+		L.errors++;
+	}
+
+	if (++L.completed >= L.total)
+	{
+		uh_bench_conn_close(c);
+		uloop_end();
+		return;
+	}
+
+	if (L.issued >= L.total)
+	{
+		uh_bench_conn_close(c);
+		return;
+	}
+
+	/* continue on the same connection or reconnect */
+	if (ok && !c->close && L.keepalive)
+	{
+		c->reused = true;
+		uh_bench_request(c);
+		uloop_fd_add(&c->fd, ULOOP_WRITE);
+		return;
+	}
+
+	uh_bench_reconnect(c);
+}
+
+/* the server may close a persistent connection instead of answering the
+ * next request, e.g. to make room for new clients; it is sent again on a
+ * new connection like browsers do */
+static void uh_bench_retry(struct uh_bench_conn *c)
+{
+	uint64_t start = c->start;
+
+	L.retries++;
+	L.issued--;
+
+	uh_bench_reconnect(c);
+
+	if (c->fd.fd > -1)
+		c->start = start;
+}
+
+/* Classify the response header, the body is then skipped according to
+ * its framing */
+static bool uh_bench_response(struct uh_bench_conn *c, char *hdr)
+{
+	char *line, *next, *val;
+
+	if (strncmp(hdr, "HTTP/1.", 7) || (strlen(hdr) < 12))
+		return false;
+
+	c->status = atoi(hdr + 9);
+	c->close = (hdr[7] == '0');
+	c->delimited = false;
+	c->remaining = -1;
+	c->state = UH_BENCH_BODY;
+
+	for (line = strstr(hdr, "\r\n"); line && line[2]; line = next)
+	{
+		line += 2;
+
+		if ((next = strstr(line, "\r\n")) != NULL)
+			*next = 0;
+
+		if (!(val = strchr(line, ':')))
+			break;
+
+		for (*val++ = 0; *val == ' '; val++);
+
+		if (!strcasecmp(line, "Content-Length"))
+		{
+			c->remaining = atol(val);
+		}
+		else if (!strcasecmp(line, "Transfer-Encoding") &&
+				 strstr(val, "chunked"))
+		{
+			c->state = UH_BENCH_CHUNK_SIZE;
+		}
+		else if (!strcasecmp(line, "Connection"))
+		{
+			c->close = !strcasecmp(val, "close");
+		}
+		else if (L.revalidate && !L.validator[0] &&
+				 !strcasecmp(line, "ETag"))
+		{
+			snprintf(L.validator, sizeof(L.validator),
+					 "If-None-Match: %s", val);
+		}
+		else if (L.revalidate && !L.validator[0] &&
+				 !strcasecmp(line, "Last-Modified"))
+		{
+			snprintf(L.validator, sizeof(L.validator),
+					 "If-Modified-Since: %s", val);
+		}
+
+		if (!next)
+			break;
+	}
+
+	/* bodyless responses */
+	if ((c->status < 200) || (c->status == 204) || (c->status == 304))
+	{
+		c->state = UH_BENCH_BODY;
+		c->remaining = 0;
+	}
+
+	/* without length the body ends with the connection */
+	if ((c->state == UH_BENCH_BODY) && (c->remaining < 0))
+	{
+		c->delimited = true;
+		c->close = true;
+	}
+
+	return true;
+}
+
+static void uh_bench_consume(struct uh_bench_conn *c, int n)
+{
+	c->len -= n;
+	memmove(c->buf, c->buf + n, c->len);
+}
+
+/* Consume buffered response data, returns 1 when the response is
+ * complete, 0 if more data is needed and -1 on malformed input */
+static int uh_bench_parse(struct uh_bench_conn *c)
+{
+	int n;
+	char *eol;
+
+	while (true)
+	{
+		switch (c->state)
+		{
+			case UH_BENCH_HEADER:
+				if (!(eol = strfind(c->buf, c->len, "\r\n\r\n", 4)))
+					return (c->len >= sizeof(c->buf) - 1) ? -1 : 0;
+
+				eol[2] = 0;
+
+				if (!uh_bench_response(c, c->buf))
+					return -1;
+
+				uh_bench_consume(c, eol + 4 - c->buf);
+				break;
+
+			case UH_BENCH_BODY:
+				/* discarded until the connection closes */
+				if (c->delimited)
+				{
+					c->len = 0;
+					return 0;
+				}
+
+				n = min(c->remaining, c->len);
+				c->remaining -= n;
+				uh_bench_consume(c, n);
+
+				return !c->remaining;
+
+			case UH_BENCH_CHUNK_DATA:
+				n = min(c->remaining, c->len);
+				c->remaining -= n;
+				uh_bench_consume(c, n);
+
+				if (c->remaining)
+					return 0;
+
+				c->state = UH_BENCH_CHUNK_END;
+				break;
+
+			case UH_BENCH_CHUNK_SIZE:
+			case UH_BENCH_CHUNK_END:
+			case UH_BENCH_TRAILER:
+				if (!(eol = strfind(c->buf, c->len, "\r\n", 2)))
+					return (c->len >= sizeof(c->buf) - 1) ? -1 : 0;
+
+				n = eol + 2 - c->buf;
+
+				if (c->state == UH_BENCH_CHUNK_SIZE)
+				{
+					c->remaining = strtol(c->buf, NULL, 16);
+					c->state = c->remaining
+						? UH_BENCH_CHUNK_DATA : UH_BENCH_TRAILER;
+				}
+				else if (c->state == UH_BENCH_CHUNK_END)
+				{
+					c->state = UH_BENCH_CHUNK_SIZE;
+				}
+				else if (n == 2)
+				{
+					uh_bench_consume(c, n);
+					return 1;
+				}
+
+				uh_bench_consume(c, n);
+				break;
+
+			default:
+				return -1;
+		}
+	}
+}
+
+static void uh_bench_conn_cb(struct uloop_fd *u, unsigned int events)
+{
+	struct uh_bench_conn *c = container_of(u, struct uh_bench_conn, fd);
+	int rv, err;
+	socklen_t sl = sizeof(err);
+
+	switch (c->state)
+	{
+		case UH_BENCH_CONNECT:
+			if (getsockopt(c->fd.fd, SOL_SOCKET, SO_ERROR, &err, &sl) || err)
+				return uh_bench_finish(c, false);
+
+#ifdef HAVE_TLS
+			if (L.tls)
+			{
+				c->state = UH_BENCH_HANDSHAKE;
+
+				if (!(c->tls = SSL_new(L.ctx)))
+					return uh_bench_finish(c, false);
+
+				SSL_set_fd(c->tls, c->fd.fd);
+				SSL_set_connect_state(c->tls);
+
+#ifdef TLS_IS_OPENSSL
+				SSL_set_tlsext_host_name(c->tls, L.host);
+
+				/* resume like browsers do */
+				if (L.session)
+					SSL_set_session(c->tls, L.session);
+#endif
+			}
+			else
+#endif
+			{
+				c->state = UH_BENCH_SEND;
+			}
+
+			return uh_bench_conn_cb(u, events);
+
+#ifdef HAVE_TLS
+		case UH_BENCH_HANDSHAKE:
+			if ((rv = SSL_do_handshake(c->tls)) != 1)
+			{
+				switch (SSL_get_error(c->tls, rv))
+				{
+					case SSL_ERROR_WANT_READ:
+						uloop_fd_add(&c->fd, ULOOP_READ);
+						return;
+
+					case SSL_ERROR_WANT_WRITE:
+						uloop_fd_add(&c->fd, ULOOP_WRITE);
+						return;
+
+					default:
+						return uh_bench_finish(c, false);
+				}
+			}
+
+#ifdef TLS_IS_OPENSSL
+			if (!L.session)
+				L.session = SSL_get1_session(c->tls);
+#endif
+
+			c->state = UH_BENCH_SEND;
+			return uh_bench_conn_cb(u, events);
+#endif
+
+		case UH_BENCH_SEND:
+			while (c->reqoff < c->reqlen)
+			{
+				rv = uh_bench_send(c, c->req + c->reqoff,
+								   c->reqlen - c->reqoff);
+
+				if ((rv < 0) && (errno == EAGAIN))
+				{
+					uloop_fd_add(&c->fd, ULOOP_WRITE);
+					return;
+				}
+				else if (rv <= 0)
+				{
+					return uh_bench_finish(c, false);
+				}
+
+				c->reqoff += rv;
+			}
+
+			c->state = UH_BENCH_HEADER;
+			uloop_fd_add(&c->fd, ULOOP_READ);
+			return;
+
+		default:
+			while (true)
+			{
+				rv = uh_bench_recv(c, c->buf + c->len,
+								   sizeof(c->buf) - c->len - 1);
+
+				if ((rv < 0) && (errno == EAGAIN))
+					return;
+
+				if (!rv && (c->state == UH_BENCH_HEADER) && !c->len &&
+					c->reused)
+					return uh_bench_retry(c);
+
+				/* end of a close delimited body */
+				if (!rv && (c->state == UH_BENCH_BODY) && c->delimited)
+					return uh_bench_finish(c, true);
+
+				if (rv <= 0)
+					return uh_bench_finish(c, false);
+
+				L.bytes += rv;
+				c->len += rv;
+
+				if ((rv = uh_bench_parse(c)) != 0)
+					return uh_bench_finish(c, rv > 0);
+			}
+	}
+}
+
+static bool uh_bench_conn_open(struct uh_bench_conn *c)
+{
+	int sock;
+
+	uh_bench_request(c);
+
+	if ((sock = socket(L.addr->ai_family, SOCK_STREAM, 0)) < 0)
+	{
+		L.errors++;
+		return false;
+	}
+
+	fd_nonblock(sock);
+	fd_cloexec(sock);
+
+	if (connect(sock, L.addr->ai_addr, L.addr->ai_addrlen) &&
+		(errno != EINPROGRESS))
+	{
+		close(sock);
+		L.errors++;
+		return false;
+	}
+
+	c->state = UH_BENCH_CONNECT;
+	c->reused = false;
+	c->fd.fd = sock;
+	c->fd.cb = uh_bench_conn_cb;
+
+	uloop_fd_add(&c->fd, ULOOP_WRITE);
+
+	return true;
+}
+
+static int uh_bench_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void uh_bench_abort(struct uloop_timeout *t)
+{
+	uloop_end();
+}
+
+static int uh_bench_load(int argc, char **argv)
+{
+	int i, opt, timeout = 60;
+	int64_t sys_start, sys_end;
+	uint64_t start, elapsed;
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+	struct uloop_timeout deadline = { .cb = uh_bench_abort };
+	struct uh_bench_conn *conns;
+
+	L.connections = 8;
+	L.total = 1000;
+
+	while ((opt = getopt(argc, argv, "c:n:t:krH:p:")) > 0)
+	{
+		switch (opt)
+		{
+			case 'c':
+				L.connections = atoi(optarg);
+				break;
+
+			case 'n':
+				L.total = atoi(optarg);
+				break;
+
+			case 't':
+				timeout = atoi(optarg);
+				break;
+
+			case 'k':
+				L.keepalive = true;
+				break;
+
+			case 'r':
+				L.revalidate = true;
+				break;
+
+			case 'H':
+				if (L.n_headers < array_size(L.headers))
+					L.headers[L.n_headers++] = optarg;
+				break;
+
+			case 'p':
+				if (L.n_pids < array_size(L.pids))
+					L.pids[L.n_pids++] = atoi(optarg);
+				break;
+
+			default:
+				optind = argc;
+				break;
+		}
+	}
+
+	if (((argc - optind) != 1) || !uh_bench_parse_url(argv[optind]) ||
+		(L.connections < 1) || (L.total < 1))
+	{
+		fprintf(stderr,
+			"Usage: uhttpd-bench load [options] url\n"
+			"	-c count        Concurrent connections, default is 8\n"
+			"	-n count        Total requests, default is 1000\n"
+			"	-t seconds      Abort the run after given time, default is 60\n"
+			"	-k              Reuse connections (keep-alive)\n"
+			"	-r              Revalidate with the validator of the first response\n"
+			"	-H header       Send additional header, multiple allowed\n"
+			"	-p pid          Sample read/write syscalls of a server process,\n"
+			"	                multiple allowed\n"
+			"\n");
+		return 1;
+	}
+
+	L.url = argv[optind];
+
+#ifdef HAVE_TLS
+	if (L.tls)
+	{
+		SSL_load_error_strings();
+		SSL_library_init();
+
+		if (!(L.ctx = SSL_CTX_new(SSLv23_client_method())))
+		{
+			fprintf(stderr, "Error: Cannot create TLS context\n");
+			return 1;
+		}
+
+		SSL_CTX_set_verify(L.ctx, SSL_VERIFY_NONE, NULL);
+	}
+#else
+	if (L.tls)
+	{
+		fprintf(stderr, "Error: Built without TLS support\n");
+		return 1;
+	}
+#endif
+
+	if ((i = getaddrinfo(L.host, L.port, &hints, &L.addr)) != 0)
+	{
+		fprintf(stderr, "Error: Cannot resolve %s: %s\n",
+				L.host, gai_strerror(i));
+		return 1;
+	}
+
+	if (L.connections > L.total)
+		L.connections = L.total;
+
+	conns = calloc(L.connections, sizeof(*conns));
+	L.latency = calloc(L.total, sizeof(*L.latency));
+
+	if (!conns || !L.latency)
+	{
+		fprintf(stderr, "Error: Out of memory\n");
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	uloop_init();
+
+	if (timeout > 0)
+		uloop_timeout_set(&deadline, timeout * 1000);
+
+	sys_start = uh_bench_syscalls();
+	start = uh_metrics_now();
+
+	for (i = 0; i < L.connections; i++)
+		while ((L.issued < L.total) && !uh_bench_conn_open(&conns[i]))
+			L.completed++;
+
+	if (L.completed < L.total)
+		uloop_run();
+
+	elapsed = uh_metrics_now() - start;
+	sys_end = uh_bench_syscalls();
+
+	qsort(L.latency, L.n_latency, sizeof(*L.latency), uh_bench_cmp);
+
+	printf("{\"bench\":\"load\",\"url\":");
+	uh_bench_json_str(L.url);
+	printf(",\"connections\":%d,\"keepalive\":%s,\"revalidate\":%s,"
+		   "\"tls\":%s,\"requests\":%d,\"completed\":%d,\"errors\":%d,"
+		   "\"retries\":%d,\"aborted\":%s,",
+		   L.connections, L.keepalive ? "true" : "false",
+		   L.revalidate ? "true" : "false", L.tls ? "true" : "false",
+		   L.total, L.n_latency, L.errors, L.retries,
+		   (L.completed < L.total) ? "true" : "false");
+
+	printf("\"status\":{\"1xx\":%d,\"2xx\":%d,\"3xx\":%d,\"4xx\":%d,"
+		   "\"5xx\":%d},",
+		   L.status[0], L.status[1], L.status[2], L.status[3], L.status[4]);
+
+	printf("\"seconds\":%.3f,\"requests_per_sec\":%.1f,"
+		   "\"bytes_per_sec\":%.0f,",
+		   elapsed / 1e6,
+		   elapsed ? L.n_latency * 1e6 / elapsed : 0.0,
+		   elapsed ? L.bytes * 1e6 / elapsed : 0.0);
+
+	printf("\"latency_us\":{\"p50\":%u,\"p99\":%u,\"max\":%u},",
+		   L.n_latency ? L.latency[(L.n_latency - 1) / 2] : 0,
+		   L.n_latency ? L.latency[(L.n_latency - 1) * 99 / 100] : 0,
+		   L.n_latency ? L.latency[L.n_latency - 1] : 0);
+
+	if ((sys_start >= 0) && (sys_end >= 0) && L.n_pids && L.n_latency)
+		printf("\"server_rw_syscalls_per_request\":%.2f}\n",
+			   (double)(sys_end - sys_start) / L.n_latency);
+	else
+		printf("\"server_rw_syscalls_per_request\":null}\n");
+
+	freeaddrinfo(L.addr);
+
+	return (L.errors || (L.completed < L.total)) ? 2 : 0;
+}
+
+#undef L
+
+
+int main(int argc, char **argv)
+{
+	if ((argc > 1) && !strcmp(argv[1], "micro"))
+		return uh_bench_micro(argc - 1, argv + 1);
+
+	if ((argc > 1) && !strcmp(argv[1], "load"))
+		return uh_bench_load(argc - 1, argv + 1);
+
+	fprintf(stderr,
+		"Usage: %s micro [-n iterations] [-r rounds] [name ...]\n"
+		"       %s load [-c conns] [-n requests] [-k] [-r] [-p pid] url\n"
+		"\n"
+		"Results are printed as one JSON object per line.\n"
+		"Covers static files, 304 responses (-r), CGI urls, keep-alive (-k)\n"
+		"and TLS (https:// urls).\n", argv[0], argv[0]);
+
+	return 1;
+}
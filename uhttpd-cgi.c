@@ -16,9 +16,16 @@
  *  limitations under the License.
  */
 
+#define _GNU_SOURCE /* posix_spawn_file_actions_addchdir_np() */
+
 #include "uhttpd.h"
 #include "uhttpd-utils.h"
 #include "uhttpd-cgi.h"
+#include "uhttpd-metrics.h"
+
+#ifdef HAVE_ZLIB
+#include "uhttpd-deflate.h"
+#endif
 
 
 static bool
@@ -131,17 +138,332 @@ static void uh_cgi_shutdown(struct uh_cgi_state *state)
 	free(state);
 }
 
+/* variables which are the same for every request */
+void uh_cgi_env_common(struct config *conf, uh_cgi_env_cb cb, void *priv)
+{
+	cb(priv, "GATEWAY_INTERFACE", "CGI/1.1");
+	cb(priv, "SERVER_SOFTWARE", "uHTTPd");
+	cb(priv, "PATH", "/sbin:/usr/sbin:/bin:/usr/bin");
+	cb(priv, "DOCUMENT_ROOT", conf->docroot);
+}
+
+void uh_cgi_env(struct client *cl, struct path_info *pi,
+				uh_cgi_env_cb cb, void *priv)
+{
+	int i;
+	struct http_request *req = &cl->request;
+
+	static const struct {
+		int field;
+		const char *name;
+	} vars[] = {
+		{ UH_HTTP_HDR_ACCEPT,           "HTTP_ACCEPT"          },
+		{ UH_HTTP_HDR_ACCEPT_CHARSET,   "HTTP_ACCEPT_CHARSET"  },
+		{ UH_HTTP_HDR_ACCEPT_ENCODING,  "HTTP_ACCEPT_ENCODING" },
+		{ UH_HTTP_HDR_ACCEPT_LANGUAGE,  "HTTP_ACCEPT_LANGUAGE" },
+		{ UH_HTTP_HDR_AUTHORIZATION,    "HTTP_AUTHORIZATION"   },
+		{ UH_HTTP_HDR_CONNECTION,       "HTTP_CONNECTION"      },
+		{ UH_HTTP_HDR_COOKIE,           "HTTP_COOKIE"          },
+		{ UH_HTTP_HDR_HOST,             "HTTP_HOST"            },
+		{ UH_HTTP_HDR_REFERER,          "HTTP_REFERER"         },
+		{ UH_HTTP_HDR_USER_AGENT,       "HTTP_USER_AGENT"      },
+		{ UH_HTTP_HDR_CONTENT_TYPE,     "CONTENT_TYPE"         },
+		{ UH_HTTP_HDR_CONTENT_LENGTH,   "CONTENT_LENGTH"       },
+	};
+
+#ifdef HAVE_TLS
+	/* https? */
+	if (cl->tls)
+		cb(priv, "HTTPS", "on");
+#endif
+
+	/* addresses */
+	cb(priv, "SERVER_NAME", sa_straddr(&cl->servaddr));
+	cb(priv, "SERVER_ADDR", sa_straddr(&cl->servaddr));
+	cb(priv, "SERVER_PORT", sa_strport(&cl->servaddr));
+	cb(priv, "REMOTE_HOST", sa_straddr(&cl->peeraddr));
+	cb(priv, "REMOTE_ADDR", sa_straddr(&cl->peeraddr));
+	cb(priv, "REMOTE_PORT", sa_strport(&cl->peeraddr));
+
+	/* path information */
+	cb(priv, "SCRIPT_NAME", pi->name);
+	cb(priv, "SCRIPT_FILENAME", pi->phys);
+	cb(priv, "QUERY_STRING", pi->query ? pi->query : "");
+
+	if (pi->info)
+		cb(priv, "PATH_INFO", pi->info);
+
+	/* REDIRECT_STATUS, php-cgi wants it */
+	switch (req->redirect_status)
+	{
+		case 404:
+			cb(priv, "REDIRECT_STATUS", "404");
+			break;
+
+		default:
+			cb(priv, "REDIRECT_STATUS", "200");
+			break;
+	}
+
+	/* http version */
+	cb(priv, "SERVER_PROTOCOL", http_versions[req->version]);
+
+	/* request method */
+	cb(priv, "REQUEST_METHOD", http_methods[req->method]);
+
+	/* request url */
+	cb(priv, "REQUEST_URI", req->url);
+
+	/* remote user */
+	if (req->realm)
+		cb(priv, "REMOTE_USER", req->realm->user);
+
+	/* request message headers, indexed by the parser */
+	for (i = 0; i < array_size(vars); i++)
+		if (req->fields[vars[i].field])
+			cb(priv, vars[i].name, req->fields[vars[i].field]);
+}
+
+int uh_cgi_relay(struct client *cl, struct uh_cgi_state *state,
+				 const char *buf, int len)
+{
+	int i, n, rest, blen, hdroff;
+	char *clen;
+	const char *coding = NULL;
+
+	struct http_response *res = &cl->response;
+	struct http_request *req = &cl->request;
+
+	/* headers complete, pass through buffer to socket */
+	if (state->header_sent)
+	{
+		D("CGI: Client(%d) relaying %d normal bytes\n", cl->fd.fd, len);
+		return uh_http_send(cl, req, buf, len);
+	}
+
+	/* we have not pushed out headers yet, try to parse input ... */
+	n = min(len, state->httpbuf.len);
+
+	memcpy(state->httpbuf.ptr, buf, n);
+	state->httpbuf.len -= n;
+	state->httpbuf.ptr += n;
+
+	blen = state->httpbuf.ptr - state->httpbuf.buf;
+
+	if (uh_cgi_header_parse(res, state->httpbuf.buf, blen, &hdroff))
+	{
+		clen = uh_cgi_header_lookup(res, "Content-Length");
+
+#ifdef HAVE_ZLIB
+		/* compress the output unless the program encoded it itself, it
+		 * is sent chunked then and can not be relayed as-is */
+		if (!uh_cgi_header_lookup(res, "Transfer-Encoding") &&
+			!uh_cgi_header_lookup(res, "Content-Encoding"))
+			coding = uh_deflate_start(cl,
+				uh_cgi_header_lookup(res, "Content-Type"),
+				clen ? atoi(clen) : -1);
+#endif
+
+		/* output is relayed with chunked encoding applied on top,
+		 * the framing is unreliable if the program did its own */
+		if (uh_cgi_header_lookup(res, "Transfer-Encoding"))
+			cl->keepalive = false;
+
+		/* the body can be relayed as-is if the program announced its
+		 * length or the connection is closed afterwards anyway */
+		else if (state->splice && !coding && clen)
+		{
+			state->relay = true;
+			state->length = atoi(clen);
+		}
+
+		else if (state->splice && !coding &&
+				 (!cl->keepalive || (req->version < UH_HTTP_VER_1_1)))
+		{
+			state->relay = true;
+			cl->keepalive = false;
+		}
+
+		/* collect the header, it is sent along with the first data */
+		uh_tcp_cork(cl);
+
+		/* write status */
+		ensure_ret(uh_http_sendf(cl, NULL,
+			"%s %03d %s\r\n"
+			"Connection: %s\r\n",
+			http_versions[req->version],
+			res->statuscode, res->statusmsg,
+			uh_http_connection(cl)));
+
+		/* add Content-Type if no Location or Content-Type */
+		if (!uh_cgi_header_lookup(res, "Location") &&
+			!uh_cgi_header_lookup(res, "Content-Type"))
+		{
+			ensure_ret(uh_http_send(cl, NULL,
+				"Content-Type: text/plain\r\n", -1));
+		}
+
+		/* if request was HTTP 1.1 we'll respond chunked */
+		if ((req->version > UH_HTTP_VER_1_0) && !state->relay &&
+			!uh_cgi_header_lookup(res, "Transfer-Encoding"))
+		{
+			ensure_ret(uh_http_send(cl, NULL,
+				"Transfer-Encoding: chunked\r\n", -1));
+		}
+
+		if (coding)
+		{
+			ensure_ret(uh_http_sendf(cl, NULL,
+				"Content-Encoding: %s\r\n"
+				"Vary: Accept-Encoding\r\n", coding));
+		}
+
+		/* write headers from CGI program, the announced length is
+		 * that of the uncompressed body */
+		foreach_header(i, res->headers)
+		{
+			if (coding && !strcasecmp(res->headers[i], "Content-Length"))
+				continue;
+
+			ensure_ret(uh_http_sendf(cl, NULL, "%s: %s\r\n",
+				res->headers[i], res->headers[i+1]));
+		}
+
+		/* terminate header */
+		ensure_ret(uh_http_send(cl, NULL, "\r\n", -1));
+
+		state->header_sent = true;
+
+		/* push out remaining head buffer, not more than announced */
+		if (hdroff < blen)
+		{
+			rest = blen - hdroff;
+
+			if (state->relay && (state->length >= 0))
+			{
+				rest = min(rest, state->length);
+				state->length -= rest;
+			}
+
+			D("CGI: Client(%d) relaying %d rest bytes\n", cl->fd.fd, rest);
+
+			ensure_ret(uh_http_send(cl, state->relay ? NULL : req,
+			                        state->httpbuf.buf + hdroff, rest));
+		}
+	}
+
+	/* ... failed and head buffer exceeded */
+	else if (!state->httpbuf.len)
+	{
+		/* I would do this ...
+		 *
+		 *    uh_cgi_error_500(cl, req,
+		 *        "The CGI program generated an "
+		 *        "invalid response:\n\n");
+		 *
+		 * ... but in order to stay as compatible as possible,
+		 * treat whatever we got as text/plain response and
+		 * build the required headers here.
+		 */
+
+		uh_tcp_cork(cl);
+
+		ensure_ret(uh_http_sendf(cl, NULL,
+								 "%s 200 OK\r\n"
+								 "Connection: %s\r\n"
+								 "Content-Type: text/plain\r\n"
+								 "%s\r\n",
+								 http_versions[req->version],
+								 uh_http_connection(cl),
+								 (req->version > UH_HTTP_VER_1_0)
+								 ? "Transfer-Encoding: chunked\r\n" : ""
+		));
+
+		state->header_sent = true;
+
+		D("CGI: Client(%d) relaying %d invalid bytes\n", cl->fd.fd, blen);
+
+		ensure_ret(uh_http_send(cl, req, state->httpbuf.buf, blen));
+	}
+
+	/* header still incomplete */
+	else
+	{
+		return 0;
+	}
+
+	/* data beyond the head buffer */
+	if (n < len)
+		ensure_ret(uh_http_send(cl, req, buf + n, len - n));
+
+	return uh_tcp_uncork(cl, false);
+}
+
+void uh_cgi_finish(struct client *cl, struct uh_cgi_state *state)
+{
+	if (!state->header_sent)
+	{
+		if (cl->timeout.pending)
+			uh_http_sendhf(cl, 502, "Bad Gateway",
+						   "The CGI process did not produce any response\n");
+		else
+			uh_http_sendhf(cl, 504, "Gateway Timeout",
+						   "The CGI process took too long to produce a "
+						   "response\n");
+	}
+	/* relayed body ended before the announced length */
+	else if (state->relay)
+	{
+		if (state->length > 0)
+			cl->keepalive = false;
+	}
+	else
+	{
+		uh_http_send(cl, &cl->request, "", 0);
+	}
+}
+
 static bool uh_cgi_socket_cb(struct client *cl)
 {
-	int i, len, blen, hdroff;
+	int len = 0;
 	char buf[UH_LIMIT_MSGHEAD];
 
 	struct uh_cgi_state *state = (struct uh_cgi_state *)cl->priv;
-	struct http_response *res = &cl->response;
 	struct http_request *req = &cl->request;
 
+#ifdef HAVE_SPLICE
+	/* move post data from the socket to the child, waiting for whichever
+	 * side is not ready */
+	while (state->splice && (state->content_length > 0))
+	{
+		len = uh_tcp_splice_in(cl, min(state->content_length,
+		                               UH_LIMIT_SPLICE));
+
+		if ((len < 0) && (errno == EAGAIN))
+			break;
+
+		/* client closed or child does not read, the remaining body
+		 * is left unread and the connection not reused */
+		if (len <= 0)
+		{
+			state->content_length = 0;
+			uh_ufd_remove(&cl->wpipe);
+			break;
+		}
+
+		state->content_length -= len;
+
+		/* explicit EOF notification for the child */
+		if (state->content_length <= 0)
+		{
+			uh_ufd_remove(&cl->wpipe);
+			req->content_length = 0;
+		}
+	}
+#endif
+
 	/* there is unread post data waiting */
-	while (state->content_length > 0)
+	while (!state->splice && (state->content_length > 0))
 	{
 		/* remaining data in http head buffer ... */
 		if (cl->httpbuf.len > 0)
@@ -180,110 +502,56 @@ static bool uh_cgi_socket_cb(struct client *cl)
 
 		/* explicit EOF notification for the child */
 		if (state->content_length <= 0)
+		{
 			uh_ufd_remove(&cl->wpipe);
+			req->content_length = 0;
+		}
 	}
 
-	/* try to read data from child */
-	while ((len = uh_raw_recv(cl->rpipe.fd, buf, state->header_sent
-	                          ? sizeof(buf) : state->httpbuf.len, -1)) > 0)
+	/* try to read data from child, while the header is incomplete not
+	 * more than fits into the head buffer */
+	while (!state->relay &&
+	       !uh_client_congested(cl) &&
+	       ((len = uh_raw_recv(cl->rpipe.fd, buf, state->header_sent
+	                           ? sizeof(buf) : state->httpbuf.len, -1)) > 0))
 	{
-		/* we have not pushed out headers yet, parse input */
-		if (!state->header_sent)
-		{
-			/* try to parse header ... */
-			memcpy(state->httpbuf.ptr, buf, len);
-			state->httpbuf.len -= len;
-			state->httpbuf.ptr += len;
+		ensure_out(uh_cgi_relay(cl, state, buf, len));
+	}
 
-			blen = state->httpbuf.ptr - state->httpbuf.buf;
+#ifdef HAVE_SPLICE
+	/* headers are out, move the remaining output within the kernel */
+	if (state->relay)
+	{
+		while (state->length)
+		{
+			len = uh_tcp_splice(cl, (state->length > 0)
+			                    ? min(state->length, UH_LIMIT_SPLICE)
+			                    : UH_LIMIT_SPLICE);
 
-			if (uh_cgi_header_parse(res, state->httpbuf.buf, blen, &hdroff))
+			if (len <= 0)
 			{
-				/* write status */
-				ensure_out(uh_http_sendf(cl, NULL,
-					"%s %03d %s\r\n"
-					"Connection: close\r\n",
-					http_versions[req->version],
-					res->statuscode, res->statusmsg));
-
-				/* add Content-Type if no Location or Content-Type */
-				if (!uh_cgi_header_lookup(res, "Location") &&
-					!uh_cgi_header_lookup(res, "Content-Type"))
-				{
-					ensure_out(uh_http_send(cl, NULL,
-						"Content-Type: text/plain\r\n", -1));
-				}
+				if ((len < 0) && (errno == EAGAIN))
+					return true;
 
-				/* if request was HTTP 1.1 we'll respond chunked */
-				if ((req->version > UH_HTTP_VER_1_0) &&
-					!uh_cgi_header_lookup(res, "Transfer-Encoding"))
-				{
-					ensure_out(uh_http_send(cl, NULL,
-						"Transfer-Encoding: chunked\r\n", -1));
-				}
+				D("CGI: Child(%d) presumed dead [%s]\n",
+				  cl->proc.pid, len ? strerror(errno) : "EOF");
 
-				/* write headers from CGI program */
-				foreach_header(i, res->headers)
-				{
-					ensure_out(uh_http_sendf(cl, NULL, "%s: %s\r\n",
-						res->headers[i], res->headers[i+1]));
-				}
-
-				/* terminate header */
-				ensure_out(uh_http_send(cl, NULL, "\r\n", -1));
-
-				state->header_sent = true;
-
-				/* push out remaining head buffer */
-				if (hdroff < blen)
-				{
-					D("CGI: Child(%d) relaying %d rest bytes\n",
-					  cl->proc.pid, blen - hdroff);
-
-					ensure_out(uh_http_send(cl, req,
-					                        state->httpbuf.buf + hdroff,
-					                        blen - hdroff));
-				}
+				goto out;
 			}
 
-			/* ... failed and head buffer exceeded */
-			else if (!state->httpbuf.len)
-			{
-				/* I would do this ...
-				 *
-				 *    uh_cgi_error_500(cl, req,
-				 *        "The CGI program generated an "
-				 *        "invalid response:\n\n");
-				 *
-				 * ... but in order to stay as compatible as possible,
-				 * treat whatever we got as text/plain response and
-				 * build the required headers here.
-				 */
-
-				ensure_out(uh_http_sendf(cl, NULL,
-										 "%s 200 OK\r\n"
-										 "Content-Type: text/plain\r\n"
-										 "%s\r\n",
-										 http_versions[req->version],
-										 (req->version > UH_HTTP_VER_1_0)
-										 ? "Transfer-Encoding: chunked\r\n" : ""
-				));
-
-				state->header_sent = true;
-
-				D("CGI: Child(%d) relaying %d invalid bytes\n",
-				  cl->proc.pid, len);
-
-				ensure_out(uh_http_send(cl, req, buf, len));
-			}
-		}
-		else
-		{
-			/* headers complete, pass through buffer to socket */
-			D("CGI: Child(%d) relaying %d normal bytes\n", cl->proc.pid, len);
-			ensure_out(uh_http_send(cl, req, buf, len));
+			if (state->length > 0)
+				state->length -= len;
 		}
+
+		/* announced length relayed, any further output is dropped */
+		goto out;
 	}
+#endif
+
+
+	/* output queue is full, continue once the client caught up */
+	if (uh_client_congested(cl))
+		return true;
 
 	/* got EOF or read error from child */
 	if ((len == 0) ||
@@ -297,37 +565,104 @@ static bool uh_cgi_socket_cb(struct client *cl)
 	return true;
 
 out:
-	if (!state->header_sent)
+	uh_cgi_finish(cl, state);
+	uh_cgi_shutdown(state);
+	return false;
+}
+
+static void uh_cgi_envp_add(void *priv, const char *name, const char *value)
+{
+	struct uh_cgi_envp *env = priv;
+	int len = strlen(name) + strlen(value) + 2;
+
+	if ((env->count >= UH_CGI_ENV_MAX) ||
+		(env->len + len > sizeof(env->arena)))
 	{
-		if (cl->timeout.pending)
-			uh_http_sendhf(cl, 502, "Bad Gateway",
-						   "The CGI process did not produce any response\n");
-		else
-			uh_http_sendhf(cl, 504, "Gateway Timeout",
-						   "The CGI process took too long to produce a "
-						   "response\n");
+		D("CGI: Environment limits exceeded, dropping %s\n", name);
+
+		env->overflow = true;
+		return;
 	}
-	else
+
+	env->vars[env->count++] = env->arena + env->len;
+	env->len += snprintf(env->arena + env->len, len, "%s=%s", name, value) + 1;
+}
+
+/* assemble the child environment in the parent, the invariant part is
+ * only built once and referenced from every request environment */
+static bool uh_cgi_envp(struct client *cl, struct path_info *pi,
+						struct uh_cgi_envp *env)
+{
+	static struct uh_cgi_envp *common = NULL;
+
+	if (!common)
 	{
-		uh_http_send(cl, req, "", 0);
+		if (!(common = calloc(1, sizeof(*common))))
+			return false;
+
+		uh_cgi_env_common(cl->server->conf, uh_cgi_envp_add, common);
 	}
 
-	uh_cgi_shutdown(state);
-	return false;
+	memcpy(env->vars, common->vars, common->count * sizeof(common->vars[0]));
+
+	env->count = common->count;
+	env->len = 0;
+	env->overflow = false;
+
+	uh_cgi_env(cl, pi, uh_cgi_envp_add, env);
+
+	env->vars[env->count] = NULL;
+
+	return !env->overflow;
 }
 
 bool uh_cgi_request(struct client *cl, struct path_info *pi,
 					struct interpreter *ip)
 {
-	int i;
-
-	int rfd[2] = { 0, 0 };
-	int wfd[2] = { 0, 0 };
+	int rfd[2] = { -1, -1 };
+	int wfd[2] = { -1, -1 };
 
 	pid_t child;
+	char *argv[3];
+	struct uh_cgi_envp env;
+
+#ifdef HAVE_SPAWN_CHDIR
+	int err;
+	posix_spawn_file_actions_t fa;
+#endif
 
 	struct uh_cgi_state *state;
 	struct http_request *req = &cl->request;
+	uint64_t spawned;
+
+	/* check for regular, world-executable file _or_ interpreter */
+	if (!((pi->stat.st_mode & S_IFREG) && (pi->stat.st_mode & S_IXOTH)) &&
+		(ip == NULL))
+	{
+		uh_http_sendhf(cl, 403, "Forbidden",
+					   "Access to this resource is forbidden\n");
+		return false;
+	}
+
+	/* build environment */
+	if (!uh_cgi_envp(cl, pi, &env))
+	{
+		uh_http_sendhf(cl, 500, "Internal Server Error",
+					   "The request exceeds the CGI environment limits\n");
+		return false;
+	}
+
+	if (ip != NULL)
+	{
+		argv[0] = ip->path;
+		argv[1] = pi->phys;
+		argv[2] = NULL;
+	}
+	else
+	{
+		argv[0] = pi->phys;
+		argv[1] = NULL;
+	}
 
 	/* allocate state */
 	if (!(state = malloc(sizeof(*state))))
@@ -339,10 +674,12 @@ bool uh_cgi_request(struct client *cl, struct path_info *pi,
 	/* spawn pipes for me->child, child->me */
 	if ((pipe(rfd) < 0) || (pipe(wfd) < 0))
 	{
-		if (rfd[0] > 0) close(rfd[0]);
-		if (rfd[1] > 0) close(rfd[1]);
-		if (wfd[0] > 0) close(wfd[0]);
-		if (wfd[1] > 0) close(wfd[1]);
+		if (rfd[0] > -1) close(rfd[0]);
+		if (rfd[1] > -1) close(rfd[1]);
+		if (wfd[0] > -1) close(wfd[0]);
+		if (wfd[1] > -1) close(wfd[1]);
+
+		free(state);
 
 		uh_http_sendhf(cl, 500, "Internal Server Error",
 						"Failed to create pipe: %s\n", strerror(errno));
@@ -350,11 +687,54 @@ bool uh_cgi_request(struct client *cl, struct path_info *pi,
 		return false;
 	}
 
+	/* none of the pipe ends may leak into the child, the file actions
+	 * move the child ends to stdin and stdout */
+	fd_cloexec(rfd[0]);
+	fd_cloexec(rfd[1]);
+	fd_cloexec(wfd[0]);
+	fd_cloexec(wfd[1]);
+
+	spawned = uh_metrics_now();
+
+#ifdef HAVE_SPAWN_CHDIR
+	/* spawn the child without duplicating our address space */
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, rfd[1], 1);
+	posix_spawn_file_actions_adddup2(&fa, wfd[0], 0);
+	posix_spawn_file_actions_addchdir_np(&fa, pi->root);
+
+	err = posix_spawn(&child, argv[0], &fa, NULL, argv, env.vars);
+
+	posix_spawn_file_actions_destroy(&fa);
+
+	if (err)
+	{
+		close(rfd[0]);
+		close(rfd[1]);
+		close(wfd[0]);
+		close(wfd[1]);
+
+		free(state);
+
+		uh_http_sendhf(cl, 500, "Internal Server Error",
+					   "Unable to launch the requested CGI program:\n"
+					   "  %s: %s\n", argv[0], strerror(err));
+
+		return false;
+	}
+#else
 	/* fork off child process */
 	switch ((child = fork()))
 	{
 	/* oops */
 	case -1:
+		close(rfd[0]);
+		close(rfd[1]);
+		close(wfd[0]);
+		close(wfd[1]);
+
+		free(state);
+
 		uh_http_sendhf(cl, 500, "Internal Server Error",
 						"Failed to fork child: %s\n", strerror(errno));
 
@@ -366,191 +746,58 @@ bool uh_cgi_request(struct client *cl, struct path_info *pi,
 		sleep(atoi(getenv("UHTTPD_SLEEP_ON_FORK") ?: "0"));
 #endif
 
-		/* do not leak parent epoll descriptor */
-		uloop_done();
-
-		/* close loose pipe ends */
-		close(rfd[0]);
-		close(wfd[1]);
-
 		/* patch stdout and stdin to pipes */
 		dup2(rfd[1], 1);
 		dup2(wfd[0], 0);
 
-		/* avoid leaking our pipe into child-child processes */
-		fd_cloexec(rfd[1]);
-		fd_cloexec(wfd[0]);
-
-		/* check for regular, world-executable file _or_ interpreter */
-		if (((pi->stat.st_mode & S_IFREG) &&
-			 (pi->stat.st_mode & S_IXOTH)) || (ip != NULL))
-		{
-			/* build environment */
-			clearenv();
-
-			/* common information */
-			setenv("GATEWAY_INTERFACE", "CGI/1.1", 1);
-			setenv("SERVER_SOFTWARE", "uHTTPd", 1);
-			setenv("PATH", "/sbin:/usr/sbin:/bin:/usr/bin", 1);
-
-#ifdef HAVE_TLS
-			/* https? */
-			if (cl->tls)
-				setenv("HTTPS", "on", 1);
-#endif
-
-			/* addresses */
-			setenv("SERVER_NAME", sa_straddr(&cl->servaddr), 1);
-			setenv("SERVER_ADDR", sa_straddr(&cl->servaddr), 1);
-			setenv("SERVER_PORT", sa_strport(&cl->servaddr), 1);
-			setenv("REMOTE_HOST", sa_straddr(&cl->peeraddr), 1);
-			setenv("REMOTE_ADDR", sa_straddr(&cl->peeraddr), 1);
-			setenv("REMOTE_PORT", sa_strport(&cl->peeraddr), 1);
-
-			/* path information */
-			setenv("SCRIPT_NAME", pi->name, 1);
-			setenv("SCRIPT_FILENAME", pi->phys, 1);
-			setenv("DOCUMENT_ROOT", pi->root, 1);
-			setenv("QUERY_STRING", pi->query ? pi->query : "", 1);
-
-			if (pi->info)
-				setenv("PATH_INFO", pi->info, 1);
-
-			/* REDIRECT_STATUS, php-cgi wants it */
-			switch (req->redirect_status)
-			{
-				case 404:
-					setenv("REDIRECT_STATUS", "404", 1);
-					break;
-
-				default:
-					setenv("REDIRECT_STATUS", "200", 1);
-					break;
-			}
-
-			/* http version */
-			setenv("SERVER_PROTOCOL", http_versions[req->version], 1);
-
-			/* request method */
-			setenv("REQUEST_METHOD", http_methods[req->method], 1);
-
-			/* request url */
-			setenv("REQUEST_URI", req->url, 1);
-
-			/* remote user */
-			if (req->realm)
-				setenv("REMOTE_USER", req->realm->user, 1);
-
-			/* request message headers */
-			foreach_header(i, req->headers)
-			{
-				if (!strcasecmp(req->headers[i], "Accept"))
-					setenv("HTTP_ACCEPT", req->headers[i+1], 1);
-
-				else if (!strcasecmp(req->headers[i], "Accept-Charset"))
-					setenv("HTTP_ACCEPT_CHARSET", req->headers[i+1], 1);
-
-				else if (!strcasecmp(req->headers[i], "Accept-Encoding"))
-					setenv("HTTP_ACCEPT_ENCODING", req->headers[i+1], 1);
-
-				else if (!strcasecmp(req->headers[i], "Accept-Language"))
-					setenv("HTTP_ACCEPT_LANGUAGE", req->headers[i+1], 1);
-
-				else if (!strcasecmp(req->headers[i], "Authorization"))
-					setenv("HTTP_AUTHORIZATION", req->headers[i+1], 1);
-
-				else if (!strcasecmp(req->headers[i], "Connection"))
-					setenv("HTTP_CONNECTION", req->headers[i+1], 1);
-
-				else if (!strcasecmp(req->headers[i], "Cookie"))
-					setenv("HTTP_COOKIE", req->headers[i+1], 1);
-
-				else if (!strcasecmp(req->headers[i], "Host"))
-					setenv("HTTP_HOST", req->headers[i+1], 1);
-
-				else if (!strcasecmp(req->headers[i], "Referer"))
-					setenv("HTTP_REFERER", req->headers[i+1], 1);
-
-				else if (!strcasecmp(req->headers[i], "User-Agent"))
-					setenv("HTTP_USER_AGENT", req->headers[i+1], 1);
+		/* execute child code ... */
+		if (chdir(pi->root))
+			perror("chdir()");
 
-				else if (!strcasecmp(req->headers[i], "Content-Type"))
-					setenv("CONTENT_TYPE", req->headers[i+1], 1);
+		execve(argv[0], argv, env.vars);
 
-				else if (!strcasecmp(req->headers[i], "Content-Length"))
-					setenv("CONTENT_LENGTH", req->headers[i+1], 1);
-			}
-
-
-			/* execute child code ... */
-			if (chdir(pi->root))
-				perror("chdir()");
-
-			if (ip != NULL)
-				execl(ip->path, ip->path, pi->phys, NULL);
-			else
-				execl(pi->phys, pi->phys, NULL);
-
-			/* in case it fails ... */
-			printf("Status: 500 Internal Server Error\r\n\r\n"
-				   "Unable to launch the requested CGI program:\n"
-				   "  %s: %s\n", ip ? ip->path : pi->phys, strerror(errno));
-		}
-
-		/* 403 */
-		else
-		{
-			printf("Status: 403 Forbidden\r\n\r\n"
-				   "Access to this resource is forbidden\n");
-		}
+		/* in case it fails ... */
+		printf("Status: 500 Internal Server Error\r\n\r\n"
+			   "Unable to launch the requested CGI program:\n"
+			   "  %s: %s\n", argv[0], strerror(errno));
 
-		close(wfd[0]);
-		close(rfd[1]);
 		exit(0);
+	}
+#endif
 
-		break;
+	/* parent; handle I/O relaying, a spawned child has been executed
+	 * already while fork() returns right away */
+	uh_metrics_inc(cgi_spawns);
+	uh_metrics_observe(&uh_metrics->cgi_spawn, uh_metrics_now() - spawned);
 
-	/* parent; handle I/O relaying */
-	default:
-		memset(state, 0, sizeof(*state));
+	memset(state, 0, sizeof(*state));
 
-		cl->rpipe.fd = rfd[0];
-		cl->wpipe.fd = wfd[1];
-		cl->proc.pid = child;
+	cl->rpipe.fd = rfd[0];
+	cl->wpipe.fd = wfd[1];
+	cl->proc.pid = child;
 
-		/* make pipe non-blocking */
-		fd_nonblock(cl->rpipe.fd);
-		fd_nonblock(cl->wpipe.fd);
+	/* make pipe non-blocking */
+	fd_nonblock(cl->rpipe.fd);
+	fd_nonblock(cl->wpipe.fd);
 
-		/* close unneeded pipe ends */
-		close(rfd[1]);
-		close(wfd[0]);
+	/* close unneeded pipe ends */
+	close(rfd[1]);
+	close(wfd[0]);
 
-		D("CGI: Child(%d) created: rfd(%d) wfd(%d)\n", child, rfd[0], wfd[1]);
+	D("CGI: Child(%d) created: rfd(%d) wfd(%d)\n", child, rfd[0], wfd[1]);
 
-		state->httpbuf.ptr = state->httpbuf.buf;
-		state->httpbuf.len = sizeof(state->httpbuf.buf);
+	state->httpbuf.ptr = state->httpbuf.buf;
+	state->httpbuf.len = sizeof(state->httpbuf.buf);
 
-		state->content_length = cl->httpbuf.len;
+	/* any other buffered data belongs to a pipelined request */
+	state->content_length = req->content_length;
 
-		/* find content length */
-		if (req->method == UH_HTTP_MSG_POST)
-		{
-			foreach_header(i, req->headers)
-			{
-				if (!strcasecmp(req->headers[i], "Content-Length"))
-				{
-					state->content_length = atoi(req->headers[i+1]);
-					break;
-				}
-			}
-		}
+	/* relay the pipes within the kernel where the framing allows */
+	state->splice = uh_tcp_can_splice(cl);
+	state->length = -1;
 
-		cl->cb = uh_cgi_socket_cb;
-		cl->priv = state;
-
-		break;
-	}
+	cl->cb = uh_cgi_socket_cb;
+	cl->priv = state;
 
 	return true;
 }
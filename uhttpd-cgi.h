@@ -17,6 +17,7 @@
  */
 
 #ifndef _UHTTPD_CGI_
+#define _UHTTPD_CGI_
 
 #include <errno.h>
 #include <unistd.h>
@@ -25,6 +26,14 @@
 
 #include <time.h>
 
+#ifdef HAVE_SPAWN_CHDIR
+#include <spawn.h>
+#endif
+
+
+#define UH_CGI_ENV_MAX		64
+#define UH_CGI_ENV_SIZE		8192
+
 
 struct uh_cgi_state {
 	struct {
@@ -34,8 +43,31 @@ struct uh_cgi_state {
 	} httpbuf;
 	int content_length;
 	bool header_sent;
+	bool splice;
+	bool relay;
+	int length;
+};
+
+struct uh_cgi_envp {
+	char *vars[UH_CGI_ENV_MAX + 1];
+	int count;
+	char arena[UH_CGI_ENV_SIZE];
+	int len;
+	bool overflow;
 };
 
+typedef void (*uh_cgi_env_cb)(void *priv, const char *name,
+                              const char *value);
+
+void uh_cgi_env_common(struct config *conf, uh_cgi_env_cb cb, void *priv);
+void uh_cgi_env(struct client *cl, struct path_info *pi,
+				uh_cgi_env_cb cb, void *priv);
+
+int uh_cgi_relay(struct client *cl, struct uh_cgi_state *state,
+				 const char *buf, int len);
+
+void uh_cgi_finish(struct client *cl, struct uh_cgi_state *state);
+
 bool uh_cgi_request(struct client *cl, struct path_info *pi,
 					struct interpreter *ip);
 
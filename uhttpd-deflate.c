@@ -0,0 +1,170 @@
+/*
+ * uhttpd - Tiny single-threaded httpd - Streaming compression
+ *
+ *   Copyright (C) 2026 agent <agent@local>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "uhttpd.h"
+#include "uhttpd-utils.h"
+#include "uhttpd-deflate.h"
+
+
+/* codings in order of preference, deflate is the zlib format */
+static const struct {
+	const char *name;
+	int wbits;
+} uh_deflate_codings[] = {
+	{ "gzip",    UH_DEFLATE_WBITS + 16 },
+	{ "deflate", UH_DEFLATE_WBITS },
+};
+
+/* media types worth compressing, matched as prefix */
+static const char *uh_deflate_types[] = {
+	"text/",
+	"application/json",
+	"application/javascript",
+	"application/xml",
+	"application/xhtml+xml",
+	"image/svg+xml",
+};
+
+static bool uh_deflate_type(const char *type)
+{
+	int i;
+
+	for (i = 0; i < array_size(uh_deflate_types); i++)
+		if (!strncasecmp(type, uh_deflate_types[i],
+						 strlen(uh_deflate_types[i])))
+			return true;
+
+	return false;
+}
+
+const char * uh_deflate_start(struct client *cl, const char *type, int length)
+{
+	int i;
+	struct uh_deflate *d;
+	char *hdr = cl->request.fields[UH_HTTP_HDR_ACCEPT_ENCODING];
+
+	/* only chunked bodies can be compressed on the fly, responses
+	 * without a body and short ones are sent as they are */
+	if (!cl->server->conf->deflate || !hdr || cl->deflate ||
+		(cl->request.version < UH_HTTP_VER_1_1) ||
+		(cl->request.method == UH_HTTP_MSG_HEAD) ||
+		(cl->response.statuscode < 200) ||
+		(cl->response.statuscode == 204) ||
+		(cl->response.statuscode == 304) ||
+		((length >= 0) && (length < UH_DEFLATE_MINSIZE)) ||
+		!type || !uh_deflate_type(type))
+		return NULL;
+
+	for (i = 0; i < array_size(uh_deflate_codings); i++)
+	{
+		if (!uh_accept_encoding(hdr, uh_deflate_codings[i].name))
+			continue;
+
+		if (!(d = malloc(sizeof(*d))))
+			return NULL;
+
+		memset(d, 0, sizeof(*d));
+
+		if (deflateInit2(&d->z, UH_DEFLATE_LEVEL, Z_DEFLATED,
+						 uh_deflate_codings[i].wbits, UH_DEFLATE_MEMLEVEL,
+						 Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			free(d);
+			return NULL;
+		}
+
+		D("Deflate: Client(%d) compressing %s as %s\n",
+		  cl->fd.fd, type, uh_deflate_codings[i].name);
+
+		cl->deflate = d;
+		return uh_deflate_codings[i].name;
+	}
+
+	return NULL;
+}
+
+static int uh_deflate_run(struct client *cl, int flush)
+{
+	int n;
+	char buf[UH_LIMIT_MSGHEAD];
+	z_stream *z = &cl->deflate->z;
+
+	/* chunks are sent as soon as zlib has produced output */
+	do
+	{
+		z->next_out  = (Bytef *)buf;
+		z->avail_out = sizeof(buf);
+
+		if (deflate(z, flush) == Z_STREAM_ERROR)
+		{
+			D("Deflate: Client(%d) stream error\n", cl->fd.fd);
+
+			cl->keepalive = false;
+			return -1;
+		}
+
+		if ((n = sizeof(buf) - z->avail_out) > 0)
+			ensure_ret(uh_http_chunk(cl, buf, n));
+	}
+	while (!z->avail_out);
+
+	return 0;
+}
+
+int uh_deflate_sendc(struct client *cl, const char *data, int len)
+{
+	struct uh_deflate *d = cl->deflate;
+
+	d->z.next_in  = (Bytef *)data;
+	d->z.avail_in = len;
+
+	/* an empty write ends the stream and the body */
+	if (!len)
+	{
+		ensure_ret(uh_deflate_run(cl, Z_FINISH));
+		uh_deflate_free(cl);
+
+		return uh_http_chunk(cl, NULL, 0);
+	}
+
+	d->pending = true;
+
+	return uh_deflate_run(cl, Z_NO_FLUSH);
+}
+
+int uh_deflate_flush(struct client *cl)
+{
+	/* an empty flush would still emit an empty block */
+	if (!cl->deflate || !cl->deflate->pending)
+		return 0;
+
+	cl->deflate->pending = false;
+
+	return uh_deflate_run(cl, Z_SYNC_FLUSH);
+}
+
+void uh_deflate_free(struct client *cl)
+{
+	if (!cl->deflate)
+		return;
+
+	deflateEnd(&cl->deflate->z);
+	free(cl->deflate);
+
+	cl->deflate = NULL;
+}
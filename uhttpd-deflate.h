@@ -0,0 +1,43 @@
+/*
+ * uhttpd - Tiny single-threaded httpd - Streaming compression header
+ *
+ *   Copyright (C) 2026 agent <agent@local>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _UHTTPD_DEFLATE_
+#define _UHTTPD_DEFLATE_
+
+#include <zlib.h>
+
+/* fixed level, a 4KB window and a small hash keep the state of each
+ * compressing client at about 40KB */
+#define UH_DEFLATE_LEVEL	6
+#define UH_DEFLATE_WBITS	12
+#define UH_DEFLATE_MEMLEVEL	5
+
+/* announced bodies below this size are not worth the overhead */
+#define UH_DEFLATE_MINSIZE	1024
+
+struct uh_deflate {
+	z_stream z;
+	bool pending;
+};
+
+const char * uh_deflate_start(struct client *cl, const char *type, int length);
+int uh_deflate_sendc(struct client *cl, const char *data, int len);
+int uh_deflate_flush(struct client *cl);
+void uh_deflate_free(struct client *cl);
+
+#endif
@@ -0,0 +1,670 @@
+/*
+ * uhttpd - Tiny single-threaded httpd - FastCGI handler
+ *
+ *   Copyright (C) 2026 agent <agent@local>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "uhttpd.h"
+#include "uhttpd-utils.h"
+#include "uhttpd-fcgi.h"
+
+#include <stddef.h>
+
+#ifdef linux
+#include <sys/prctl.h>
+#endif
+
+
+struct uh_fcgi_app *uh_fcgi_apps = NULL;
+
+
+struct uh_fcgi_app * uh_fcgi_add(const char *prefix, const char *path)
+{
+	struct uh_fcgi_app *app;
+
+	/* several extensions may share one application */
+	if (!prefix)
+		for (app = uh_fcgi_apps; app; app = app->next)
+			if (!app->prefix && !strcmp(app->path, path))
+				return app;
+
+	if ((app = malloc(sizeof(*app))) != NULL)
+	{
+		memset(app, 0, sizeof(*app));
+
+		strncpy(app->path, path, sizeof(app->path) - 1);
+		app->prefix = prefix ? strdup(prefix) : NULL;
+		app->lsock = -1;
+
+		app->next = uh_fcgi_apps;
+		uh_fcgi_apps = app;
+
+		return app;
+	}
+
+	return NULL;
+}
+
+
+static void uh_fcgi_spawn(struct uh_fcgi_proc *p)
+{
+	pid_t pid;
+	struct uh_fcgi_app *app = p->app;
+
+	switch ((pid = fork()))
+	{
+		case -1:
+			perror("fork()");
+			uloop_timeout_set(&p->restart, 1000);
+			break;
+
+		case 0:
+			/* do not leak parent epoll descriptor */
+			uloop_done();
+
+#ifdef linux
+			/* do not outlive the server */
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+
+			/* the application accepts its connections on stdin */
+			dup2(app->lsock, 0);
+
+			if (chdir(app->conf->docroot))
+				perror("chdir()");
+
+			execl(app->path, app->path, NULL);
+
+			fprintf(stderr, "Unable to launch FastCGI application %s: %s\n",
+					app->path, strerror(errno));
+
+			_exit(1);
+
+		default:
+			D("FastCGI: %s started pid %d\n", app->path, pid);
+
+			p->started = time(NULL);
+			p->proc.pid = pid;
+			uloop_process_add(&p->proc);
+			break;
+	}
+}
+
+static void uh_fcgi_restart_cb(struct uloop_timeout *t)
+{
+	uh_fcgi_spawn(container_of(t, struct uh_fcgi_proc, restart));
+}
+
+static void uh_fcgi_exit_cb(struct uloop_process *proc, int ret)
+{
+	struct uh_fcgi_proc *p = container_of(proc, struct uh_fcgi_proc, proc);
+
+	D("FastCGI: %s pid %d exited with status %d\n",
+	  p->app->path, proc->pid, ret);
+
+	/* respawn, but do not spin on applications failing at startup */
+	uloop_timeout_set(&p->restart, (time(NULL) - p->started < 1) ? 1000 : 0);
+}
+
+/* applications are started on first use, so that every worker process
+ * maintains a pool of its own */
+static int uh_fcgi_start(struct uh_fcgi_app *app, struct config *conf)
+{
+	int i;
+	struct stat s;
+	static int index = 0;
+
+	app->conf = conf;
+
+	/* connect to an application which is managed elsewhere */
+	if (!stat(app->path, &s) && S_ISSOCK(s.st_mode))
+	{
+		app->addr.sun_family = AF_UNIX;
+		strncpy(app->addr.sun_path, app->path, sizeof(app->addr.sun_path) - 1);
+		app->addrlen = sizeof(app->addr);
+		app->started = true;
+
+		return 0;
+	}
+
+	/* listen on an abstract socket, nothing to clean up in the fs */
+	app->addr.sun_family = AF_UNIX;
+	app->addrlen = offsetof(struct sockaddr_un, sun_path) + 1 +
+		snprintf(app->addr.sun_path + 1, sizeof(app->addr.sun_path) - 1,
+				 "uhttpd-fcgi-%d-%d", (int)getpid(), index++);
+
+	if ((app->lsock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+	{
+		perror("socket()");
+		return -1;
+	}
+
+	if (bind(app->lsock, (struct sockaddr *)&app->addr, app->addrlen) ||
+		listen(app->lsock, UH_LIMIT_CLIENTS))
+	{
+		perror("bind()");
+		close(app->lsock);
+		app->lsock = -1;
+		return -1;
+	}
+
+	fd_cloexec(app->lsock);
+
+	if (!(app->procs = calloc(conf->fcgi_procs, sizeof(*app->procs))))
+	{
+		close(app->lsock);
+		app->lsock = -1;
+		return -1;
+	}
+
+	app->n_procs = conf->fcgi_procs;
+
+	for (i = 0; i < app->n_procs; i++)
+	{
+		app->procs[i].app = app;
+		app->procs[i].proc.cb = uh_fcgi_exit_cb;
+		app->procs[i].restart.cb = uh_fcgi_restart_cb;
+
+		uh_fcgi_spawn(&app->procs[i]);
+	}
+
+	app->started = true;
+
+	return 0;
+}
+
+/* connections are not kept open, an application process serving a
+ * persistent connection would be unavailable to all others, the backlog
+ * of the listening socket queues requests until a process is free */
+static int uh_fcgi_connect(struct uh_fcgi_app *app)
+{
+	int sock;
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+
+	fd_cloexec(sock);
+	fd_nonblock(sock);
+
+	/* a full backlog means the application is overloaded */
+	if (connect(sock, (struct sockaddr *)&app->addr, app->addrlen))
+	{
+		D("FastCGI: connect to %s failed: %s\n", app->path, strerror(errno));
+
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+void uh_fcgi_cleanup(void)
+{
+	int i;
+	struct uh_fcgi_app *app;
+
+	for (app = uh_fcgi_apps; app; app = app->next)
+	{
+		for (i = 0; i < app->n_procs; i++)
+		{
+			uloop_timeout_cancel(&app->procs[i].restart);
+
+			if (app->procs[i].proc.pending)
+			{
+				uloop_process_delete(&app->procs[i].proc);
+				kill(app->procs[i].proc.pid, SIGTERM);
+			}
+		}
+
+		if (app->lsock > -1)
+			close(app->lsock);
+
+		free(app->procs);
+
+		app->procs = NULL;
+		app->n_procs = 0;
+		app->lsock = -1;
+		app->started = false;
+	}
+}
+
+
+static bool uh_fcgi_buf_grow(struct uh_fcgi_buf *b, int len)
+{
+	char *data;
+	int size = b->size ? b->size : 1024;
+
+	if (b->error)
+		return false;
+
+	while (size < b->len + len)
+		size *= 2;
+
+	if (size > b->size)
+	{
+		if (!(data = realloc(b->data, size)))
+		{
+			b->error = true;
+			return false;
+		}
+
+		b->data = data;
+		b->size = size;
+	}
+
+	return true;
+}
+
+static void uh_fcgi_record(struct uh_fcgi_buf *b, int type,
+						   const char *data, int len)
+{
+	unsigned char *h;
+
+	if (!uh_fcgi_buf_grow(b, UH_FCGI_HEADER_LEN + len))
+		return;
+
+	h = (unsigned char *)b->data + b->len;
+
+	h[0] = UH_FCGI_VERSION;
+	h[1] = type;
+	h[2] = 0; /* request id 1, one request per connection at a time */
+	h[3] = 1;
+	h[4] = (len >> 8) & 0xff;
+	h[5] = len & 0xff;
+	h[6] = 0;
+	h[7] = 0;
+
+	if (len > 0)
+		memcpy(b->data + b->len + UH_FCGI_HEADER_LEN, data, len);
+
+	b->len += UH_FCGI_HEADER_LEN + len;
+}
+
+static int uh_fcgi_length(unsigned char *p, int len)
+{
+	if (len < 128)
+	{
+		p[0] = len;
+		return 1;
+	}
+
+	p[0] = ((len >> 24) & 0x7f) | 0x80;
+	p[1] = (len >> 16) & 0xff;
+	p[2] = (len >>  8) & 0xff;
+	p[3] = len & 0xff;
+
+	return 4;
+}
+
+static void uh_fcgi_param(void *priv, const char *name, const char *value)
+{
+	struct uh_fcgi_buf *b = priv;
+	int nlen = strlen(name);
+	int vlen = strlen(value);
+	unsigned char *p;
+
+	if (!uh_fcgi_buf_grow(b, 8 + nlen + vlen))
+		return;
+
+	p = (unsigned char *)b->data + b->len;
+	p += uh_fcgi_length(p, nlen);
+	p += uh_fcgi_length(p, vlen);
+
+	memcpy(p, name, nlen);
+	memcpy(p + nlen, value, vlen);
+
+	b->len = (char *)p + nlen + vlen - b->data;
+}
+
+static bool uh_fcgi_queue_request(struct client *cl, struct path_info *pi,
+								  struct uh_fcgi_buf *b)
+{
+	int off, len;
+	char begin[8] = { 0, UH_FCGI_RESPONDER, 0 };
+
+	struct uh_fcgi_buf params = { };
+
+	uh_cgi_env_common(cl->server->conf, uh_fcgi_param, &params);
+	uh_cgi_env(cl, pi, uh_fcgi_param, &params);
+
+	uh_fcgi_record(b, UH_FCGI_BEGIN_REQUEST, begin, sizeof(begin));
+
+	/* the parameter stream is split into records of the maximum size */
+	for (off = 0; off < params.len; off += len)
+	{
+		len = min(params.len - off, UH_FCGI_RECORD_MAX);
+		uh_fcgi_record(b, UH_FCGI_PARAMS, params.data + off, len);
+	}
+
+	uh_fcgi_record(b, UH_FCGI_PARAMS, NULL, 0);
+
+	/* no request body, terminate the input stream right away */
+	if (cl->request.content_length <= 0)
+		uh_fcgi_record(b, UH_FCGI_STDIN, NULL, 0);
+
+	free(params.data);
+
+	return !params.error && !b->error;
+}
+
+/* write as much of the queued records as the application accepts, the
+ * rest is sent once the socket becomes writable again */
+static int uh_fcgi_flush(struct client *cl, struct uh_fcgi_state *state)
+{
+	int rv, off = 0;
+	struct uh_fcgi_buf *b = &state->out;
+
+	if (b->error)
+		return -1;
+
+	while (off < b->len)
+	{
+		if ((rv = write(cl->wpipe.fd, b->data + off, b->len - off)) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				break;
+
+			D("FastCGI: Client(%d) write error: %s\n",
+			  cl->fd.fd, strerror(errno));
+
+			return -1;
+		}
+
+		off += rv;
+	}
+
+	if (off > 0)
+	{
+		memmove(b->data, b->data + off, b->len - off);
+		b->len -= off;
+	}
+
+	if (b->len > 0)
+		uloop_fd_add(&cl->wpipe, ULOOP_WRITE);
+	else
+		uloop_fd_delete(&cl->wpipe);
+
+	/* stop reading the body while the application is backed up */
+	uh_client_stall(cl, b->len >= UH_FCGI_QUEUE_MAX);
+
+	return 0;
+}
+
+/* feed the received data through the record parser, returns the number
+ * of consumed bytes or -1 if relaying the output failed */
+static int uh_fcgi_parse(struct client *cl, struct uh_fcgi_state *state,
+						 const char *buf, int len)
+{
+	int n, pos = 0;
+	unsigned char *h = state->record.head;
+
+	while ((pos < len) && !state->ended)
+	{
+		/* record header */
+		if (state->record.headlen < UH_FCGI_HEADER_LEN)
+		{
+			n = min(UH_FCGI_HEADER_LEN - state->record.headlen, len - pos);
+
+			memcpy(h + state->record.headlen, buf + pos, n);
+			state->record.headlen += n;
+			pos += n;
+
+			if (state->record.headlen < UH_FCGI_HEADER_LEN)
+				break;
+
+			state->record.type = h[1];
+			state->record.clen = (h[4] << 8) | h[5];
+			state->record.plen = h[6];
+		}
+
+		/* record content */
+		else if (state->record.clen > 0)
+		{
+			n = min(state->record.clen, len - pos);
+
+			switch (state->record.type)
+			{
+			case UH_FCGI_STDOUT:
+				ensure_ret(uh_cgi_relay(cl, &state->cgi, buf + pos, n));
+				break;
+
+			case UH_FCGI_STDERR:
+				fprintf(stderr, "%.*s", n, buf + pos);
+				break;
+			}
+
+			state->record.clen -= n;
+			pos += n;
+		}
+
+		/* record padding */
+		else if (state->record.plen > 0)
+		{
+			n = min(state->record.plen, len - pos);
+
+			state->record.plen -= n;
+			pos += n;
+		}
+
+		if ((state->record.headlen == UH_FCGI_HEADER_LEN) &&
+			!state->record.clen && !state->record.plen)
+		{
+			if (state->record.type == UH_FCGI_END_REQUEST)
+			{
+				D("FastCGI: Client(%d) request complete\n", cl->fd.fd);
+				state->ended = true;
+			}
+
+			state->record.headlen = 0;
+		}
+	}
+
+	return pos;
+}
+
+static bool uh_fcgi_socket_cb(struct client *cl)
+{
+	int len = 0;
+	char buf[UH_LIMIT_MSGHEAD];
+
+	struct uh_fcgi_state *state = (struct uh_fcgi_state *)cl->priv;
+	struct http_request *req = &cl->request;
+
+	/* there is unread post data waiting and room to queue it */
+	while ((state->cgi.content_length > 0) &&
+	       (state->out.len < UH_FCGI_QUEUE_MAX))
+	{
+		/* remaining data in http head buffer ... */
+		if (cl->httpbuf.len > 0)
+		{
+			len = min(state->cgi.content_length, cl->httpbuf.len);
+
+			memcpy(buf, cl->httpbuf.ptr, len);
+
+			cl->httpbuf.len -= len;
+			cl->httpbuf.ptr += len;
+		}
+
+		/* read it from socket ... */
+		else
+		{
+			len = uh_tcp_recv(cl, buf, min(state->cgi.content_length,
+			                               sizeof(buf)));
+
+			if ((len < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+				break;
+		}
+
+		D("FastCGI: Client(%d) feed %d body bytes\n", cl->fd.fd, len);
+
+		if (len > 0)
+			state->cgi.content_length -= len;
+		else
+			state->cgi.content_length = 0;
+
+		/* ... queue for the application, an empty record marks the end */
+		if (len > 0)
+			uh_fcgi_record(&state->out, UH_FCGI_STDIN, buf, len);
+
+		if (state->cgi.content_length <= 0)
+		{
+			uh_fcgi_record(&state->out, UH_FCGI_STDIN, NULL, 0);
+			req->content_length = 0;
+		}
+	}
+
+	if (uh_fcgi_flush(cl, state) < 0)
+		goto out;
+
+	/* try to read data from the application */
+	while (!state->ended && !uh_client_congested(cl) &&
+	       ((len = uh_raw_recv(cl->rpipe.fd, buf, sizeof(buf), -1)) > 0))
+	{
+		ensure_out(uh_fcgi_parse(cl, state, buf, len));
+	}
+
+	if (state->ended)
+		goto out;
+
+	/* output queue is full, continue once the client caught up */
+	if (uh_client_congested(cl))
+		return true;
+
+	/* got EOF or read error from the application */
+	if ((len == 0) ||
+		((errno != EAGAIN) && (errno != EWOULDBLOCK) && (len == -1)))
+	{
+		D("FastCGI: Client(%d) connection lost [%s]\n",
+		  cl->fd.fd, strerror(errno));
+
+		goto out;
+	}
+
+	return true;
+
+out:
+	uh_cgi_finish(cl, &state->cgi);
+	return false;
+}
+
+static void uh_fcgi_close(struct client *cl)
+{
+	struct uh_fcgi_state *state = (struct uh_fcgi_state *)cl->priv;
+
+	free(state->out.data);
+	free(state);
+}
+
+static void uh_fcgi_timeout_cb(struct uloop_timeout *t)
+{
+	struct client *cl = container_of(t, struct client, timeout);
+
+	D("FastCGI: Client(%d) timed out\n", cl->fd.fd);
+
+	/* let the socket callback observe an EOF and answer with a 504 */
+	shutdown(cl->rpipe.fd, SHUT_RDWR);
+}
+
+bool uh_fcgi_request(struct client *cl, struct path_info *pi,
+					 struct uh_fcgi_app *app)
+{
+	int fd;
+	char url[UH_LIMIT_MSGHEAD];
+
+	struct path_info prefix = { };
+	struct uh_fcgi_state *state;
+	struct config *conf = cl->server->conf;
+
+	if (!app->started && uh_fcgi_start(app, conf))
+	{
+		uh_http_sendhf(cl, 502, "Bad Gateway",
+					   "Unable to start the FastCGI application\n");
+		return false;
+	}
+
+	/* applications mounted at a prefix are not backed by a file, the
+	 * remaining url is passed as path info */
+	if (!pi)
+	{
+		snprintf(url, sizeof(url), "%s", cl->request.url);
+
+		if ((prefix.query = strchr(url, '?')) != NULL)
+			*prefix.query++ = 0;
+
+		prefix.root = conf->docroot;
+		prefix.phys = app->path;
+		prefix.name = app->prefix;
+		prefix.info = url + strlen(app->prefix);
+
+		pi = &prefix;
+	}
+
+	if ((fd = uh_fcgi_connect(app)) == -1)
+	{
+		uh_http_sendhf(cl, 503, "Service Unavailable",
+					   "The FastCGI application is not available\n");
+		return false;
+	}
+
+	if (!(state = malloc(sizeof(*state))))
+	{
+		close(fd);
+		uh_http_sendhf(cl, 500, "Internal Server Error", "Out of memory");
+		return false;
+	}
+
+	memset(state, 0, sizeof(*state));
+
+	/* output is relayed like the one of a cgi child, the request goes
+	 * through a duplicate which is only polled while records are queued */
+	cl->rpipe.fd = fd;
+	cl->wpipe.fd = dup(fd);
+
+	if ((cl->wpipe.fd == -1) ||
+		!uh_fcgi_queue_request(cl, pi, &state->out) ||
+		(uh_fcgi_flush(cl, state) < 0))
+	{
+		uh_ufd_remove(&cl->wpipe);
+		uh_ufd_remove(&cl->rpipe);
+
+		free(state->out.data);
+		free(state);
+
+		uh_http_sendhf(cl, 502, "Bad Gateway",
+					   "Failed to send the request to the FastCGI "
+					   "application\n");
+		return false;
+	}
+
+	fd_cloexec(cl->wpipe.fd);
+
+	state->cgi.httpbuf.ptr = state->cgi.httpbuf.buf;
+	state->cgi.httpbuf.len = sizeof(state->cgi.httpbuf.buf);
+
+	/* any other buffered data belongs to a pipelined request */
+	state->cgi.content_length = cl->request.content_length;
+
+	cl->timeout.cb = uh_fcgi_timeout_cb;
+	uloop_timeout_set(&cl->timeout, conf->script_timeout * 1000);
+
+	cl->cb = uh_fcgi_socket_cb;
+	cl->cleanup = uh_fcgi_close;
+	cl->priv = state;
+
+	return true;
+}
@@ -0,0 +1,101 @@
+/*
+ * uhttpd - Tiny single-threaded httpd - FastCGI header
+ *
+ *   Copyright (C) 2026 agent <agent@local>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _UHTTPD_FCGI_
+#define _UHTTPD_FCGI_
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <time.h>
+
+#include "uhttpd-cgi.h"
+
+
+#define UH_FCGI_VERSION			1
+#define UH_FCGI_HEADER_LEN		8
+#define UH_FCGI_RECORD_MAX		65535
+
+#define UH_FCGI_BEGIN_REQUEST	1
+#define UH_FCGI_END_REQUEST		3
+#define UH_FCGI_PARAMS			4
+#define UH_FCGI_STDIN			5
+#define UH_FCGI_STDOUT			6
+#define UH_FCGI_STDERR			7
+
+#define UH_FCGI_RESPONDER		1
+
+/* request body queued for the application before reading is paused */
+#define UH_FCGI_QUEUE_MAX		UH_LIMIT_OUTBUF
+
+
+struct uh_fcgi_app;
+
+struct uh_fcgi_proc {
+	struct uloop_process proc;
+	struct uloop_timeout restart;
+	struct uh_fcgi_app *app;
+	time_t started;
+};
+
+struct uh_fcgi_app {
+	char path[PATH_MAX];
+	char *prefix;
+	struct config *conf;
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	int lsock;
+	bool started;
+	int n_procs;
+	struct uh_fcgi_proc *procs;
+	struct uh_fcgi_app *next;
+};
+
+struct uh_fcgi_buf {
+	char *data;
+	int len;
+	int size;
+	bool error;
+};
+
+struct uh_fcgi_state {
+	struct uh_cgi_state cgi;
+	struct uh_fcgi_buf out;
+	struct {
+		unsigned char head[UH_FCGI_HEADER_LEN];
+		int headlen;
+		int type;
+		int clen;
+		int plen;
+	} record;
+	bool ended;
+};
+
+extern struct uh_fcgi_app *uh_fcgi_apps;
+
+struct uh_fcgi_app * uh_fcgi_add(const char *prefix, const char *path);
+
+bool uh_fcgi_request(struct client *cl, struct path_info *pi,
+					 struct uh_fcgi_app *app);
+
+void uh_fcgi_cleanup(void);
+
+#endif
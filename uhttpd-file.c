@@ -26,26 +26,91 @@
 time_t timegm (struct tm *tm);
 #endif
 
-static const char * uh_file_mime_lookup(const char *path)
+static struct mimetype *uh_mime_hash[UH_MIME_BUCKETS];
+static struct uh_file_dirlist uh_dirlist_cache[UH_DIRLIST_CACHE_SIZE];
+
+static unsigned int uh_file_mime_hash(const char *extn)
 {
-	struct mimetype *m = &uh_mime_types[0];
-	const char *e;
+	unsigned int h = 5381;
 
-	while (m->extn)
-	{
-		e = &path[strlen(path)-1];
+	while (*extn)
+		h = ((h << 5) + h) ^ tolower(*extn++);
 
-		while (e >= path)
-		{
-			if ((*e == '.' || *e == '/') && !strcasecmp(&e[1], m->extn))
-				return m->mime;
+	return h % UH_MIME_BUCKETS;
+}
 
-			e--;
-		}
+static void uh_file_mime_insert(struct mimetype *m)
+{
+	unsigned int h = uh_file_mime_hash(m->extn);
+
+	m->next = uh_mime_hash[h];
+	uh_mime_hash[h] = m;
+}
+
+static void uh_file_mime_init(void)
+{
+	static bool done = false;
+	int i;
 
-		m++;
+	if (done)
+		return;
+
+	/* insert built-in types back to front, the first definition of an
+	 * extension wins and later user mappings override all of them */
+	for (i = array_size(uh_mime_types) - 2; i >= 0; i--)
+		uh_file_mime_insert(&uh_mime_types[i]);
+
+	done = true;
+}
+
+struct mimetype * uh_file_mime_add(const char *extn, const char *mime)
+{
+	struct mimetype *new;
+
+	uh_file_mime_init();
+
+	if ((new = malloc(sizeof(*new))) != NULL)
+	{
+		new->extn = strdup(extn);
+		new->mime = strdup(mime);
+
+		uh_file_mime_insert(new);
 	}
 
+	return new;
+}
+
+static const char * uh_file_mime_find(const char *extn)
+{
+	struct mimetype *m;
+
+	for (m = uh_mime_hash[uh_file_mime_hash(extn)]; m; m = m->next)
+		if (!strcasecmp(m->extn, extn))
+			return m->mime;
+
+	return NULL;
+}
+
+static const char * uh_file_mime_lookup(const char *path)
+{
+	const char *base = path;
+	const char *p, *mime;
+
+	uh_file_mime_init();
+
+	for (p = path; *p; p++)
+		if (*p == '/')
+			base = &p[1];
+
+	/* whole file names like README come first, then the extensions
+	 * from the longest one, so "tar.gz" is preferred over "gz" */
+	if ((mime = uh_file_mime_find(base)) != NULL)
+		return mime;
+
+	for (p = base; *p; p++)
+		if ((*p == '.') && (mime = uh_file_mime_find(&p[1])) != NULL)
+			return mime;
+
 	return "application/octet-stream";
 }
 
@@ -76,39 +141,90 @@ static time_t uh_file_date2unix(const char *date)
 static char * uh_file_unix2date(time_t ts)
 {
 	static char str[128];
-	struct tm *t = gmtime(&ts);
+	static time_t last = -1;
+	struct tm *t;
 
-	strftime(str, sizeof(str), "%a, %d %b %Y %H:%M:%S GMT", t);
+	/* consecutive calls mostly ask for the same timestamp */
+	if (ts != last)
+	{
+		t = gmtime(&ts);
+		strftime(str, sizeof(str), "%a, %d %b %Y %H:%M:%S GMT", t);
+		last = ts;
+	}
 
 	return str;
 }
 
-static char * uh_file_header_lookup(struct client *cl, const char *name)
+static const char * uh_file_date_now(void)
 {
-	int i;
+	static char str[128];
+	static time_t last = -1;
+	time_t now = time(NULL);
+	struct tm *t;
 
-	foreach_header(i, cl->request.headers)
+	/* formatted at most once per second */
+	if (now != last)
 	{
-		if (!strcasecmp(cl->request.headers[i], name))
-			return cl->request.headers[i+1];
+		t = gmtime(&now);
+		strftime(str, sizeof(str), "%a, %d %b %Y %H:%M:%S GMT", t);
+		last = now;
 	}
 
-	return NULL;
+	return str;
 }
 
 
-static int uh_file_response_ok_hdrs(struct client *cl, struct stat *s)
+static const struct path_encoding * uh_file_encoding(struct client *cl,
+													 struct path_info *pi)
 {
-	ensure_ret(uh_http_sendf(cl, NULL, "Connection: close\r\n"));
+	const struct path_encoding *enc;
+	char *hdr = cl->request.fields[UH_HTTP_HDR_ACCEPT_ENCODING];
 
-	if (s)
+	if (hdr && pi->encodings)
+		for (enc = uh_path_encodings; enc->name; enc++)
+			if ((pi->encodings & enc->flag) &&
+				uh_accept_encoding(hdr, enc->name))
+				return enc;
+
+	return NULL;
+}
+
+static int uh_file_open(struct client *cl, struct path_info *pi,
+						const struct path_encoding **enc)
+{
+	int fd;
+	char path[PATH_MAX];
+
+	/* prefer a precompressed sibling over the raw file */
+	if ((*enc = uh_file_encoding(cl, pi)) != NULL)
 	{
-		ensure_ret(uh_http_sendf(cl, NULL, "ETag: %s\r\n", uh_file_mktag(s)));
-		ensure_ret(uh_http_sendf(cl, NULL, "Last-Modified: %s\r\n",
-								 uh_file_unix2date(s->st_mtime)));
+		snprintf(path, sizeof(path), "%s%s", pi->phys, (*enc)->extn);
+
+		if ((fd = open(path, O_RDONLY)) > 0)
+			return fd;
+
+		*enc = NULL;
 	}
 
-	return uh_http_sendf(cl, NULL, "Date: %s\r\n", uh_file_unix2date(time(NULL)));
+	return open(pi->phys, O_RDONLY);
+}
+
+static int uh_file_response_ok_hdrs(struct client *cl, struct stat *s)
+{
+	if (s)
+		return uh_http_sendf(cl, NULL,
+							 "Connection: %s\r\n"
+							 "ETag: %s\r\n"
+							 "Last-Modified: %s\r\n"
+							 "Date: %s\r\n",
+							 uh_http_connection(cl), uh_file_mktag(s),
+							 uh_file_unix2date(s->st_mtime),
+							 uh_file_date_now());
+
+	return uh_http_sendf(cl, NULL,
+						 "Connection: %s\r\n"
+						 "Date: %s\r\n",
+						 uh_http_connection(cl), uh_file_date_now());
 }
 
 static int uh_file_response_200(struct client *cl, struct stat *s)
@@ -131,14 +247,36 @@ static int uh_file_response_412(struct client *cl)
 {
 	return uh_http_sendf(cl, NULL,
 						 "%s 412 Precondition Failed\r\n"
-						 "Connection: close\r\n",
-	                     http_versions[cl->request.version]);
+						 "Content-Length: 0\r\n"
+						 "Connection: %s\r\n",
+	                     http_versions[cl->request.version],
+	                     uh_http_connection(cl));
+}
+
+static int uh_file_response_206(struct client *cl, struct stat *s)
+{
+	ensure_ret(uh_http_sendf(cl, NULL, "%s 206 Partial Content\r\n",
+							 http_versions[cl->request.version]));
+
+	return uh_file_response_ok_hdrs(cl, s);
+}
+
+static int uh_file_response_416(struct client *cl, struct stat *s)
+{
+	return uh_http_sendf(cl, NULL,
+						 "%s 416 Requested Range Not Satisfiable\r\n"
+						 "Content-Range: bytes */%llu\r\n"
+						 "Content-Length: 0\r\n"
+						 "Connection: %s\r\n",
+						 http_versions[cl->request.version],
+						 (unsigned long long)s->st_size,
+						 uh_http_connection(cl));
 }
 
 static int uh_file_if_match(struct client *cl, struct stat *s, int *ok)
 {
 	const char *tag = uh_file_mktag(s);
-	char *hdr = uh_file_header_lookup(cl, "If-Match");
+	char *hdr = cl->request.fields[UH_HTTP_HDR_IF_MATCH];
 	char *p;
 	int i;
 
@@ -171,7 +309,7 @@ static int uh_file_if_match(struct client *cl, struct stat *s, int *ok)
 
 static int uh_file_if_modified_since(struct client *cl, struct stat *s, int *ok)
 {
-	char *hdr = uh_file_header_lookup(cl, "If-Modified-Since");
+	char *hdr = cl->request.fields[UH_HTTP_HDR_IF_MODIFIED_SINCE];
 	*ok = 1;
 
 	if (hdr)
@@ -189,7 +327,7 @@ static int uh_file_if_modified_since(struct client *cl, struct stat *s, int *ok)
 static int uh_file_if_none_match(struct client *cl, struct stat *s, int *ok)
 {
 	const char *tag = uh_file_mktag(s);
-	char *hdr = uh_file_header_lookup(cl, "If-None-Match");
+	char *hdr = cl->request.fields[UH_HTTP_HDR_IF_NONE_MATCH];
 	char *p;
 	int i;
 	*ok = 1;
@@ -227,24 +365,27 @@ static int uh_file_if_none_match(struct client *cl, struct stat *s, int *ok)
 	return *ok;
 }
 
-static int uh_file_if_range(struct client *cl, struct stat *s, int *ok)
+static bool uh_file_if_range(struct client *cl, struct stat *s)
 {
-	char *hdr = uh_file_header_lookup(cl, "If-Range");
-	*ok = 1;
+	char *hdr = cl->request.fields[UH_HTTP_HDR_IF_RANGE];
 
+	/* a range of a changed file must not be combined with an older copy,
+	 * entity tags need a strong match, dates an exact one */
 	if (hdr)
 	{
-		*ok = 0;
-		ensure_ret(uh_file_response_412(cl));
+		if (hdr[0] == '"')
+			return !strcmp(hdr, uh_file_mktag(s));
+
+		return (uh_file_date2unix(hdr) == s->st_mtime);
 	}
 
-	return *ok;
+	return true;
 }
 
 static int uh_file_if_unmodified_since(struct client *cl, struct stat *s,
 									   int *ok)
 {
-	char *hdr = uh_file_header_lookup(cl, "If-Unmodified-Since");
+	char *hdr = cl->request.fields[UH_HTTP_HDR_IF_UNMODIFIED_SINCE];
 	*ok = 1;
 
 	if (hdr)
@@ -265,137 +406,661 @@ static int uh_file_scandir_filter_dir(const struct dirent *e)
 	return strcmp(e->d_name, ".") ? 1 : 0;
 }
 
-static void uh_file_dirlist(struct client *cl, struct path_info *pi)
+static int uh_file_dirlist_printf(struct uh_file_dirlist *dl,
+								  const char *fmt, ...)
 {
-	int i;
+	int len;
+	char *new;
+	va_list ap;
+
+	while (true)
+	{
+		va_start(ap, fmt);
+		len = vsnprintf(dl->buf + dl->len, dl->size - dl->len, fmt, ap);
+		va_end(ap);
+
+		if (len < 0)
+			return -1;
+
+		if ((dl->len + len) < dl->size)
+			break;
+
+		if (!(new = realloc(dl->buf, max(dl->size * 2, dl->len + len + 1))))
+			return -1;
+
+		dl->size = max(dl->size * 2, dl->len + len + 1);
+		dl->buf = new;
+	}
+
+	dl->len += len;
+	return len;
+}
+
+/* render the listing into a buffer, every entry is looked at once and
+ * the tag is derived from the output so it changes along with the sizes
+ * and dates of the entries even if the directory itself did not */
+static bool uh_file_dirlist_render(struct uh_file_dirlist *dl,
+								   struct path_info *pi)
+{
+	int i, dir;
 	int count = 0;
-	char filename[PATH_MAX];
-	char *pathptr;
+	int valid = 0;
 	struct dirent **files = NULL;
-	struct stat s;
+	struct uh_file_dirent *ents = NULL;
+	uint32_t hash = 2166136261U;
+	bool rv = false;
+
+	dl->len = 0;
+	dl->size = 0;
+	dl->buf = NULL;
+
+	if (((dir = open(pi->phys, O_RDONLY | O_DIRECTORY)) > -1) &&
+		((count = scandir(pi->phys, &files, uh_file_scandir_filter_dir,
+						  alphasort)) > 0) &&
+		((ents = malloc(count * sizeof(*ents))) != NULL))
+	{
+		for (i = 0; i < count; i++)
+		{
+			if (!fstatat(dir, files[i]->d_name, &ents[valid].stat, 0))
+				ents[valid++].name = files[i]->d_name;
+		}
+	}
 
-	ensure_out(uh_http_sendf(cl, &cl->request,
-							 "<html><head><title>Index of %s</title></head>"
-							 "<body><h1>Index of %s</h1><hr /><ol>",
-							 pi->name, pi->name));
+	ensure_out(uh_file_dirlist_printf(dl,
+		"<html><head><title>Index of %s</title></head>"
+		"<body><h1>Index of %s</h1><hr /><ol>", pi->name, pi->name));
+
+	/* list subdirs */
+	for (i = 0; i < valid; i++)
+	{
+		if ((ents[i].stat.st_mode & S_IFDIR) &&
+			(ents[i].stat.st_mode & S_IXOTH))
+		{
+			ensure_out(uh_file_dirlist_printf(dl,
+				"<li><strong><a href='%s%s'>%s</a>/"
+				"</strong><br /><small>modified: %s"
+				"<br />directory - %.02f kbyte<br />"
+				"<br /></small></li>",
+				pi->name, ents[i].name, ents[i].name,
+				uh_file_unix2date(ents[i].stat.st_mtime),
+				ents[i].stat.st_size / 1024.0));
+		}
+	}
 
-	if ((count = scandir(pi->phys, &files, uh_file_scandir_filter_dir,
-						 alphasort)) > 0)
+	/* list files */
+	for (i = 0; i < valid; i++)
 	{
-		memset(filename, 0, sizeof(filename));
-		memcpy(filename, pi->phys, sizeof(filename) - 1);
-		pathptr = &filename[strlen(filename)];
+		if (!(ents[i].stat.st_mode & S_IFDIR) &&
+			(ents[i].stat.st_mode & S_IROTH))
+		{
+			ensure_out(uh_file_dirlist_printf(dl,
+				"<li><strong><a href='%s%s'>%s</a>"
+				"</strong><br /><small>modified: %s"
+				"<br />%s - %.02f kbyte<br />"
+				"<br /></small></li>",
+				pi->name, ents[i].name, ents[i].name,
+				uh_file_unix2date(ents[i].stat.st_mtime),
+				uh_file_mime_lookup(ents[i].name),
+				ents[i].stat.st_size / 1024.0));
+		}
+	}
+
+	ensure_out(uh_file_dirlist_printf(dl, "</ol><hr /></body></html>"));
 
-		/* list subdirs */
+	/* FNV-1a */
+	for (i = 0; i < dl->len; i++)
+		hash = (hash ^ (unsigned char)dl->buf[i]) * 16777619U;
+
+	snprintf(dl->tag, sizeof(dl->tag), "\"d%x-%x-%x\"",
+			 (unsigned int) pi->stat.st_ino, (unsigned int) dl->len, hash);
+
+	dl->dev = pi->stat.st_dev;
+	dl->ino = pi->stat.st_ino;
+	dl->mtime = pi->stat.st_mtime;
+	dl->rendered = time(NULL);
+
+	rv = true;
+
+out:
+	if (dir > -1)
+		close(dir);
+
+	if (files)
+	{
 		for (i = 0; i < count; i++)
+			free(files[i]);
+
+		free(files);
+	}
+
+	free(ents);
+
+	if (!rv)
+	{
+		free(dl->buf);
+		dl->buf = NULL;
+	}
+
+	return rv;
+}
+
+static void uh_file_dirlist_free(struct uh_file_dirlist *dl)
+{
+	free(dl->path);
+	free(dl->url);
+	free(dl->buf);
+
+	memset(dl, 0, sizeof(*dl));
+}
+
+/* find the cached listing of the directory, which is still valid if the
+ * directory was not modified and it was rendered recently enough, or
+ * the slot to reuse for it */
+static struct uh_file_dirlist * uh_file_dirlist_lookup(struct path_info *pi,
+													   bool *valid)
+{
+	int i;
+	time_t now = time(NULL);
+	struct uh_file_dirlist *dl, *old = &uh_dirlist_cache[0];
+
+	for (i = 0; i < UH_DIRLIST_CACHE_SIZE; i++)
+	{
+		dl = &uh_dirlist_cache[i];
+
+		if (dl->path && !strcmp(dl->path, pi->phys) &&
+			!strcmp(dl->url, pi->name))
+		{
+			*valid = ((dl->dev == pi->stat.st_dev) &&
+					  (dl->ino == pi->stat.st_ino) &&
+					  (dl->mtime == pi->stat.st_mtime) &&
+					  ((now - dl->rendered) < UH_DIRLIST_CACHE_TTL));
+
+			return dl;
+		}
+
+		if (!dl->path || (old->path && (dl->rendered < old->rendered)))
+			old = dl;
+	}
+
+	*valid = false;
+	uh_file_dirlist_free(old);
+
+	return old;
+}
+
+/* whether a list of entity tags contains the given one, unlike the
+ * precondition checks above this leaves the header intact */
+static bool uh_file_match_tag(const char *hdr, const char *tag)
+{
+	int len = strlen(tag);
+
+	while (hdr && *hdr)
+	{
+		hdr += strspn(hdr, " ,");
+
+		if ((*hdr == '*') ||
+			(!strncmp(hdr, tag, len) && strchr(" ,", hdr[len])))
+			return true;
+
+		hdr = strpbrk(hdr, " ,");
+	}
+
+	return false;
+}
+
+static void uh_file_dirlist(struct client *cl, struct path_info *pi)
+{
+	bool valid;
+	struct uh_file_dirlist *dl, tmp;
+	char *hdr = cl->request.fields[UH_HTTP_HDR_IF_NONE_MATCH];
+
+	dl = uh_file_dirlist_lookup(pi, &valid);
+
+	if (!valid)
+	{
+		if (!uh_file_dirlist_render(&tmp, pi))
 		{
-			snprintf(pathptr, sizeof(filename) - (pathptr - filename),
-			         "%s", files[i]->d_name);
+			uh_http_sendhf(cl, 500, "Internal Server Error",
+						   "Unable to list directory");
+			return;
+		}
 
-			if (!stat(filename, &s) &&
-				(s.st_mode & S_IFDIR) && (s.st_mode & S_IXOTH))
+		/* huge listings are rendered for each request */
+		if (tmp.len > UH_DIRLIST_CACHE_MAX)
+		{
+			uh_file_dirlist_free(dl);
+			dl = &tmp;
+		}
+		else
+		{
+			free(dl->buf);
+
+			tmp.path = dl->path ? dl->path : strdup(pi->phys);
+			tmp.url  = dl->url  ? dl->url  : strdup(pi->name);
+
+			*dl = tmp;
+		}
+	}
+
+	if (hdr && uh_file_match_tag(hdr, dl->tag))
+	{
+		ensure_out(uh_file_response_304(cl, NULL));
+		ensure_out(uh_http_sendf(cl, NULL, "ETag: %s\r\n\r\n", dl->tag));
+		goto out;
+	}
+
+	ensure_out(uh_file_response_200(cl, NULL));
+	ensure_out(uh_http_sendf(cl, NULL,
+							 "ETag: %s\r\n"
+							 "Content-Type: text/html\r\n"
+							 "Content-Length: %d\r\n\r\n",
+							 dl->tag, dl->len));
+
+	if (cl->request.method != UH_HTTP_MSG_HEAD)
+		ensure_out(uh_http_send(cl, NULL, dl->buf, dl->len));
+
+out:
+	if (dl == &tmp)
+		free(tmp.buf);
+
+	/* a failed strdup() leaves a slot that never matches */
+	else if (!dl->path || !dl->url)
+		uh_file_dirlist_free(dl);
+}
+
+
+/* Parse a "bytes=" range set, returns the number of satisfiable ranges or
+ * -1 if the header is malformed and the whole file is to be sent. */
+static int uh_file_range_parse(const char *hdr, off_t size,
+							   struct uh_file_range *ranges)
+{
+	int n = 0;
+	char *p, *e;
+	unsigned long long a, b;
+
+	if (strncasecmp(hdr, "bytes=", 6))
+		return -1;
+
+	for (p = (char *)&hdr[6]; ; p++)
+	{
+		while (isspace(*p))
+			p++;
+
+		/* suffix range, the last bytes of the file */
+		if (*p == '-')
+		{
+			a = strtoull(&p[1], &e, 10);
+
+			if (e == &p[1])
+				return -1;
+
+			b = size;
+			a = (a < size) ? size - a : 0;
+
+			if (a == b)
+				a = size;
+		}
+		else
+		{
+			a = strtoull(p, &e, 10);
+
+			if ((e == p) || (*e != '-'))
+				return -1;
+
+			p = &e[1];
+			b = strtoull(p, &e, 10);
+
+			/* open ended range */
+			if (e == p)
+				b = size;
+			else if (b++ < a)
+				return -1;
+
+			if (b > size)
+				b = size;
+		}
+
+		/* ranges starting beyond the end are not satisfiable, skip them */
+		if (a < size)
+		{
+			if (n >= UH_LIMIT_RANGES)
+				return -1;
+
+			ranges[n].start = a;
+			ranges[n].end   = b;
+			n++;
+		}
+
+		for (p = e; isspace(*p); p++);
+
+		if (!*p)
+			break;
+
+		if (*p != ',')
+			return -1;
+	}
+
+	return n;
+}
+
+static int uh_file_part_header(char *buf, int len, struct uh_file_state *state,
+							   struct uh_file_range *r)
+{
+	return snprintf(buf, len,
+					"\r\n--%s\r\n"
+					"Content-Type: %s\r\n"
+					"Content-Range: bytes %llu-%llu/%llu\r\n\r\n",
+					state->boundary, state->mime,
+					(unsigned long long)r->start,
+					(unsigned long long)r->end - 1,
+					(unsigned long long)state->size);
+}
+
+static void uh_file_cleanup(struct client *cl)
+{
+	struct uh_file_state *state = (struct uh_file_state *)cl->priv;
+
+	/* image contents are served from the shared mapping */
+	if (!state->borrowed)
+	{
+		if (state->map)
+			munmap(state->map, state->size);
+
+		close(state->fd);
+	}
+
+	free(state);
+}
+
+static bool uh_file_send_cb(struct client *cl)
+{
+	int len;
+	char buf[UH_LIMIT_MSGHEAD];
+
+	struct uh_file_state *state = (struct uh_file_state *)cl->priv;
+	struct uh_file_range *r;
+
+	/* current range is complete, proceed with the next one */
+	if (state->offset >= state->length)
+	{
+		if (state->range >= state->nranges)
+		{
+			/* terminate multipart body */
+			if (state->multipart)
 			{
-				ensure_out(uh_http_sendf(cl, &cl->request,
-										 "<li><strong><a href='%s%s'>%s</a>/"
-										 "</strong><br /><small>modified: %s"
-										 "<br />directory - %.02f kbyte<br />"
-										 "<br /></small></li>",
-										 pi->name, files[i]->d_name,
-										 files[i]->d_name,
-										 uh_file_unix2date(s.st_mtime),
-										 s.st_size / 1024.0));
+				len = snprintf(buf, sizeof(buf), "\r\n--%s--\r\n",
+							   state->boundary);
+
+				ensure_out(uh_tcp_send(cl, buf, len));
 			}
 
-			*pathptr = 0;
+			return false;
 		}
 
-		/* list files */
-		for (i = 0; i < count; i++)
+		r = &state->ranges[state->range++];
+
+		if (state->multipart)
+		{
+			len = uh_file_part_header(buf, sizeof(buf), state, r);
+			ensure_out(uh_tcp_send(cl, buf, len));
+		}
+
+		state->offset = r->start;
+		state->length = r->end;
+	}
+
+	/* send a single chunk per writable event to not stall other clients */
+	if (state->offset < state->length)
+	{
+#ifndef __APPLE__
+		/* plain connection, let the kernel copy the file to the socket */
+		if (state->zerocopy)
+		{
+			len = min(state->length - state->offset, UH_LIMIT_SENDFILE);
+
+			/* the header collected by uh_file_request() goes out first,
+			 * hinting the kernel to merge it with the file data */
+			ensure_out(uh_tcp_uncork(cl, true));
+			ensure_out(uh_tcp_sendfile(cl, state->fd, &state->offset, len));
+			return true;
+		}
+#endif
+
+		/* data has to pass the tls layer, copy it from the mapping */
+		if (uh_client_congested(cl))
+			return true;
+
+		len = min(state->length - state->offset, UH_LIMIT_OUTBUF);
+
+		if (state->map)
 		{
-			snprintf(pathptr, sizeof(filename) - (pathptr - filename),
-			         "%s", files[i]->d_name);
+			ensure_out(uh_tcp_send(cl, state->map + state->offset, len));
+		}
 
-			if (!stat(filename, &s) &&
-				!(s.st_mode & S_IFDIR) && (s.st_mode & S_IROTH))
+		/* file could not be mapped, read it */
+		else
+		{
+			while (((len = pread(state->fd, buf, min(len, sizeof(buf)),
+								 state->offset)) < 0) && (errno == EINTR))
+				continue;
+
+			if (len <= 0)
 			{
-				ensure_out(uh_http_sendf(cl, &cl->request,
-										 "<li><strong><a href='%s%s'>%s</a>"
-										 "</strong><br /><small>modified: %s"
-										 "<br />%s - %.02f kbyte<br />"
-										 "<br /></small></li>",
-										 pi->name, files[i]->d_name,
-										 files[i]->d_name,
-										 uh_file_unix2date(s.st_mtime),
-										 uh_file_mime_lookup(filename),
-										 s.st_size / 1024.0));
+				D("File: read error on fd %d\n", state->fd);
+				cl->keepalive = false;
+				return false;
 			}
 
-			*pathptr = 0;
+			ensure_out(uh_tcp_send(cl, buf, len));
 		}
-	}
 
-	ensure_out(uh_http_sendf(cl, &cl->request, "</ol><hr /></body></html>"));
-	ensure_out(uh_http_sendf(cl, &cl->request, ""));
+		/* the first slice shares the write with the header */
+		ensure_out(uh_tcp_uncork(cl, false));
+
+		state->offset += len;
+		uh_client_yield(cl);
+		return true;
+	}
 
 out:
-	if (files)
+	return false;
+}
+
+static void uh_file_state_init(struct uh_file_state *state, int fd,
+							   struct stat *s, const char *mime)
+{
+	memset(state, 0, sizeof(*state));
+
+	state->fd = fd;
+	state->size = s->st_size;
+	state->mime = mime;
+
+	/* whole file unless ranges were requested */
+	state->nranges = 1;
+	state->ranges[0].end = s->st_size;
+
+	snprintf(state->boundary, sizeof(state->boundary), "%08x%08x",
+			 (unsigned int) s->st_ino, (unsigned int) time(NULL));
+
+#ifndef __APPLE__
+	state->zerocopy = true;
+#endif
+}
+
+static bool uh_file_send_body(struct client *cl, struct uh_file_state *tmpl)
+{
+	struct uh_file_state *state;
+
+	if (!(state = malloc(sizeof(*state))))
+		return false;
+
+	memcpy(state, tmpl, sizeof(*state));
+
+#ifdef HAVE_TLS
+	/* sendfile() would bypass the tls layer unless the kernel took over
+	 * the record encryption */
+	if (cl->tls && !(cl->server->conf->tls_offload &&
+	                 cl->server->conf->tls_ktls(cl)))
 	{
-		for (i = 0; i < count; i++)
-			free(files[i]);
+		state->zerocopy = false;
 
-		free(files);
+		if (state->borrowed)
+			goto out;
+
+		state->map = mmap(NULL, state->size, PROT_READ, MAP_SHARED,
+						  state->fd, 0);
+
+		if (state->map == MAP_FAILED)
+		{
+			D("File: cannot map fd %d: %s\n", state->fd, strerror(errno));
+			state->map = NULL;
+		}
+		else
+		{
+			madvise(state->map, state->size, MADV_SEQUENTIAL);
+		}
 	}
+
+out:
+#endif
+	cl->cb = uh_file_send_cb;
+	cl->cleanup = uh_file_cleanup;
+	cl->priv = state;
+
+	return true;
 }
 
+static int uh_file_send_header(struct client *cl, struct path_info *pi,
+							   struct uh_file_state *state, bool partial,
+							   off_t *length)
+{
+	int i;
+	struct uh_file_range *r = &state->ranges[0];
+
+	if (partial)
+		ensure_ret(uh_file_response_206(cl, &pi->stat));
+	else
+		ensure_ret(uh_file_response_200(cl, &pi->stat));
+
+	ensure_ret(uh_http_send(cl, NULL, "Accept-Ranges: bytes\r\n", -1));
+
+	if (state->vary)
+		ensure_ret(uh_http_send(cl, NULL, "Vary: Accept-Encoding\r\n", -1));
+
+	if (state->encoding)
+		ensure_ret(uh_http_sendf(cl, NULL, "Content-Encoding: %s\r\n",
+								 state->encoding));
+
+	if (state->multipart)
+	{
+		ensure_ret(uh_http_sendf(cl, NULL,
+			"Content-Type: multipart/byteranges; boundary=%s\r\n",
+			state->boundary));
+
+		/* part headers, data and closing delimiter */
+		*length = snprintf(NULL, 0, "\r\n--%s--\r\n", state->boundary);
+
+		for (i = 0; i < state->nranges; i++)
+		{
+			r = &state->ranges[i];
+			*length += uh_file_part_header(NULL, 0, state, r);
+			*length += r->end - r->start;
+		}
+	}
+	else
+	{
+		ensure_ret(uh_http_sendf(cl, NULL, "Content-Type: %s\r\n",
+								 state->mime));
+
+		if (partial)
+			ensure_ret(uh_http_sendf(cl, NULL,
+				"Content-Range: bytes %llu-%llu/%llu\r\n",
+				(unsigned long long)r->start,
+				(unsigned long long)r->end - 1,
+				(unsigned long long)state->size));
+
+		*length = r->end - r->start;
+	}
+
+	/* the body is framed by its length, no chunked encoding */
+	ensure_ret(uh_http_sendf(cl, NULL, "Content-Length: %llu\r\n",
+							 (unsigned long long)*length));
+
+	/* close header */
+	return uh_http_send(cl, NULL, "\r\n", -1);
+}
 
 bool uh_file_request(struct client *cl, struct path_info *pi)
 {
-	int rlen;
 	int ok = 1;
 	int fd = -1;
-	char buf[UH_LIMIT_MSGHEAD];
+	int n = -1;
+	char *hdr;
+	off_t length;
+	const struct path_encoding *enc = NULL;
+	struct uh_file_state state;
+	struct uh_file_range ranges[UH_LIMIT_RANGES];
+
+	/* request bodies are not read, the connection can not be reused */
+	if (cl->request.content_length > 0)
+		cl->keepalive = false;
+
+	/* collect the response header, it is sent along with the body */
+	uh_tcp_cork(cl);
 
 	/* we have a file */
-	if ((pi->stat.st_mode & S_IFREG) && ((fd = open(pi->phys, O_RDONLY)) > 0))
+	if ((pi->stat.st_mode & S_IFREG) && ((fd = uh_file_open(cl, pi, &enc)) > 0))
 	{
+		/* the lookup result may be cached, frame by the actual size, a
+		 * compressed variant gets its own entity tag from its own inode */
+		fstat(fd, &pi->stat);
+
 		/* test preconditions */
 		if (ok) ensure_out(uh_file_if_modified_since(cl, &pi->stat, &ok));
 		if (ok) ensure_out(uh_file_if_match(cl, &pi->stat, &ok));
-		if (ok) ensure_out(uh_file_if_range(cl, &pi->stat, &ok));
 		if (ok) ensure_out(uh_file_if_unmodified_since(cl, &pi->stat, &ok));
 		if (ok) ensure_out(uh_file_if_none_match(cl, &pi->stat, &ok));
 
 		if (ok > 0)
 		{
-			/* write status */
-			ensure_out(uh_file_response_200(cl, &pi->stat));
-
-			ensure_out(uh_http_sendf(cl, NULL, "Content-Type: %s\r\n",
-									 uh_file_mime_lookup(pi->name)));
+			uh_file_state_init(&state, fd, &pi->stat,
+							   uh_file_mime_lookup(pi->name));
 
-			ensure_out(uh_http_sendf(cl, NULL, "Content-Length: %i\r\n",
-									 pi->stat.st_size));
+			state.encoding = enc ? enc->name : NULL;
+			state.vary = (pi->encodings != 0);
 
-			/* if request was HTTP 1.1 we'll respond chunked */
-			if ((cl->request.version > UH_HTTP_VER_1_0) &&
-				(cl->request.method != UH_HTTP_MSG_HEAD))
+			/* partial content, ignored if the file changed meanwhile */
+			if ((hdr = cl->request.fields[UH_HTTP_HDR_RANGE]) &&
+				uh_file_if_range(cl, &pi->stat))
 			{
-				ensure_out(uh_http_send(cl, NULL,
-										"Transfer-Encoding: chunked\r\n", -1));
+				n = uh_file_range_parse(hdr, pi->stat.st_size, ranges);
+
+				if (!n)
+				{
+					ensure_out(uh_file_response_416(cl, &pi->stat));
+					ensure_out(uh_http_send(cl, NULL, "\r\n", -1));
+					goto out;
+				}
+				else if (n > 0)
+				{
+					memcpy(state.ranges, ranges, n * sizeof(ranges[0]));
+					state.nranges = n;
+					state.multipart = (n > 1);
+				}
 			}
 
-			/* close header */
-			ensure_out(uh_http_send(cl, NULL, "\r\n", -1));
+			ensure_out(uh_file_send_header(cl, pi, &state, (n > 0), &length));
 
-			/* send body */
-			if (cl->request.method != UH_HTTP_MSG_HEAD)
+			/* send body from the loop as the client accepts it */
+			if ((cl->request.method != UH_HTTP_MSG_HEAD) && (length > 0))
 			{
-				/* pump file data */
-				while ((rlen = read(fd, buf, sizeof(buf))) > 0)
-					ensure_out(uh_http_send(cl, &cl->request, buf, rlen));
+				if (!uh_file_send_body(cl, &state))
+				{
+					cl->keepalive = false;
+					goto out;
+				}
 
-				/* send trailer in chunked mode */
-				ensure_out(uh_http_send(cl, &cl->request, "", 0));
+				return true;
 			}
 		}
 
@@ -409,17 +1074,7 @@ bool uh_file_request(struct client *cl, struct path_info *pi)
 	/* directory */
 	else if ((pi->stat.st_mode & S_IFDIR) && !cl->server->conf->no_dirlists)
 	{
-		/* write status */
-		ensure_out(uh_file_response_200(cl, NULL));
-
-		if (cl->request.version > UH_HTTP_VER_1_0)
-			ensure_out(uh_http_send(cl, NULL,
-									"Transfer-Encoding: chunked\r\n", -1));
-
-		ensure_out(uh_http_send(cl, NULL,
-								"Content-Type: text/html\r\n\r\n", -1));
-
-		/* content */
+		/* status, headers and content */
 		uh_file_dirlist(cl, pi);
 	}
 
@@ -431,8 +1086,133 @@ bool uh_file_request(struct client *cl, struct path_info *pi)
 	}
 
 out:
+	uh_tcp_uncork(cl, false);
+
 	if (fd > -1)
 		close(fd);
 
 	return false;
 }
+
+static int uh_file_image_hdrs(struct client *cl, const char *tag, time_t mtime)
+{
+	return uh_http_sendf(cl, NULL,
+						 "Connection: %s\r\n"
+						 "ETag: %s\r\n"
+						 "Last-Modified: %s\r\n"
+						 "Date: %s\r\n",
+						 uh_http_connection(cl), tag,
+						 uh_file_unix2date(mtime), uh_file_date_now());
+}
+
+/* serve an entry of the docroot image, the data is sent from the shared
+ * mapping or the image descriptor, ranges are not supported for these */
+bool uh_file_image_request(struct client *cl, struct uh_image *img,
+						   const struct uh_image_entry *e)
+{
+	int i;
+	char *hdr;
+	bool vary = false;
+	const char *tag, *enc = NULL;
+	const struct uh_image_data *d = &e->data[0];
+	struct uh_file_state state;
+	struct stat s;
+	time_t mtime = ntohl(e->mtime);
+
+	if (cl->request.content_length > 0)
+		cl->keepalive = false;
+
+	uh_tcp_cork(cl);
+
+	/* prefer a precompressed variant */
+	for (i = 0; uh_path_encodings[i].name; i++)
+	{
+		if (!e->data[i + 1].offset)
+			continue;
+
+		vary = true;
+
+		if (!enc && (hdr = cl->request.fields[UH_HTTP_HDR_ACCEPT_ENCODING]) &&
+			uh_accept_encoding(hdr, uh_path_encodings[i].name))
+		{
+			enc = uh_path_encodings[i].name;
+			d = &e->data[i + 1];
+		}
+	}
+
+	tag = uh_image_str(img, d->tag);
+
+	/* preconditions */
+	if (((hdr = cl->request.fields[UH_HTTP_HDR_IF_MATCH]) &&
+		 !uh_file_match_tag(hdr, tag)) ||
+		((hdr = cl->request.fields[UH_HTTP_HDR_IF_UNMODIFIED_SINCE]) &&
+		 (uh_file_date2unix(hdr) < mtime)))
+	{
+		ensure_out(uh_file_response_412(cl));
+		ensure_out(uh_http_send(cl, NULL, "\r\n", -1));
+		goto out;
+	}
+
+	if ((hdr = cl->request.fields[UH_HTTP_HDR_IF_NONE_MATCH])
+		? uh_file_match_tag(hdr, tag)
+		: ((hdr = cl->request.fields[UH_HTTP_HDR_IF_MODIFIED_SINCE]) &&
+		   (uh_file_date2unix(hdr) >= mtime)))
+	{
+		if ((cl->request.method == UH_HTTP_MSG_GET) ||
+			(cl->request.method == UH_HTTP_MSG_HEAD))
+		{
+			ensure_out(uh_http_sendf(cl, NULL, "%s 304 Not Modified\r\n",
+									 http_versions[cl->request.version]));
+			ensure_out(uh_file_image_hdrs(cl, tag, mtime));
+		}
+		else
+		{
+			ensure_out(uh_file_response_412(cl));
+		}
+
+		ensure_out(uh_http_send(cl, NULL, "\r\n", -1));
+		goto out;
+	}
+
+	ensure_out(uh_http_sendf(cl, NULL, "%s 200 OK\r\n",
+							 http_versions[cl->request.version]));
+	ensure_out(uh_file_image_hdrs(cl, tag, mtime));
+
+	if (vary)
+		ensure_out(uh_http_send(cl, NULL, "Vary: Accept-Encoding\r\n", -1));
+
+	if (enc)
+		ensure_out(uh_http_sendf(cl, NULL, "Content-Encoding: %s\r\n", enc));
+
+	ensure_out(uh_http_sendf(cl, NULL,
+							 "Content-Type: %s\r\n"
+							 "Content-Length: %u\r\n\r\n",
+							 uh_image_str(img, e->mime),
+							 (unsigned int) ntohl(d->size)));
+
+	if ((cl->request.method != UH_HTTP_MSG_HEAD) && d->size)
+	{
+		/* the data is a single range of the image */
+		memset(&s, 0, sizeof(s));
+		s.st_size = img->size;
+
+		uh_file_state_init(&state, img->fd, &s, NULL);
+
+		state.map = img->map;
+		state.borrowed = true;
+		state.ranges[0].start = ntohl(d->offset);
+		state.ranges[0].end = ntohl(d->offset) + ntohl(d->size);
+
+		if (!uh_file_send_body(cl, &state))
+		{
+			cl->keepalive = false;
+			goto out;
+		}
+
+		return true;
+	}
+
+out:
+	uh_tcp_uncork(cl, false);
+	return false;
+}
@@ -17,6 +17,7 @@
  */
 
 #ifndef _UHTTPD_FILE_
+#define _UHTTPD_FILE_
 
 #include <fcntl.h>
 #include <time.h>
@@ -24,12 +25,68 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+
+#include "uhttpd-image.h"
+
+#define UH_MIME_BUCKETS	128
+
+#define UH_DIRLIST_CACHE_SIZE	8
+#define UH_DIRLIST_CACHE_TTL	10
+#define UH_DIRLIST_CACHE_MAX	262144
 
 struct mimetype {
 	const char *extn;
 	const char *mime;
+	struct mimetype *next;
+};
+
+struct uh_file_range {
+	off_t start;
+	off_t end;
+};
+
+struct uh_file_state {
+	int fd;
+	off_t offset;
+	off_t length;
+	off_t size;
+	char *map;
+	bool zerocopy;
+	bool multipart;
+	bool vary;
+	bool borrowed;
+	const char *mime;
+	const char *encoding;
+	char boundary[24];
+	int range;
+	int nranges;
+	struct uh_file_range ranges[UH_LIMIT_RANGES];
+};
+
+struct uh_file_dirent {
+	const char *name;
+	struct stat stat;
 };
 
+struct uh_file_dirlist {
+	char *path;
+	char *url;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	time_t rendered;
+	char tag[32];
+	char *buf;
+	int len;
+	int size;
+};
+
+struct mimetype * uh_file_mime_add(const char *extn, const char *mime);
+
 bool uh_file_request(struct client *cl, struct path_info *pi);
 
+bool uh_file_image_request(struct client *cl, struct uh_image *img,
+						   const struct uh_image_entry *e);
+
 #endif
@@ -0,0 +1,158 @@
+/*
+ * uhttpd - Tiny single-threaded httpd - Docroot image
+ *
+ *   Copyright (C) 2026 agent <agent@local>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "uhttpd.h"
+#include "uhttpd-utils.h"
+#include "uhttpd-image.h"
+
+#include <sys/mman.h>
+
+
+static bool uh_image_valid(struct uh_image *img)
+{
+	int i, j;
+	size_t end;
+	const struct uh_image_data *d;
+	const struct uh_image_header *hdr = (struct uh_image_header *)img->map;
+
+	if ((img->size < sizeof(*hdr)) ||
+		memcmp(hdr->magic, UH_IMAGE_MAGIC, sizeof(hdr->magic)) ||
+		(ntohl(hdr->version) != UH_IMAGE_VERSION) ||
+		(ntohl(hdr->size) != img->size))
+		return false;
+
+	img->count = ntohl(hdr->count);
+	img->entries = (struct uh_image_entry *)(img->map + sizeof(*hdr));
+
+	/* size_t is 32 bits wide on most targets, compare bounds against
+	 * the remaining space rather than summing possibly wrapping terms */
+	if ((img->count < 0) ||
+		((size_t)img->count > (img->size - sizeof(*hdr)) /
+		                      sizeof(*img->entries)))
+		return false;
+
+	end = sizeof(*hdr) + (size_t)img->count * sizeof(*img->entries);
+
+	if ((end >= img->size) || img->map[img->size - 1])
+		return false;
+
+	/* the final string is terminated by the last byte checked above, so
+	 * every in-bounds offset refers to a terminated string */
+	for (i = 0; i < img->count; i++)
+	{
+		if ((ntohl(img->entries[i].path) < end) ||
+			(ntohl(img->entries[i].path) >= img->size) ||
+			(ntohl(img->entries[i].mime) < end) ||
+			(ntohl(img->entries[i].mime) >= img->size))
+			return false;
+
+		for (j = 0; j < UH_IMAGE_VARIANTS; j++)
+		{
+			d = &img->entries[i].data[j];
+
+			if (!d->size && !d->offset)
+				continue;
+
+			if ((ntohl(d->offset) < end) || (ntohl(d->tag) < end) ||
+				(ntohl(d->tag) >= img->size) ||
+				(ntohl(d->offset) > img->size) ||
+				(ntohl(d->size) > img->size - ntohl(d->offset)))
+				return false;
+		}
+
+		if ((i > 0) && (strcmp(uh_image_str(img, img->entries[i-1].path),
+							   uh_image_str(img, img->entries[i].path)) >= 0))
+			return false;
+	}
+
+	return true;
+}
+
+struct uh_image * uh_image_open(const char *path)
+{
+	struct stat s;
+	struct uh_image *img;
+
+	if (!(img = malloc(sizeof(*img))))
+		return NULL;
+
+	memset(img, 0, sizeof(*img));
+
+	if (((img->fd = open(path, O_RDONLY)) < 0) || fstat(img->fd, &s))
+		goto err;
+
+	fd_cloexec(img->fd);
+
+	img->size = s.st_size;
+	img->map = mmap(NULL, img->size, PROT_READ, MAP_SHARED, img->fd, 0);
+
+	if (img->map == MAP_FAILED)
+	{
+		img->map = NULL;
+		goto err;
+	}
+
+	if (!uh_image_valid(img))
+	{
+		errno = EINVAL;
+		goto err;
+	}
+
+	return img;
+
+err:
+	if (img->map)
+		munmap(img->map, img->size);
+
+	if (img->fd > -1)
+		close(img->fd);
+
+	free(img);
+	return NULL;
+}
+
+/* find the entry of the decoded url path, the query string is ignored,
+ * the path is stored in the given buffer for the auth check */
+const struct uh_image_entry * uh_image_lookup(struct uh_image *img,
+											  const char *url,
+											  char *name, int len)
+{
+	int cmp, lo = 0, hi = img->count - 1, mid;
+	const char *q = strchr(url, '?');
+	int n = uh_urldecode(name, len - 1, url, q ? (q - url) : strlen(url));
+
+	if (n < 0)
+		return NULL;
+
+	name[n] = 0;
+
+	while (lo <= hi)
+	{
+		mid = (lo + hi) / 2;
+		cmp = strcmp(name, uh_image_str(img, img->entries[mid].path));
+
+		if (!cmp)
+			return &img->entries[mid];
+		else if (cmp < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
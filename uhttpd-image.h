@@ -0,0 +1,74 @@
+/*
+ * uhttpd - Tiny single-threaded httpd - Docroot image header
+ *
+ *   Copyright (C) 2026 agent <agent@local>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _UHTTPD_IMAGE_
+#define _UHTTPD_IMAGE_
+
+#include <stdint.h>
+
+/*
+ * An image is built by uhttpd-mkimage from a docroot and starts with a
+ * header, followed by the entries sorted by their url path, a table of
+ * nul terminated strings and the file contents. All fields are stored
+ * in network byte order, string and data positions are image offsets.
+ */
+
+#define UH_IMAGE_MAGIC		"uhIMAGE"
+#define UH_IMAGE_VERSION	1
+
+/* plain data and one variant per precompressed encoding */
+#define UH_IMAGE_VARIANTS	3
+
+struct uh_image_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint32_t size;
+};
+
+struct uh_image_data {
+	uint32_t offset;
+	uint32_t size;
+	uint32_t tag;
+};
+
+struct uh_image_entry {
+	uint32_t path;
+	uint32_t mime;
+	uint32_t mtime;
+	struct uh_image_data data[UH_IMAGE_VARIANTS];
+};
+
+struct uh_image {
+	int fd;
+	char *map;
+	size_t size;
+	int count;
+	const struct uh_image_entry *entries;
+};
+
+#define uh_image_str(img, off) \
+	((const char *)(img)->map + ntohl(off))
+
+struct uh_image * uh_image_open(const char *path);
+
+const struct uh_image_entry * uh_image_lookup(struct uh_image *img,
+											  const char *url,
+											  char *name, int len);
+
+#endif
@@ -21,6 +21,73 @@
 #include "uhttpd-lua.h"
 
 
+/* request of the in-process handler coroutine currently executing */
+static struct uh_lua_state *uh_lua_running = NULL;
+
+/* read request body data for an in-process handler, returns the number
+ * of pushed values or -1 if the client has nothing to read yet */
+static int uh_lua_recv_client(lua_State *L, struct uh_lua_state *state,
+							  char *buffer, int length)
+{
+	int rlen;
+	struct client *cl = state->cl;
+
+	/* end of body */
+	if (state->content_length <= 0)
+	{
+		lua_pushnumber(L, 0);
+		return 1;
+	}
+
+	length = min(length, state->content_length);
+
+	/* remaining data in http head buffer ... */
+	if (cl->httpbuf.len > 0)
+	{
+		rlen = min(length, cl->httpbuf.len);
+
+		memcpy(buffer, cl->httpbuf.ptr, rlen);
+
+		cl->httpbuf.len -= rlen;
+		cl->httpbuf.ptr += rlen;
+	}
+
+	/* ... or from the socket */
+	else
+	{
+#ifdef HAVE_TLS
+		if (cl->tls)
+			rlen = cl->server->conf->tls_recv(cl, buffer, length);
+		else
+#endif
+			rlen = uh_tcp_recv_lowlevel(cl, buffer, length);
+
+		if ((rlen < 0) &&
+			((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+		{
+			return -1;
+		}
+
+		/* client went away, treat as eof */
+		if (rlen <= 0)
+		{
+			state->content_length = 0;
+			lua_pushnumber(L, rlen);
+			return 1;
+		}
+	}
+
+	D("Lua: Client(%d) read %d body bytes\n", cl->fd.fd, rlen);
+
+	/* body consumed, it must not be parsed as the next request */
+	if ((state->content_length -= rlen) <= 0)
+		cl->request.content_length = 0;
+
+	lua_pushnumber(L, rlen);
+	lua_pushlstring(L, buffer, rlen);
+	return 2;
+}
+
 static int uh_lua_recv(lua_State *L)
 {
 	size_t length;
@@ -35,6 +102,20 @@ static int uh_lua_recv(lua_State *L)
 
 	if ((length > 0) && (length <= sizeof(buffer)))
 	{
+		/* in-process handler, suspend until the client sent more data */
+		if (uh_lua_running)
+		{
+			if ((rlen = uh_lua_recv_client(L, uh_lua_running,
+			                               buffer, length)) < 0)
+			{
+				uh_lua_running->wait = UH_LUA_WAIT_READ;
+				uh_lua_running->wait_len = length;
+				return lua_yield(L, 0);
+			}
+
+			return rlen;
+		}
+
 		/* receive data */
 		rlen = uh_raw_recv(fd, buffer, length, to);
 
@@ -80,6 +161,50 @@ static int uh_lua_send_common(lua_State *L, bool chunked)
 
 	buffer = luaL_checklstring(L, 1, &length);
 
+	/* in-process handler, queue the data and suspend while the client
+	 * does not keep up */
+	if (uh_lua_running)
+	{
+		struct client *cl = uh_lua_running->cl;
+
+		if (chunked)
+		{
+			if (length > 0)
+			{
+				snprintf(chunk, sizeof(chunk), "%X\r\n", (int) length);
+
+				slen = -1;
+				uh_tcp_cork(cl);
+				ensure_out(uh_tcp_send(cl, chunk, strlen(chunk)));
+				ensure_out(uh_tcp_send(cl, buffer, length));
+				ensure_out(uh_tcp_send(cl, "\r\n", 2));
+				ensure_out(uh_tcp_uncork(cl, false));
+
+				slen = strlen(chunk) + length + 2;
+			}
+			else
+			{
+				slen = uh_tcp_send(cl, "0\r\n\r\n", 5);
+			}
+		}
+		else
+		{
+			slen = uh_tcp_send(cl, buffer, length);
+		}
+
+		if (slen > 0)
+			uh_lua_running->data_sent = true;
+
+		if ((slen >= 0) && uh_client_congested(cl))
+		{
+			uh_lua_running->wait = UH_LUA_WAIT_WRITE;
+			uh_lua_running->wait_rv = slen;
+			return lua_yield(L, 0);
+		}
+
+		goto out;
+	}
+
 	if (chunked)
 	{
 		if (length > 0)
@@ -248,6 +373,101 @@ lua_State * uh_lua_init(const struct config *conf)
 	return L;
 }
 
+/* push the env table passed to the handler callback */
+static void uh_lua_env(lua_State *L, struct client *cl)
+{
+	int i;
+	char *query_string;
+	const char *prefix = cl->server->conf->lua_prefix;
+
+	struct http_request *req = &cl->request;
+
+	int content_length = req->content_length;
+
+	/* build env table */
+	lua_newtable(L);
+
+	/* request method */
+	lua_pushstring(L, http_methods[req->method]);
+	lua_setfield(L, -2, "REQUEST_METHOD");
+
+	/* request url */
+	lua_pushstring(L, req->url);
+	lua_setfield(L, -2, "REQUEST_URI");
+
+	/* script name */
+	lua_pushstring(L, cl->server->conf->lua_prefix);
+	lua_setfield(L, -2, "SCRIPT_NAME");
+
+	/* query string, path info */
+	if ((query_string = strchr(req->url, '?')) != NULL)
+	{
+		lua_pushstring(L, query_string + 1);
+		lua_setfield(L, -2, "QUERY_STRING");
+
+		if ((int)(query_string - req->url) > strlen(prefix))
+		{
+			lua_pushlstring(L,
+				&req->url[strlen(prefix)],
+				(int)(query_string - req->url) - strlen(prefix)
+			);
+
+			lua_setfield(L, -2, "PATH_INFO");
+		}
+	}
+	else if (strlen(req->url) > strlen(prefix))
+	{
+		lua_pushstring(L, &req->url[strlen(prefix)]);
+		lua_setfield(L, -2, "PATH_INFO");
+	}
+
+	/* http protcol version */
+	lua_pushnumber(L, 0.9 + (req->version / 10.0));
+	lua_setfield(L, -2, "HTTP_VERSION");
+
+	lua_pushstring(L, http_versions[req->version]);
+	lua_setfield(L, -2, "SERVER_PROTOCOL");
+
+
+	/* address information */
+	lua_pushstring(L, sa_straddr(&cl->peeraddr));
+	lua_setfield(L, -2, "REMOTE_ADDR");
+
+	lua_pushinteger(L, sa_port(&cl->peeraddr));
+	lua_setfield(L, -2, "REMOTE_PORT");
+
+	lua_pushstring(L, sa_straddr(&cl->servaddr));
+	lua_setfield(L, -2, "SERVER_ADDR");
+
+	lua_pushinteger(L, sa_port(&cl->servaddr));
+	lua_setfield(L, -2, "SERVER_PORT");
+
+	/* essential env vars */
+	if (req->fields[UH_HTTP_HDR_CONTENT_TYPE])
+	{
+		lua_pushstring(L, req->fields[UH_HTTP_HDR_CONTENT_TYPE]);
+		lua_setfield(L, -2, "CONTENT_TYPE");
+	}
+
+	lua_pushnumber(L, content_length);
+	lua_setfield(L, -2, "CONTENT_LENGTH");
+
+	/* misc. headers */
+	lua_newtable(L);
+
+	foreach_header(i, req->headers)
+	{
+		if( strcasecmp(req->headers[i], "Content-Length") &&
+			strcasecmp(req->headers[i], "Content-Type"))
+		{
+			lua_pushstring(L, req->headers[i+1]);
+			lua_setfield(L, -2, req->headers[i]);
+		}
+	}
+
+	lua_setfield(L, -2, "headers");
+}
+
 static void uh_lua_shutdown(struct uh_lua_state *state)
 {
 	free(state);
@@ -260,6 +480,43 @@ static bool uh_lua_socket_cb(struct client *cl)
 
 	struct uh_lua_state *state = (struct uh_lua_state *)cl->priv;
 
+#ifdef HAVE_SPLICE
+	/* move post data from the socket to the child, waiting for whichever
+	 * side is not ready */
+	while (state->splice && (state->content_length > 0))
+	{
+		len = uh_tcp_splice_in(cl, min(state->content_length,
+		                               UH_LIMIT_SPLICE));
+
+		if ((len < 0) && (errno == EAGAIN))
+			break;
+
+		if (len > 0)
+			state->content_length -= len;
+		else
+			state->content_length = 0;
+
+		/* explicit EOF notification for the child */
+		if (state->content_length <= 0)
+			uh_ufd_remove(&cl->wpipe);
+	}
+
+	/* the child writes the complete response, pass it through as-is */
+	while (state->splice && ((len = uh_tcp_splice(cl, UH_LIMIT_SPLICE)) > 0))
+		state->data_sent = true;
+
+	if (state->splice)
+	{
+		if ((len < 0) && (errno == EAGAIN))
+			return true;
+
+		D("Lua: Child(%d) presumed dead [%s]\n",
+		  cl->proc.pid, len ? strerror(errno) : "EOF");
+
+		goto out;
+	}
+#endif
+
 	/* there is unread post data waiting */
 	while (state->content_length > 0)
 	{
@@ -303,7 +560,8 @@ static bool uh_lua_socket_cb(struct client *cl)
 	}
 
 	/* try to read data from child */
-	while ((len = uh_raw_recv(cl->rpipe.fd, buf, sizeof(buf), -1)) > 0)
+	while (!uh_client_congested(cl) &&
+	       ((len = uh_raw_recv(cl->rpipe.fd, buf, sizeof(buf), -1)) > 0))
 	{
 		/* pass through buffer to socket */
 		D("Lua: Child(%d) relaying %d normal bytes\n", cl->proc.pid, len);
@@ -311,6 +569,10 @@ static bool uh_lua_socket_cb(struct client *cl)
 		state->data_sent = true;
 	}
 
+	/* output queue is full, continue once the client caught up */
+	if (uh_client_congested(cl))
+		return true;
+
 	/* got EOF or read error from child */
 	if ((len == 0) ||
 		((errno != EAGAIN) && (errno != EWOULDBLOCK) && (len == -1)))
@@ -339,11 +601,180 @@ out:
 	return false;
 }
 
+static void uh_lua_hook(lua_State *L, lua_Debug *ar)
+{
+	/* script time budget exhausted, abort the handler */
+	if (uh_lua_running && (time(NULL) >= uh_lua_running->deadline))
+	{
+		uh_lua_running->timedout = true;
+		luaL_error(L, "script timeout exceeded");
+	}
+}
+
+static int uh_lua_resume(struct uh_lua_state *state, int nargs)
+{
+	int rv;
+
+	state->wait = UH_LUA_WAIT_NONE;
+
+	uh_lua_running = state;
+	rv = lua_resume(state->co, nargs);
+	uh_lua_running = NULL;
+
+	return rv;
+}
+
+static void uh_lua_finish(struct client *cl, struct uh_lua_state *state,
+						  int rv)
+{
+	const char *err_str;
+	struct http_request *req = &cl->request;
+
+	if (state->timedout && !state->data_sent)
+	{
+		uh_http_sendhf(cl, 504, "Gateway Timeout",
+					   "The Lua handler took too long to produce a "
+					   "response\n");
+	}
+	else if (rv && !state->data_sent)
+	{
+		if (!(err_str = lua_tostring(state->co, -1)))
+			err_str = "Unknown error";
+
+		uh_http_sendf(cl, NULL,
+					  "%s 500 Internal Server Error\r\n"
+					  "Connection: close\r\n"
+					  "Content-Type: text/plain\r\n"
+					  "Content-Length: %i\r\n\r\n"
+					  "Lua raised a runtime error:\n  %s\n",
+					  http_versions[req->version],
+					  31 + (int) strlen(err_str), err_str);
+	}
+	else if (!state->data_sent)
+	{
+		uh_http_sendhf(cl, 502, "Bad Gateway",
+					   "The Lua handler did not produce any response\n");
+	}
+}
+
+static bool uh_lua_inproc_cb(struct client *cl)
+{
+	int rv, nargs = 0;
+	char buffer[UH_LIMIT_MSGHEAD];
+
+	struct uh_lua_state *state = (struct uh_lua_state *)cl->priv;
+
+	switch (state->wait)
+	{
+	/* complete the pending read, its results are returned by recv() */
+	case UH_LUA_WAIT_READ:
+		if ((nargs = uh_lua_recv_client(state->co, state, buffer,
+		                                state->wait_len)) < 0)
+			return true;
+
+		break;
+
+	/* the output queue drained, return the send() result */
+	case UH_LUA_WAIT_WRITE:
+		if (uh_client_congested(cl))
+			return true;
+
+		lua_pushnumber(state->co, state->wait_rv);
+		nargs = 1;
+		break;
+
+	/* handler yielded on its own */
+	case UH_LUA_WAIT_NONE:
+		break;
+	}
+
+	if ((rv = uh_lua_resume(state, nargs)) == LUA_YIELD)
+	{
+		/* not waiting for i/o, resume on the next loop iteration */
+		if (state->wait == UH_LUA_WAIT_NONE)
+			uh_client_yield(cl);
+
+		return true;
+	}
+
+	uh_lua_finish(cl, state, rv);
+	return false;
+}
+
+static void uh_lua_inproc_close(struct client *cl)
+{
+	struct uh_lua_state *state = (struct uh_lua_state *)cl->priv;
+
+	luaL_unref(cl->server->conf->lua_state, LUA_REGISTRYINDEX, state->ref);
+	free(state);
+}
+
+static void uh_lua_inproc_timeout_cb(struct uloop_timeout *t)
+{
+	struct client *cl = container_of(t, struct client, timeout);
+	struct uh_lua_state *state = (struct uh_lua_state *)cl->priv;
+
+	D("Lua: Client(%d) handler suspended for too long\n", cl->fd.fd);
+
+	if (!state->data_sent)
+		uh_http_sendhf(cl, 504, "Gateway Timeout",
+					   "The Lua handler took too long to produce a "
+					   "response\n");
+
+	uh_client_shutdown(cl);
+}
+
+/* run the handler in a coroutine of the main state, it is suspended
+ * whenever it would block on the client and resumed by the socket
+ * callback, a hook enforces the script timeout while it is running */
+static bool uh_lua_request_inproc(struct client *cl, lua_State *L,
+								  struct uh_lua_state *state)
+{
+	int rv;
+	struct config *conf = cl->server->conf;
+	struct http_request *req = &cl->request;
+
+	memset(state, 0, sizeof(*state));
+
+	state->cl = cl;
+	state->deadline = time(NULL) + conf->script_timeout;
+	/* the announced body of any method, buffered bytes beyond it belong
+	 * to the next request */
+	state->content_length = req->content_length;
+
+	/* anchor the thread in the registry while the request is running */
+	state->co = lua_newthread(L);
+	state->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	lua_sethook(state->co, uh_lua_hook, LUA_MASKCOUNT, UH_LUA_HOOK_COUNT);
+
+	/* put handler callback and env table on the coroutine stack */
+	lua_getglobal(state->co, UH_LUA_CALLBACK);
+	uh_lua_env(state->co, cl);
+
+	cl->priv = state;
+	cl->cleanup = uh_lua_inproc_close;
+
+	/* handler completed without waiting on the client */
+	if ((rv = uh_lua_resume(state, 1)) != LUA_YIELD)
+	{
+		uh_lua_finish(cl, state, rv);
+		return false;
+	}
+
+	if (state->wait == UH_LUA_WAIT_NONE)
+		uh_client_yield(cl);
+
+	cl->timeout.cb = uh_lua_inproc_timeout_cb;
+	uloop_timeout_set(&cl->timeout, conf->script_timeout * 1000);
+
+	cl->cb = uh_lua_inproc_cb;
+
+	return true;
+}
+
 bool uh_lua_request(struct client *cl, lua_State *L)
 {
-	int i;
-	char *query_string;
-	const char *prefix = cl->server->conf->lua_prefix;
 	const char *err_str = NULL;
 
 	int rfd[2] = { 0, 0 };
@@ -354,16 +785,21 @@ bool uh_lua_request(struct client *cl, lua_State *L)
 	struct uh_lua_state *state;
 	struct http_request *req = &cl->request;
 
-	int content_length = cl->httpbuf.len;
 
+	/* the handler writes raw HTTP, its response framing is unknown */
+	cl->keepalive = false;
 
 	/* allocate state */
 	if (!(state = malloc(sizeof(*state))))
 	{
-		uh_client_error(cl, 500, "Internal Server Error", "Out of memory");
+		uh_http_sendhf(cl, 500, "Internal Server Error", "Out of memory");
 		return false;
 	}
 
+	/* run the handler within the server process */
+	if (cl->server->conf->lua_inproc)
+		return uh_lua_request_inproc(cl, L, state);
+
 	/* spawn pipes for me->child, child->me */
 	if ((pipe(rfd) < 0) || (pipe(wfd) < 0))
 	{
@@ -372,8 +808,8 @@ bool uh_lua_request(struct client *cl, lua_State *L)
 		if (wfd[0] > 0) close(wfd[0]);
 		if (wfd[1] > 0) close(wfd[1]);
 
-		uh_client_error(cl, 500, "Internal Server Error",
-						"Failed to create pipe: %s", strerror(errno));
+		uh_http_sendhf(cl, 500, "Internal Server Error",
+					   "Failed to create pipe: %s", strerror(errno));
 
 		return false;
 	}
@@ -382,8 +818,8 @@ bool uh_lua_request(struct client *cl, lua_State *L)
 	switch ((child = fork()))
 	{
 	case -1:
-		uh_client_error(cl, 500, "Internal Server Error",
-						"Failed to fork child: %s", strerror(errno));
+		uh_http_sendhf(cl, 500, "Internal Server Error",
+					   "Failed to fork child: %s", strerror(errno));
 
 		return false;
 
@@ -411,94 +847,7 @@ bool uh_lua_request(struct client *cl, lua_State *L)
 		lua_getglobal(L, UH_LUA_CALLBACK);
 
 		/* build env table */
-		lua_newtable(L);
-
-		/* request method */
-		lua_pushstring(L, http_methods[req->method]);
-		lua_setfield(L, -2, "REQUEST_METHOD");
-
-		/* request url */
-		lua_pushstring(L, req->url);
-		lua_setfield(L, -2, "REQUEST_URI");
-
-		/* script name */
-		lua_pushstring(L, cl->server->conf->lua_prefix);
-		lua_setfield(L, -2, "SCRIPT_NAME");
-
-		/* query string, path info */
-		if ((query_string = strchr(req->url, '?')) != NULL)
-		{
-			lua_pushstring(L, query_string + 1);
-			lua_setfield(L, -2, "QUERY_STRING");
-
-			if ((int)(query_string - req->url) > strlen(prefix))
-			{
-				lua_pushlstring(L,
-					&req->url[strlen(prefix)],
-					(int)(query_string - req->url) - strlen(prefix)
-				);
-
-				lua_setfield(L, -2, "PATH_INFO");
-			}
-		}
-		else if (strlen(req->url) > strlen(prefix))
-		{
-			lua_pushstring(L, &req->url[strlen(prefix)]);
-			lua_setfield(L, -2, "PATH_INFO");
-		}
-
-		/* http protcol version */
-		lua_pushnumber(L, 0.9 + (req->version / 10.0));
-		lua_setfield(L, -2, "HTTP_VERSION");
-
-		lua_pushstring(L, http_versions[req->version]);
-		lua_setfield(L, -2, "SERVER_PROTOCOL");
-
-
-		/* address information */
-		lua_pushstring(L, sa_straddr(&cl->peeraddr));
-		lua_setfield(L, -2, "REMOTE_ADDR");
-
-		lua_pushinteger(L, sa_port(&cl->peeraddr));
-		lua_setfield(L, -2, "REMOTE_PORT");
-
-		lua_pushstring(L, sa_straddr(&cl->servaddr));
-		lua_setfield(L, -2, "SERVER_ADDR");
-
-		lua_pushinteger(L, sa_port(&cl->servaddr));
-		lua_setfield(L, -2, "SERVER_PORT");
-
-		/* essential env vars */
-		foreach_header(i, req->headers)
-		{
-			if (!strcasecmp(req->headers[i], "Content-Length"))
-			{
-				content_length = atoi(req->headers[i+1]);
-			}
-			else if (!strcasecmp(req->headers[i], "Content-Type"))
-			{
-				lua_pushstring(L, req->headers[i+1]);
-				lua_setfield(L, -2, "CONTENT_TYPE");
-			}
-		}
-
-		lua_pushnumber(L, content_length);
-		lua_setfield(L, -2, "CONTENT_LENGTH");
-
-		/* misc. headers */
-		lua_newtable(L);
-
-		foreach_header(i, req->headers)
-		{
-			if( strcasecmp(req->headers[i], "Content-Length") &&
-				strcasecmp(req->headers[i], "Content-Type"))
-			{
-				lua_pushstring(L, req->headers[i+1]);
-				lua_setfield(L, -2, req->headers[i]);
-			}
-		}
-
-		lua_setfield(L, -2, "headers");
+		uh_lua_env(L, cl);
 
 
 		/* call */
@@ -549,20 +898,12 @@ bool uh_lua_request(struct client *cl, lua_State *L)
 
 		D("Lua: Child(%d) created: rfd(%d) wfd(%d)\n", child, rfd[0], wfd[1]);
 
-		state->content_length = cl->httpbuf.len;
+		/* the announced body of any method, buffered bytes beyond it
+		 * belong to the next request */
+		state->content_length = req->content_length;
 
-		/* find content length */
-		if (req->method == UH_HTTP_MSG_POST)
-		{
-			foreach_header(i, req->headers)
-			{
-				if (!strcasecmp(req->headers[i], "Content-Length"))
-				{
-					state->content_length = atoi(req->headers[i+1]);
-					break;
-				}
-			}
-		}
+		/* relay the pipes within the kernel on plain connections */
+		state->splice = uh_tcp_can_splice(cl);
 
 		cl->cb = uh_lua_socket_cb;
 		cl->priv = state;
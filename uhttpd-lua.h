@@ -20,6 +20,7 @@
 
 #include <math.h>  /* floor() */
 #include <errno.h>
+#include <time.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -31,10 +32,28 @@
 #define UH_LUA_ERR_TOOBIG  -2
 #define UH_LUA_ERR_PARAM   -3
 
+/* instructions between two checks of the script time budget */
+#define UH_LUA_HOOK_COUNT	1000
+
+
+enum uh_lua_wait {
+	UH_LUA_WAIT_NONE,
+	UH_LUA_WAIT_READ,
+	UH_LUA_WAIT_WRITE,
+};
 
 struct uh_lua_state {
 	int content_length;
 	bool data_sent;
+	bool splice;
+	struct client *cl;
+	lua_State *co;
+	int ref;
+	enum uh_lua_wait wait;
+	int wait_len;
+	int wait_rv;
+	time_t deadline;
+	bool timedout;
 };
 
 lua_State * uh_lua_init(const struct config *conf);
@@ -0,0 +1,295 @@
+/*
+ * uhttpd - Tiny single-threaded httpd - Metrics
+ *
+ *   Copyright (C) 2026 agent <agent@local>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "uhttpd.h"
+#include "uhttpd-utils.h"
+#include "uhttpd-metrics.h"
+
+#include <sys/mman.h>
+
+
+/* counters of a single process until the workers share a mapping */
+static struct uh_metrics uh_metrics_local;
+static struct uh_metrics *uh_metrics_slots = &uh_metrics_local;
+static int uh_metrics_nslots = 1;
+
+struct uh_metrics *uh_metrics = &uh_metrics_local;
+
+const char *uh_metrics_handlers[__UH_METRICS_MAX] = {
+	"file", "cgi", "lua", "ubus"
+};
+
+/* upper bounds in microseconds */
+const unsigned int uh_metrics_bounds[UH_METRICS_BUCKETS - 1] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+	100000, 250000, 500000, 1000000
+};
+
+
+uint64_t uh_metrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void uh_metrics_observe(struct uh_metrics_hist *h, uint64_t usec)
+{
+	int i;
+
+	for (i = 0; (i < UH_METRICS_BUCKETS - 1) && (usec > uh_metrics_bounds[i]);
+	     i++);
+
+	h->count[i]++;
+	h->sum += usec;
+}
+
+/* map one slot per process before the workers are forked, slot zero is
+ * kept by the supervisor */
+bool uh_metrics_init(int slots)
+{
+	struct uh_metrics *m;
+
+	m = mmap(NULL, slots * sizeof(*m), PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (m == MAP_FAILED)
+		return false;
+
+	memset(m, 0, slots * sizeof(*m));
+	memcpy(&m[0], &uh_metrics_local, sizeof(*m));
+
+	uh_metrics = uh_metrics_slots = m;
+	uh_metrics_nslots = slots;
+
+	return true;
+}
+
+/* the clients of a previous worker in this slot are gone with it, the
+ * totals are carried on */
+void uh_metrics_attach(int slot)
+{
+	if (slot < uh_metrics_nslots)
+	{
+		uh_metrics = &uh_metrics_slots[slot];
+		uh_metrics->clients = 0;
+	}
+}
+
+static void uh_metrics_hist_sum(struct uh_metrics_hist *d,
+								const struct uh_metrics_hist *s)
+{
+	int i;
+
+	for (i = 0; i < UH_METRICS_BUCKETS; i++)
+		d->count[i] += s->count[i];
+
+	d->sum += s->sum;
+}
+
+void uh_metrics_sum(struct uh_metrics *sum)
+{
+	int i, j, k;
+	const struct uh_metrics *m;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for (i = 0; i < uh_metrics_nslots; i++)
+	{
+		m = &uh_metrics_slots[i];
+
+		sum->accepts          += m->accepts;
+		sum->accepts_deferred += m->accepts_deferred;
+		sum->accepts_refused  += m->accepts_refused;
+		sum->clients          += m->clients;
+		sum->bytes_in         += m->bytes_in;
+		sum->bytes_out        += m->bytes_out;
+		sum->tls_handshakes   += m->tls_handshakes;
+		sum->tls_failures     += m->tls_failures;
+		sum->cgi_spawns       += m->cgi_spawns;
+		sum->cgi_timeouts     += m->cgi_timeouts;
+		sum->cgi_kills        += m->cgi_kills;
+
+		sum->path_cache_hits      += m->path_cache_hits;
+		sum->path_cache_misses    += m->path_cache_misses;
+		sum->path_cache_evictions += m->path_cache_evictions;
+
+		uh_metrics_hist_sum(&sum->cgi_spawn, &m->cgi_spawn);
+
+		for (j = 0; j < __UH_METRICS_MAX; j++)
+		{
+			sum->handlers[j].requests += m->handlers[j].requests;
+
+			for (k = 0; k < 5; k++)
+				sum->handlers[j].status[k] += m->handlers[j].status[k];
+
+			uh_metrics_hist_sum(&sum->handlers[j].ttfb, &m->handlers[j].ttfb);
+		}
+	}
+}
+
+/* the request is timed from its dispatch to the first response byte */
+void uh_metrics_start(struct client *cl, enum uh_metrics_handler handler)
+{
+	cl->metrics.handler = handler;
+	cl->metrics.start = uh_metrics_now();
+}
+
+/* called with the first data sent for the request, the status class is
+ * taken from the status line if there is one */
+void uh_metrics_response(struct client *cl, const char *buf, int len)
+{
+	struct uh_metrics_requests *r = &uh_metrics->handlers[cl->metrics.handler];
+
+	r->requests++;
+
+	if ((len > 12) && !strncmp(buf, "HTTP/", 5) &&
+		(buf[9] >= '1') && (buf[9] <= '5'))
+		r->status[buf[9] - '1']++;
+
+	uh_metrics_observe(&r->ttfb, uh_metrics_now() - cl->metrics.start);
+	cl->metrics.start = 0;
+}
+
+static int uh_metrics_format_hist(char *buf, int len, const char *name,
+								  const char *label,
+								  const struct uh_metrics_hist *h)
+{
+	int i, n = 0;
+	uint64_t total = 0;
+
+	for (i = 0; i < UH_METRICS_BUCKETS; i++)
+	{
+		total += h->count[i];
+
+		if (i < UH_METRICS_BUCKETS - 1)
+			n += snprintf(buf + n, max(len - n, 0),
+						  "%s_bucket{%s%sle=\"%.4f\"} %llu\n",
+						  name, label, *label ? "," : "",
+						  uh_metrics_bounds[i] / 1000000.0,
+						  (unsigned long long)total);
+		else
+			n += snprintf(buf + n, max(len - n, 0),
+						  "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+						  name, label, *label ? "," : "",
+						  (unsigned long long)total);
+	}
+
+	n += snprintf(buf + n, max(len - n, 0),
+				  "%s_sum%s%s%s %.6f\n%s_count%s%s%s %llu\n",
+				  name, *label ? "{" : "", label, *label ? "}" : "",
+				  h->sum / 1000000.0,
+				  name, *label ? "{" : "", label, *label ? "}" : "",
+				  (unsigned long long)total);
+
+	return n;
+}
+
+/* plain text in the Prometheus exposition format, returns the length the
+ * output would need like snprintf() */
+int uh_metrics_format(char *buf, int len)
+{
+	int i, j, n;
+	char label[32];
+	struct uh_metrics m;
+
+	uh_metrics_sum(&m);
+
+	n = snprintf(buf, len,
+				 "uhttpd_accepts_total %llu\n"
+				 "uhttpd_accepts_deferred_total %llu\n"
+				 "uhttpd_accepts_refused_total %llu\n"
+				 "uhttpd_clients %lld\n"
+				 "uhttpd_received_bytes_total %llu\n"
+				 "uhttpd_sent_bytes_total %llu\n"
+				 "uhttpd_tls_handshakes_total %llu\n"
+				 "uhttpd_tls_handshake_failures_total %llu\n"
+				 "uhttpd_cgi_spawns_total %llu\n"
+				 "uhttpd_cgi_timeouts_total %llu\n"
+				 "uhttpd_cgi_kills_total %llu\n"
+				 "uhttpd_path_cache_hits_total %llu\n"
+				 "uhttpd_path_cache_misses_total %llu\n"
+				 "uhttpd_path_cache_evictions_total %llu\n",
+				 (unsigned long long)m.accepts,
+				 (unsigned long long)m.accepts_deferred,
+				 (unsigned long long)m.accepts_refused,
+				 (long long)m.clients,
+				 (unsigned long long)m.bytes_in,
+				 (unsigned long long)m.bytes_out,
+				 (unsigned long long)m.tls_handshakes,
+				 (unsigned long long)m.tls_failures,
+				 (unsigned long long)m.cgi_spawns,
+				 (unsigned long long)m.cgi_timeouts,
+				 (unsigned long long)m.cgi_kills,
+				 (unsigned long long)m.path_cache_hits,
+				 (unsigned long long)m.path_cache_misses,
+				 (unsigned long long)m.path_cache_evictions);
+
+	n += uh_metrics_format_hist(buf + n, max(len - n, 0),
+								"uhttpd_cgi_spawn_seconds", "", &m.cgi_spawn);
+
+	for (i = 0; i < __UH_METRICS_MAX; i++)
+	{
+		snprintf(label, sizeof(label), "handler=\"%s\"",
+				 uh_metrics_handlers[i]);
+
+		n += snprintf(buf + n, max(len - n, 0),
+					  "uhttpd_requests_total{%s} %llu\n",
+					  label, (unsigned long long)m.handlers[i].requests);
+
+		for (j = 0; j < 5; j++)
+			n += snprintf(buf + n, max(len - n, 0),
+						  "uhttpd_responses_total{%s,class=\"%dxx\"} %llu\n",
+						  label, j + 1,
+						  (unsigned long long)m.handlers[i].status[j]);
+
+		n += uh_metrics_format_hist(buf + n, max(len - n, 0),
+									"uhttpd_ttfb_seconds", label,
+									&m.handlers[i].ttfb);
+	}
+
+	return n;
+}
+
+bool uh_metrics_request(struct client *cl)
+{
+	int len;
+	char buf[16384];
+
+	len = min(uh_metrics_format(buf, sizeof(buf)), sizeof(buf) - 1);
+
+	uh_tcp_cork(cl);
+
+	uh_http_sendf(cl, NULL,
+				  "%s 200 OK\r\n"
+				  "Connection: %s\r\n"
+				  "Content-Type: text/plain; version=0.0.4\r\n"
+				  "Cache-Control: no-cache\r\n"
+				  "Content-Length: %d\r\n\r\n",
+				  http_versions[cl->request.version],
+				  uh_http_connection(cl), len);
+
+	if (cl->request.method != UH_HTTP_MSG_HEAD)
+		uh_tcp_send(cl, buf, len);
+
+	uh_tcp_uncork(cl, false);
+
+	return false;
+}
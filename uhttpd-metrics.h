@@ -0,0 +1,92 @@
+/*
+ * uhttpd - Tiny single-threaded httpd - Metrics header
+ *
+ *   Copyright (C) 2026 agent <agent@local>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _UHTTPD_METRICS_
+#define _UHTTPD_METRICS_
+
+#include <stdint.h>
+#include <time.h>
+
+/* latency buckets, the last one counts everything above the bounds */
+#define UH_METRICS_BUCKETS	14
+
+enum uh_metrics_handler {
+	UH_METRICS_FILE,
+	UH_METRICS_CGI,
+	UH_METRICS_LUA,
+	UH_METRICS_UBUS,
+	__UH_METRICS_MAX
+};
+
+struct uh_metrics_hist {
+	uint64_t count[UH_METRICS_BUCKETS];
+	uint64_t sum;
+};
+
+struct uh_metrics_requests {
+	uint64_t requests;
+	uint64_t status[5];
+	struct uh_metrics_hist ttfb;
+};
+
+/* counters of one process, the workers and the supervisor each own a
+ * slot of a shared mapping and write to it without synchronisation */
+struct uh_metrics {
+	uint64_t accepts;
+	uint64_t accepts_deferred;
+	uint64_t accepts_refused;
+	int64_t clients;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t tls_handshakes;
+	uint64_t tls_failures;
+	uint64_t cgi_spawns;
+	uint64_t cgi_timeouts;
+	uint64_t cgi_kills;
+	uint64_t path_cache_hits;
+	uint64_t path_cache_misses;
+	uint64_t path_cache_evictions;
+	struct uh_metrics_hist cgi_spawn;
+	struct uh_metrics_requests handlers[__UH_METRICS_MAX];
+};
+
+extern struct uh_metrics *uh_metrics;
+extern const char *uh_metrics_handlers[__UH_METRICS_MAX];
+extern const unsigned int uh_metrics_bounds[UH_METRICS_BUCKETS - 1];
+
+#define uh_metrics_inc(field) \
+	(uh_metrics->field++)
+
+#define uh_metrics_add(field, n) \
+	(uh_metrics->field += (n))
+
+uint64_t uh_metrics_now(void);
+
+void uh_metrics_observe(struct uh_metrics_hist *h, uint64_t usec);
+
+bool uh_metrics_init(int slots);
+void uh_metrics_attach(int slot);
+void uh_metrics_sum(struct uh_metrics *sum);
+
+void uh_metrics_start(struct client *cl, enum uh_metrics_handler handler);
+void uh_metrics_response(struct client *cl, const char *buf, int len);
+
+int uh_metrics_format(char *buf, int len);
+bool uh_metrics_request(struct client *cl);
+
+#endif
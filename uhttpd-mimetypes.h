@@ -17,6 +17,7 @@
  */
 
 #ifndef _UHTTPD_MIMETYPES_
+#define _UHTTPD_MIMETYPES_
 
 static struct mimetype uh_mime_types[] = {
 
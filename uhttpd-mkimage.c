@@ -0,0 +1,411 @@
+/*
+ * uhttpd - Tiny single-threaded httpd - Docroot image builder
+ *
+ *   Copyright (C) 2026 agent <agent@local>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "uhttpd.h"
+#include "uhttpd-utils.h"
+#include "uhttpd-file.h"
+#include "uhttpd-image.h"
+
+#include "uhttpd-mimetypes.h"
+
+
+/* sidecar extensions of the precompressed variants, in the order of
+ * uh_path_encodings[] which the server uses to pick them */
+static const char *uh_mkimage_extns[UH_IMAGE_VARIANTS - 1] = {
+	".br", ".gz"
+};
+
+struct uh_mkimage_blob {
+	char *path;
+	uint32_t size;
+	uint32_t offset;
+	char tag[32];
+};
+
+struct uh_mkimage_entry {
+	char *url;
+	const char *mime;
+	time_t mtime;
+	int blobs[UH_IMAGE_VARIANTS];
+};
+
+static struct uh_mkimage_blob *blobs = NULL;
+static int n_blobs = 0;
+
+static struct uh_mkimage_entry *entries = NULL;
+static int n_entries = 0;
+
+static const char *index_files[16];
+static int n_index_files = 0;
+
+
+static void * uh_mkimage_grow(void *ptr, int count, size_t size)
+{
+	/* grow in steps of 64 elements */
+	if (!(count % 64) && !(ptr = realloc(ptr, (count + 64) * size)))
+	{
+		fprintf(stderr, "Error: Out of memory\n");
+		exit(1);
+	}
+
+	return ptr;
+}
+
+static const char * uh_mkimage_mime(const char *path)
+{
+	struct mimetype *m;
+	const char *base = path;
+	const char *p;
+
+	for (p = path; *p; p++)
+		if (*p == '/')
+			base = &p[1];
+
+	/* same order as the server, whole names first, then the longest
+	 * extension */
+	for (m = uh_mime_types; m->extn; m++)
+		if (!strcasecmp(m->extn, base))
+			return m->mime;
+
+	for (p = base; *p; p++)
+		if (*p == '.')
+			for (m = uh_mime_types; m->extn; m++)
+				if (!strcasecmp(m->extn, &p[1]))
+					return m->mime;
+
+	return "application/octet-stream";
+}
+
+static int uh_mkimage_blob(const char *path, struct stat *s)
+{
+	int i;
+
+	/* index files and variants are stored once for all their urls */
+	for (i = 0; i < n_blobs; i++)
+		if (!strcmp(blobs[i].path, path))
+			return i;
+
+	if (s->st_size > UINT32_MAX)
+	{
+		fprintf(stderr, "Error: %s is too large\n", path);
+		exit(1);
+	}
+
+	blobs = uh_mkimage_grow(blobs, n_blobs, sizeof(*blobs));
+	memset(&blobs[n_blobs], 0, sizeof(*blobs));
+
+	blobs[n_blobs].path = strdup(path);
+	blobs[n_blobs].size = s->st_size;
+
+	return n_blobs++;
+}
+
+static void uh_mkimage_add(const char *url, const char *path, struct stat *s)
+{
+	int i;
+	char variant[PATH_MAX];
+	struct stat vs;
+	struct uh_mkimage_entry *e;
+
+	entries = uh_mkimage_grow(entries, n_entries, sizeof(*entries));
+	e = &entries[n_entries++];
+
+	e->url = strdup(url);
+	e->mime = uh_mkimage_mime(path);
+	e->mtime = s->st_mtime;
+	e->blobs[0] = uh_mkimage_blob(path, s);
+
+	/* outdated variants are ignored, like the server does */
+	for (i = 0; i < UH_IMAGE_VARIANTS - 1; i++)
+	{
+		snprintf(variant, sizeof(variant), "%s%s", path, uh_mkimage_extns[i]);
+
+		e->blobs[i + 1] = (!stat(variant, &vs) && S_ISREG(vs.st_mode) &&
+						   (vs.st_mtime >= s->st_mtime))
+			? uh_mkimage_blob(variant, &vs) : -1;
+	}
+}
+
+static void uh_mkimage_scan(const char *dir, const char *url)
+{
+	int i;
+	DIR *d;
+	struct dirent *de;
+	struct stat s;
+	char path[PATH_MAX], sub[PATH_MAX];
+
+	if (!(d = opendir(dir)))
+	{
+		fprintf(stderr, "Error: Cannot open %s: %s\n", dir, strerror(errno));
+		exit(1);
+	}
+
+	while ((de = readdir(d)) != NULL)
+	{
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+
+		if (stat(path, &s))
+			continue;
+
+		if (S_ISDIR(s.st_mode))
+		{
+			snprintf(sub, sizeof(sub), "%s%s/", url, de->d_name);
+			uh_mkimage_scan(path, sub);
+		}
+		else if (S_ISREG(s.st_mode))
+		{
+			snprintf(sub, sizeof(sub), "%s%s", url, de->d_name);
+			uh_mkimage_add(sub, path, &s);
+		}
+	}
+
+	closedir(d);
+
+	/* the directory url itself serves the first index file found */
+	for (i = 0; i < n_index_files; i++)
+	{
+		snprintf(path, sizeof(path), "%s/%s", dir, index_files[i]);
+
+		if (!stat(path, &s) && S_ISREG(s.st_mode))
+		{
+			uh_mkimage_add(url, path, &s);
+			break;
+		}
+	}
+}
+
+/* entity tag from the size and a FNV-1a hash of the contents */
+static void uh_mkimage_tag(struct uh_mkimage_blob *b)
+{
+	int i, len;
+	char buf[4096];
+	uint64_t hash = 14695981039346656037ULL;
+	FILE *f;
+
+	if (!(f = fopen(b->path, "r")))
+	{
+		fprintf(stderr, "Error: Cannot read %s: %s\n",
+				b->path, strerror(errno));
+		exit(1);
+	}
+
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+		for (i = 0; i < len; i++)
+			hash = (hash ^ (unsigned char)buf[i]) * 1099511628211ULL;
+
+	fclose(f);
+
+	snprintf(b->tag, sizeof(b->tag), "\"%x-%08x%08x\"", b->size,
+			 (unsigned int)(hash >> 32), (unsigned int)hash);
+}
+
+static int uh_mkimage_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct uh_mkimage_entry *)a)->url,
+				  ((const struct uh_mkimage_entry *)b)->url);
+}
+
+static void uh_mkimage_write(FILE *out, const void *buf, size_t len)
+{
+	if (fwrite(buf, 1, len, out) != len)
+	{
+		fprintf(stderr, "Error: Cannot write image: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+static void uh_mkimage_copy(FILE *out, struct uh_mkimage_blob *b)
+{
+	int len;
+	uint32_t total = 0;
+	char buf[4096];
+	FILE *f;
+
+	if (!(f = fopen(b->path, "r")))
+	{
+		fprintf(stderr, "Error: Cannot read %s: %s\n",
+				b->path, strerror(errno));
+		exit(1);
+	}
+
+	while ((total < b->size) && (len = fread(buf, 1, sizeof(buf), f)) > 0)
+	{
+		if (len > (b->size - total))
+			len = b->size - total;
+
+		uh_mkimage_write(out, buf, len);
+		total += len;
+	}
+
+	fclose(f);
+
+	/* the file changed since it was scanned */
+	if (total != b->size)
+	{
+		fprintf(stderr, "Error: %s changed while building the image\n",
+				b->path);
+		exit(1);
+	}
+}
+
+/* strings are appended to the table in the order they are referenced */
+static uint32_t uh_mkimage_str(uint64_t *strpos, const char *str)
+{
+	uint32_t off = *strpos;
+
+	*strpos += strlen(str) + 1;
+	return htonl(off);
+}
+
+int main(int argc, char **argv)
+{
+	int i, j, opt;
+	uint64_t pos, strpos;
+	FILE *out;
+	struct uh_image_header hdr;
+	struct uh_image_entry ent;
+
+	while ((opt = getopt(argc, argv, "I:")) > 0)
+	{
+		switch (opt)
+		{
+			/* index file */
+			case 'I':
+				if (n_index_files < (sizeof(index_files) / sizeof(index_files[0])))
+					index_files[n_index_files++] = optarg;
+				break;
+
+			default:
+				optind = argc;
+				break;
+		}
+	}
+
+	if ((argc - optind) != 2)
+	{
+		fprintf(stderr,
+			"Usage: %s [-I index] docroot image\n"
+			"	-I string       Serve given filename for directories, multiple allowed\n"
+			"\n", argv[0]);
+
+		exit(1);
+	}
+
+	/* default index files */
+	if (!n_index_files)
+	{
+		index_files[n_index_files++] = "index.html";
+		index_files[n_index_files++] = "index.htm";
+		index_files[n_index_files++] = "default.html";
+		index_files[n_index_files++] = "default.htm";
+	}
+
+	uh_mkimage_scan(argv[optind], "/");
+	qsort(entries, n_entries, sizeof(*entries), uh_mkimage_cmp);
+
+	/* data follows the entries, the strings come last so the image ends
+	 * with a terminating nul */
+	pos = sizeof(hdr) + (uint64_t)n_entries * sizeof(ent);
+
+	for (i = 0; i < n_blobs; i++)
+	{
+		uh_mkimage_tag(&blobs[i]);
+
+		blobs[i].offset = pos;
+		pos += blobs[i].size;
+	}
+
+	strpos = pos;
+
+	for (i = 0; i < n_entries; i++)
+	{
+		pos += strlen(entries[i].url) + 1 + strlen(entries[i].mime) + 1;
+
+		for (j = 0; j < UH_IMAGE_VARIANTS; j++)
+			if (entries[i].blobs[j] > -1)
+				pos += strlen(blobs[entries[i].blobs[j]].tag) + 1;
+	}
+
+	if (pos > UINT32_MAX)
+	{
+		fprintf(stderr, "Error: Image exceeds 4GB\n");
+		exit(1);
+	}
+
+	if (!(out = fopen(argv[optind + 1], "w")))
+	{
+		fprintf(stderr, "Error: Cannot create %s: %s\n",
+				argv[optind + 1], strerror(errno));
+		exit(1);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, UH_IMAGE_MAGIC, sizeof(hdr.magic));
+	hdr.version = htonl(UH_IMAGE_VERSION);
+	hdr.count = htonl(n_entries);
+	hdr.size = htonl(pos);
+
+	uh_mkimage_write(out, &hdr, sizeof(hdr));
+
+	for (i = 0; i < n_entries; i++)
+	{
+		memset(&ent, 0, sizeof(ent));
+
+		ent.path = uh_mkimage_str(&strpos, entries[i].url);
+		ent.mime = uh_mkimage_str(&strpos, entries[i].mime);
+		ent.mtime = htonl(entries[i].mtime);
+
+		for (j = 0; j < UH_IMAGE_VARIANTS; j++)
+		{
+			if (entries[i].blobs[j] < 0)
+				continue;
+
+			ent.data[j].offset = htonl(blobs[entries[i].blobs[j]].offset);
+			ent.data[j].size = htonl(blobs[entries[i].blobs[j]].size);
+			ent.data[j].tag = uh_mkimage_str(&strpos,
+											 blobs[entries[i].blobs[j]].tag);
+		}
+
+		uh_mkimage_write(out, &ent, sizeof(ent));
+	}
+
+	for (i = 0; i < n_blobs; i++)
+		uh_mkimage_copy(out, &blobs[i]);
+
+	for (i = 0; i < n_entries; i++)
+	{
+		uh_mkimage_write(out, entries[i].url, strlen(entries[i].url) + 1);
+		uh_mkimage_write(out, entries[i].mime, strlen(entries[i].mime) + 1);
+
+		for (j = 0; j < UH_IMAGE_VARIANTS; j++)
+			if (entries[i].blobs[j] > -1)
+				uh_mkimage_write(out, blobs[entries[i].blobs[j]].tag,
+								 strlen(blobs[entries[i].blobs[j]].tag) + 1);
+	}
+
+	if (fclose(out))
+	{
+		fprintf(stderr, "Error: Cannot write image: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	return 0;
+}
@@ -23,6 +23,150 @@
 #include <syslog.h>
 #define dbg(...) syslog(LOG_INFO, __VA_ARGS__)
 
+#ifdef TLS_IS_OPENSSL
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+/* Session ticket keys, the current one encrypts new tickets while the
+ * previous one is still accepted for another lifetime period so that
+ * clients are not forced into a full handshake right after rotation.
+ * The keys of a period are derived from a secret generated before the
+ * workers are forked and the period number, every worker arrives at the
+ * same keys at the same time without any coordination. */
+struct uh_tls_ticket_key {
+	unsigned char name[16];
+	unsigned char aes[32];
+	unsigned char hmac[32];
+	uint64_t period;
+	bool valid;
+};
+
+static unsigned char uh_tls_ticket_secret[32];
+static struct uh_tls_ticket_key uh_tls_ticket_keys[2];
+static int uh_tls_ticket_lifetime;
+
+static int uh_tls_ticket_key_derive(struct uh_tls_ticket_key *k,
+                                    uint64_t period)
+{
+	int i;
+	unsigned char in[sizeof(uh_tls_ticket_secret) + 9];
+	unsigned char out[3 * SHA256_DIGEST_LENGTH];
+
+	memcpy(in, uh_tls_ticket_secret, sizeof(uh_tls_ticket_secret));
+
+	for (i = 0; i < 8; i++)
+		in[sizeof(uh_tls_ticket_secret) + i] = period >> (56 - 8 * i);
+
+	/* one block of output per counter value */
+	for (i = 0; i < 3; i++)
+	{
+		in[sizeof(in) - 1] = i;
+
+		if (!EVP_Digest(in, sizeof(in), out + i * SHA256_DIGEST_LENGTH,
+		                NULL, EVP_sha256(), NULL))
+			return 0;
+	}
+
+	memcpy(k->name, out, sizeof(k->name));
+	memcpy(k->aes, out + SHA256_DIGEST_LENGTH, sizeof(k->aes));
+	memcpy(k->hmac, out + 2 * SHA256_DIGEST_LENGTH, sizeof(k->hmac));
+
+	k->period = period;
+	k->valid = true;
+
+	return 1;
+}
+
+/* bring the keys of the current and the previous period up to date */
+static int uh_tls_ticket_keys_update(void)
+{
+	struct uh_tls_ticket_key *cur = &uh_tls_ticket_keys[0];
+	struct uh_tls_ticket_key *prev = &uh_tls_ticket_keys[1];
+	uint64_t period = time(NULL) / uh_tls_ticket_lifetime;
+
+	if (cur->valid && (cur->period == period))
+		return 1;
+
+	if (cur->valid && (cur->period + 1 == period))
+		*prev = *cur;
+	else if (!uh_tls_ticket_key_derive(prev, period - 1))
+		return 0;
+
+	D("TLS: session ticket key of period %llu\n", (unsigned long long)period);
+
+	return uh_tls_ticket_key_derive(cur, period);
+}
+
+static struct uh_tls_ticket_key * uh_tls_ticket_key_find(unsigned char *name)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if (uh_tls_ticket_keys[i].valid &&
+			!memcmp(uh_tls_ticket_keys[i].name, name,
+			        sizeof(uh_tls_ticket_keys[i].name)))
+			return &uh_tls_ticket_keys[i];
+
+	return NULL;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int uh_tls_ticket_cb(SSL *s, unsigned char *name, unsigned char *iv,
+                            EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc)
+#else
+static int uh_tls_ticket_cb(SSL *s, unsigned char *name, unsigned char *iv,
+                            EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+#endif
+{
+	struct uh_tls_ticket_key *k = &uh_tls_ticket_keys[0];
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	OSSL_PARAM params[3];
+#endif
+
+	/* rotate lazily, tickets are only issued and checked here */
+	if (!uh_tls_ticket_keys_update())
+		return -1;
+
+	if (enc)
+	{
+		if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) < 1)
+			return -1;
+
+		memcpy(name, k->name, sizeof(k->name));
+	}
+	else if (!(k = uh_tls_ticket_key_find(name)))
+	{
+		/* unknown or expired key, fall back to a full handshake */
+		return 0;
+	}
+
+	if (!EVP_CipherInit_ex(ectx, EVP_aes_256_cbc(), NULL, k->aes, iv, enc))
+		return -1;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+	                                              k->hmac, sizeof(k->hmac));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+	                                             "sha256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+
+	if (!EVP_MAC_CTX_set_params(hctx, params))
+		return -1;
+#else
+	if (!HMAC_Init_ex(hctx, k->hmac, sizeof(k->hmac), EVP_sha256(), NULL))
+		return -1;
+#endif
+
+	/* ask for a fresh ticket if the previous key decrypted this one */
+	return (!enc && (k != &uh_tls_ticket_keys[0])) ? 2 : 1;
+}
+#endif
+
 SSL_CTX * uh_tls_ctx_init(void)
 {
 	SSL_CTX *c;
@@ -35,8 +179,17 @@ SSL_CTX * uh_tls_ctx_init(void)
 #else
 	if ((c = SSL_CTX_new(TLSv1_server_method())) != NULL)
 #endif
+	{
 		SSL_CTX_set_verify(c, SSL_VERIFY_NONE, NULL);
 
+#ifdef TLS_IS_OPENSSL
+		/* writes are retried from the client output queue which may have
+		 * been compacted or grown in the meantime */
+		SSL_CTX_set_mode(c, SSL_MODE_ENABLE_PARTIAL_WRITE |
+		                    SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#endif
+	}
+
 	return c;
 }
 
@@ -60,12 +213,74 @@ int uh_tls_ctx_key(SSL_CTX *c, const char *file)
 	return rv;
 }
 
+/* Set up the server side session cache holding up to cache_size entries
+ * and stateless session tickets with keys rotated every lifetime seconds,
+ * either can be disabled by passing 0. */
+void uh_tls_ctx_session(SSL_CTX *c, int cache_size, int lifetime)
+{
+#ifdef TLS_IS_OPENSSL
+	SSL_CTX_set_session_id_context(c, (const unsigned char *)"uhttpd", 6);
+
+	/* the cache lives in the memory of each worker, a client resuming
+	 * by session ID on another worker gets a full handshake, tickets
+	 * work across all of them */
+	if (cache_size > 0)
+	{
+		SSL_CTX_set_session_cache_mode(c, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(c, cache_size);
+	}
+	else
+	{
+		SSL_CTX_set_session_cache_mode(c, SSL_SESS_CACHE_OFF);
+	}
+
+	if (lifetime > 0)
+	{
+		uh_tls_ticket_lifetime = lifetime;
+
+		/* generate the secret now so that forked workers share it */
+		if ((RAND_bytes(uh_tls_ticket_secret,
+		                sizeof(uh_tls_ticket_secret)) > 0) &&
+			uh_tls_ticket_keys_update())
+		{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+			SSL_CTX_set_tlsext_ticket_key_evp_cb(c, uh_tls_ticket_cb);
+#else
+			SSL_CTX_set_tlsext_ticket_key_cb(c, uh_tls_ticket_cb);
+#endif
+		}
+
+		SSL_CTX_set_timeout(c, lifetime);
+	}
+	else
+	{
+		SSL_CTX_set_options(c, SSL_OP_NO_TICKET);
+	}
+#endif
+}
+
+/* Returns 1 if the TLS library is able to hand record encryption over to
+ * the kernel, individual connections may still fall back to userspace
+ * depending on the negotiated cipher. */
+int uh_tls_ctx_ktls(SSL_CTX *c)
+{
+#if defined(TLS_IS_OPENSSL) && defined(SSL_OP_ENABLE_KTLS) && \
+    !defined(OPENSSL_NO_KTLS)
+	SSL_CTX_set_options(c, SSL_OP_ENABLE_KTLS);
+	return 1;
+#else
+	return 0;
+#endif
+}
+
 void uh_tls_ctx_free(struct listener *l)
 {
 	SSL_CTX_free(l->tls);
 }
 
 
+/* Returns 1 once the handshake completed, 0 if it has to be resumed when
+ * the socket becomes ready again and -1 on failure. */
 int uh_tls_client_accept(struct client *c)
 {
 	int rv, err;
@@ -77,63 +292,75 @@ int uh_tls_client_accept(struct client *c)
 		return 1;
 	}
 
-	if ((c->tls = SSL_new(c->server->tls)))
+	/* first round, setup the client context */
+	if (!c->tls)
 	{
-		if ((rv = SSL_set_fd(c->tls, fd)) < 1)
-		{
-			SSL_free(c->tls);
-			c->tls = NULL;
-		}
-		else
-		{
-			while (true)
-			{
-				rv = SSL_accept(c->tls);
-				err = SSL_get_error(c->tls, rv);
-
-				if ((rv != 1) &&
-					(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE))
-				{
-					if (uh_socket_wait(fd, c->server->conf->network_timeout,
-									   (err == SSL_ERROR_WANT_WRITE)))
-					{
-						D("TLS: accept(%d) = retry\n", fd);
-						continue;
-					}
-
-					D("TLS: accept(%d) = timeout\n", fd);
-				}
-				else if (rv == 1)
-				{
-					D("TLS: accept(%d) = %p\n", fd, c->tls);
-					return 1;
-				}
+		if (!(c->tls = SSL_new(c->server->tls)))
+			return -1;
+
+		if (SSL_set_fd(c->tls, fd) < 1)
+			goto err;
+	}
+
+	rv = SSL_accept(c->tls);
+
+	if (rv == 1)
+	{
+		D("TLS: accept(%d) = %p\n", fd, c->tls);
+		return 1;
+	}
+
+	err = SSL_get_error(c->tls, rv);
+
+	if (err == SSL_ERROR_WANT_READ)
+	{
+		D("TLS: accept(%d) = want read\n", fd);
+		return 0;
+	}
+	else if (err == SSL_ERROR_WANT_WRITE)
+	{
+		D("TLS: accept(%d) = want write\n", fd);
+		uh_client_yield(c);
+		return 0;
+	}
 
 #ifdef TLS_IS_OPENSSL
-				D("TLS: accept(%d) = failed: %s\n",
-				  fd, ERR_error_string(ERR_get_error(), NULL));
+	D("TLS: accept(%d) = failed: %s\n",
+	  fd, ERR_error_string(ERR_get_error(), NULL));
 #endif
 
-				SSL_free(c->tls);
-				c->tls = NULL;
-				break;
-			}
-		}
-	}
+err:
+	SSL_free(c->tls);
+	c->tls = NULL;
 
-	return 0;
+	return -1;
 }
 
 int uh_tls_client_recv(struct client *c, char *buf, int len)
 {
 	int rv = SSL_read(c->tls, buf, len);
-	int err = SSL_get_error(c->tls, 0);
+	int err = SSL_get_error(c->tls, rv);
 
-	if ((rv == -1) && (err == SSL_ERROR_WANT_READ))
+	if (rv <= 0)
 	{
-		D("TLS: recv(%d, %d) = retry\n", c->fd.fd, len);
-		errno = EAGAIN;
-		return -1;
+		/* renegotiation needs to write, resume on the next writable event */
+		if (err == SSL_ERROR_WANT_WRITE)
+			uh_client_yield(c);
+
+		if ((err == SSL_ERROR_WANT_READ) || (err == SSL_ERROR_WANT_WRITE))
+		{
+			D("TLS: recv(%d, %d) = retry\n", c->fd.fd, len);
+			errno = EAGAIN;
+			return -1;
+		}
+
+		/* orderly shutdown by the peer */
+		if (err == SSL_ERROR_ZERO_RETURN)
+			return 0;
+
+		/* protocol error, do not leave a stale EAGAIN behind */
+		if (err == SSL_ERROR_SSL)
+			errno = EIO;
 	}
 
 	D("TLS: recv(%d, %d) = %d\n", c->fd.fd, len, rv);
@@ -143,19 +370,75 @@ int uh_tls_client_recv(struct client *c, char *buf, int len)
 int uh_tls_client_send(struct client *c, const char *buf, int len)
 {
 	int rv = SSL_write(c->tls, buf, len);
-	int err = SSL_get_error(c->tls, 0);
+	int err = SSL_get_error(c->tls, rv);
 
-	if ((rv == -1) && (err == SSL_ERROR_WANT_WRITE))
+	if (rv <= 0)
 	{
-		D("TLS: send(%d, %d) = retry\n", c->fd.fd, len);
-		errno = EAGAIN;
-		return -1;
+		/* renegotiation needs input, do not poll for writability meanwhile */
+		if (err == SSL_ERROR_WANT_READ)
+			c->outbuf.blocked = true;
+
+		if ((err == SSL_ERROR_WANT_READ) || (err == SSL_ERROR_WANT_WRITE))
+		{
+			D("TLS: send(%d, %d) = retry\n", c->fd.fd, len);
+			errno = EAGAIN;
+			return -1;
+		}
+
+		if (err == SSL_ERROR_SSL)
+			errno = EIO;
 	}
 
 	D("TLS: send(%d, %d) = %d\n", c->fd.fd, len, rv);
 	return rv;
 }
 
+int uh_tls_client_ktls(struct client *c)
+{
+#if defined(TLS_IS_OPENSSL) && defined(SSL_OP_ENABLE_KTLS) && \
+    !defined(OPENSSL_NO_KTLS)
+	return c->tls && BIO_get_ktls_send(SSL_get_wbio(c->tls));
+#else
+	return 0;
+#endif
+}
+
+int uh_tls_client_sendfile(struct client *c, int fd, off_t *offset, int len)
+{
+#if defined(TLS_IS_OPENSSL) && defined(SSL_OP_ENABLE_KTLS) && \
+    !defined(OPENSSL_NO_KTLS)
+	ossl_ssize_t rv = SSL_sendfile(c->tls, fd, *offset, len, 0);
+	int err;
+
+	if (rv > 0)
+	{
+		*offset += rv;
+	}
+	else
+	{
+		err = SSL_get_error(c->tls, rv);
+
+		if ((err == SSL_ERROR_WANT_READ) || (err == SSL_ERROR_WANT_WRITE))
+			errno = EAGAIN;
+		else if (err == SSL_ERROR_SSL)
+			errno = EIO;
+
+		rv = -1;
+	}
+
+	D("TLS: sendfile(%d, %d) = %d\n", c->fd.fd, len, (int)rv);
+	return rv;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int uh_tls_client_pending(struct client *c)
+{
+	return c->tls ? SSL_pending(c->tls) : 0;
+}
+
 void uh_tls_client_close(struct client *c)
 {
 	if (c->tls)
@@ -26,11 +26,16 @@
 SSL_CTX * uh_tls_ctx_init();
 int uh_tls_ctx_cert(SSL_CTX *c, const char *file);
 int uh_tls_ctx_key(SSL_CTX *c, const char *file);
+void uh_tls_ctx_session(SSL_CTX *c, int cache_size, int lifetime);
+int uh_tls_ctx_ktls(SSL_CTX *c);
 void uh_tls_ctx_free(struct listener *l);
 
 int uh_tls_client_accept(struct client *c);
 int uh_tls_client_recv(struct client *c, char *buf, int len);
 int uh_tls_client_send(struct client *c, const char *buf, int len);
+int uh_tls_client_ktls(struct client *c);
+int uh_tls_client_sendfile(struct client *c, int fd, off_t *offset, int len);
+int uh_tls_client_pending(struct client *c);
 void uh_tls_client_close(struct client *c);
 
 #endif
@@ -19,6 +19,11 @@
 #include "uhttpd.h"
 #include "uhttpd-utils.h"
 #include "uhttpd-ubus.h"
+#include "uhttpd-metrics.h"
+
+#ifdef HAVE_ZLIB
+#include "uhttpd-deflate.h"
+#endif
 
 
 enum {
@@ -217,6 +222,18 @@ uh_ubus_session_dump(struct uh_ubus_session *ses,
 	blob_buf_free(&b);
 }
 
+/* wheel slot of the second in which the session expires, a touch only
+ * moves this later so sessions are relocated lazily once their old slot
+ * comes up */
+static int
+uh_ubus_session_slot(struct uh_ubus_session *ses)
+{
+	return (ses->touched.tv_sec + ses->timeout) % UH_UBUS_WHEEL_SLOTS;
+}
+
+static void uh_ubus_session_insert(struct uh_ubus_state *state,
+                                   struct uh_ubus_session *ses);
+
 static struct uh_ubus_session *
 uh_ubus_session_create(struct uh_ubus_state *state, int timeout)
 {
@@ -233,16 +250,34 @@ uh_ubus_session_create(struct uh_ubus_state *state, int timeout)
 	uh_ubus_random(ses->id);
 
 	ses->timeout  = timeout;
-	ses->avl.key  = ses->id;
 
-	avl_insert(&state->sessions, &ses->avl);
 	avl_init(&ses->acls, uh_ubus_avlcmp, true, NULL);
 	avl_init(&ses->data, uh_ubus_avlcmp, false, NULL);
-	clock_gettime(CLOCK_MONOTONIC, &ses->touched);
+
+	uh_ubus_session_insert(state, ses);
 
 	return ses;
 }
 
+static void
+uh_ubus_session_insert(struct uh_ubus_state *state,
+					   struct uh_ubus_session *ses)
+{
+	ses->avl.key = ses->id;
+
+	avl_insert(&state->sessions, &ses->avl);
+	clock_gettime(CLOCK_MONOTONIC, &ses->touched);
+
+	list_add_tail(&ses->wheel,
+	              &state->wheel[uh_ubus_session_slot(ses)]);
+
+	if (!state->expire.pending)
+	{
+		state->wheel_time = ses->touched.tv_sec;
+		uloop_timeout_set(&state->expire, 1000);
+	}
+}
+
 
 static struct uh_ubus_session *
 uh_ubus_session_get(struct uh_ubus_state *state, const char *id)
@@ -258,35 +293,98 @@ uh_ubus_session_get(struct uh_ubus_state *state, const char *id)
 }
 
 static void
-uh_ubus_session_destroy(struct uh_ubus_state *state,
-						struct uh_ubus_session *ses)
+uh_ubus_acl_trie_free(struct uh_ubus_acl_node *node)
+{
+	struct uh_ubus_acl_node *next;
+
+	for (; node; node = next)
+	{
+		next = node->next;
+		uh_ubus_acl_trie_free(node->child);
+		free(node);
+	}
+}
+
+static void
+uh_ubus_session_free(struct uh_ubus_session *ses)
 {
 	struct uh_ubus_session_acl *acl, *nacl;
 	struct uh_ubus_session_data *data, *ndata;
 
+	uh_ubus_acl_trie_free(ses->acl_trie);
+
 	avl_remove_all_elements(&ses->acls, acl, avl, nacl)
 		free(acl);
 
 	avl_remove_all_elements(&ses->data, data, avl, ndata)
 		free(data);
 
-	avl_delete(&state->sessions, &ses->avl);
 	free(ses);
 }
 
+/* let the workers drop their copy of a changed or destroyed session */
 static void
-uh_ubus_session_cleanup(struct uh_ubus_state *state)
+uh_ubus_session_notify(struct uh_ubus_state *state,
+					   struct uh_ubus_session *ses)
 {
+	struct blob_buf b;
+
+	if (state->remote)
+		return;
+
+	memset(&b, 0, sizeof(b));
+	blob_buf_init(&b, 0);
+	blobmsg_add_string(&b, "sid", ses->id);
+
+	ubus_send_event(state->ctx, "uhttpd.session", b.head);
+	blob_buf_free(&b);
+}
+
+static void
+uh_ubus_session_destroy(struct uh_ubus_state *state,
+						struct uh_ubus_session *ses)
+{
+	uh_ubus_session_notify(state, ses);
+
+	list_del(&ses->wheel);
+	avl_delete(&state->sessions, &ses->avl);
+	uh_ubus_session_free(ses);
+}
+
+static void
+uh_ubus_session_expire_cb(struct uloop_timeout *t)
+{
+	int n;
 	struct timespec now;
+	struct list_head *slot;
 	struct uh_ubus_session *ses, *nses;
+	struct uh_ubus_state *state = container_of(t, struct uh_ubus_state, expire);
 
 	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	avl_for_each_element_safe(&state->sessions, ses, avl, nses)
+	/* visit the slot of every second passed since the last run, one turn
+	 * of the wheel covers all of them */
+	for (n = 0; (state->wheel_time <= now.tv_sec) && (n < UH_UBUS_WHEEL_SLOTS);
+	     n++, state->wheel_time++)
 	{
-		if ((now.tv_sec - ses->touched.tv_sec) >= ses->timeout)
-			uh_ubus_session_destroy(state, ses);
+		slot = &state->wheel[state->wheel_time % UH_UBUS_WHEEL_SLOTS];
+
+		list_for_each_entry_safe(ses, nses, slot, wheel)
+		{
+			if ((now.tv_sec - ses->touched.tv_sec) >= ses->timeout)
+				uh_ubus_session_destroy(state, ses);
+
+			/* touched meanwhile, move to the slot of its new expiry */
+			else if (&state->wheel[uh_ubus_session_slot(ses)] != slot)
+				list_move_tail(&ses->wheel,
+				               &state->wheel[uh_ubus_session_slot(ses)]);
+		}
 	}
+
+	state->wheel_time = now.tv_sec + 1;
+
+	if (!avl_is_empty(&state->sessions))
+		uloop_timeout_set(&state->expire, 1000);
 }
 
 
@@ -303,9 +401,6 @@ uh_ubus_handle_create(struct ubus_context *ctx, struct ubus_object *obj,
 
 	blobmsg_parse(new_policy, __UH_UBUS_SN_MAX, tb, blob_data(msg), blob_len(msg));
 
-	/* TODO: make this a uloop timeout */
-	uh_ubus_session_cleanup(state);
-
 	if (tb[UH_UBUS_SN_TIMEOUT])
 		timeout = *(uint32_t *)blobmsg_data(tb[UH_UBUS_SN_TIMEOUT]);
 
@@ -328,9 +423,6 @@ uh_ubus_handle_list(struct ubus_context *ctx, struct ubus_object *obj,
 
 	blobmsg_parse(sid_policy, __UH_UBUS_SI_MAX, tb, blob_data(msg), blob_len(msg));
 
-	/* TODO: make this a uloop timeout */
-	uh_ubus_session_cleanup(state);
-
 	if (!tb[UH_UBUS_SI_SID])
 	{
 		avl_for_each_element(&state->sessions, ses, avl)
@@ -378,6 +470,8 @@ uh_ubus_session_grant(struct uh_ubus_session *ses, struct ubus_context *ctx,
 
 		nacl->avl.key = nacl->object;
 		avl_insert(&ses->acls, &nacl->avl);
+
+		ses->acl_dirty = true;
 	}
 
 	return 0;
@@ -407,9 +501,380 @@ uh_ubus_session_revoke(struct uh_ubus_session *ses, struct ubus_context *ctx,
 		}
 	}
 
+	ses->acl_dirty = true;
+
 	return 0;
 }
 
+static unsigned int
+uh_ubus_acl_hash(const char *object, const char *function)
+{
+	unsigned int h = 5381;
+
+	while (*object)
+		h = (h * 33) ^ (unsigned char)*object++;
+
+	h = (h * 33) ^ '/';
+
+	while (*function)
+		h = (h * 33) ^ (unsigned char)*function++;
+
+	return h % UH_UBUS_ACL_HASH;
+}
+
+static struct uh_ubus_acl_node *
+uh_ubus_acl_trie_insert(struct uh_ubus_acl_node **root,
+						const char *prefix, int len)
+{
+	int i;
+	struct uh_ubus_acl_node *node, **np;
+
+	if (!*root && !(*root = calloc(1, sizeof(**root))))
+		return NULL;
+
+	for (i = 0, node = *root; i < len; i++, node = *np)
+	{
+		for (np = &node->child; *np && ((*np)->c != prefix[i]);
+		     np = &(*np)->next);
+
+		if (!*np)
+		{
+			if (!(*np = calloc(1, sizeof(**np))))
+				return NULL;
+
+			(*np)->c = prefix[i];
+		}
+	}
+
+	return node;
+}
+
+/* sort the ACLs into the exact match hash and the wildcard trie, done
+ * on the first check after a grant or revoke */
+static void
+uh_ubus_session_acl_compile(struct uh_ubus_session *ses)
+{
+	unsigned int h;
+	struct uh_ubus_acl_node *node;
+	struct uh_ubus_session_acl *acl;
+
+	uh_ubus_acl_trie_free(ses->acl_trie);
+
+	ses->acl_trie = NULL;
+	memset(ses->acl_hash, 0, sizeof(ses->acl_hash));
+
+	avl_for_each_element(&ses->acls, acl, avl)
+	{
+		if (!strpbrk(acl->object, "*?") && !strpbrk(acl->function, "*?"))
+		{
+			h = uh_ubus_acl_hash(acl->object, acl->function);
+			acl->chain = ses->acl_hash[h];
+			ses->acl_hash[h] = acl;
+		}
+
+		/* an entry which does not fit into memory grants nothing */
+		else if ((node = uh_ubus_acl_trie_insert(&ses->acl_trie, acl->object,
+		                                         strcspn(acl->object, "*?"))))
+		{
+			acl->chain = node->acls;
+			node->acls = acl;
+		}
+	}
+
+	ses->acl_dirty = false;
+}
+
+static bool
+uh_ubus_session_acl_check(struct uh_ubus_session *ses,
+						  const char *obj, const char *fun)
+{
+	const char *p = obj;
+	struct uh_ubus_acl_node *node;
+	struct uh_ubus_session_acl *acl;
+
+	if (ses->acl_dirty)
+		uh_ubus_session_acl_compile(ses);
+
+	for (acl = ses->acl_hash[uh_ubus_acl_hash(obj, fun)]; acl; acl = acl->chain)
+		if (!strcmp(acl->object, obj) && !strcmp(acl->function, fun))
+			return true;
+
+	/* wildcard entries can only match below the nodes spelled by the
+	 * object name */
+	for (node = ses->acl_trie; node; p++)
+	{
+		for (acl = node->acls; acl; acl = acl->chain)
+			if (uh_ubus_strmatch(obj, acl->object) &&
+				uh_ubus_strmatch(fun, acl->function))
+				return true;
+
+		if (!*p)
+			break;
+
+		for (node = node->child; node && (node->c != *p); node = node->next);
+	}
+
+	return false;
+}
+
+
+enum {
+	UH_UBUS_OE_ID,
+	UH_UBUS_OE_PATH,
+	__UH_UBUS_OE_MAX,
+};
+
+static const struct blobmsg_policy object_policy[__UH_UBUS_OE_MAX] = {
+	[UH_UBUS_OE_ID] = { .name = "id", .type = BLOBMSG_TYPE_INT32 },
+	[UH_UBUS_OE_PATH] = { .name = "path", .type = BLOBMSG_TYPE_STRING },
+};
+
+static bool
+uh_ubus_object_id(struct uh_ubus_state *state, const char *path, uint32_t *id)
+{
+	struct uh_ubus_object *o;
+
+	if (!(o = avl_find_element(&state->objects, path, o, avl)))
+		return false;
+
+	*id = o->id;
+	return true;
+}
+
+static void
+uh_ubus_object_add(struct uh_ubus_state *state, const char *path, uint32_t id)
+{
+	struct uh_ubus_object *o;
+
+	/* a path registered again replaces the previous id */
+	if ((o = avl_find_element(&state->objects, path, o, avl)) != NULL)
+	{
+		o->id = id;
+		return;
+	}
+
+	if (!(o = malloc(sizeof(*o) + strlen(path) + 1)))
+		return;
+
+	o->id = id;
+	strcpy(o->path, path);
+
+	o->avl.key = o->path;
+	avl_insert(&state->objects, &o->avl);
+}
+
+static void
+uh_ubus_object_remove(struct uh_ubus_state *state, const char *path,
+					  uint32_t id)
+{
+	struct uh_ubus_object *o;
+
+	if ((o = avl_find_element(&state->objects, path, o, avl)) &&
+		(o->id == id))
+	{
+		avl_delete(&state->objects, &o->avl);
+		free(o);
+	}
+}
+
+static void
+uh_ubus_objects_free(struct uh_ubus_state *state)
+{
+	struct uh_ubus_object *o, *no;
+
+	avl_remove_all_elements(&state->objects, o, avl, no)
+		free(o);
+}
+
+static void
+uh_ubus_objects_cb(struct ubus_context *ctx, struct ubus_object_data *obj,
+				   void *priv)
+{
+	uh_ubus_object_add(priv, obj->path, obj->id);
+}
+
+/* a session changed in the supervisor, forget the cached copy and do not
+ * cache the result of a fetch which may predate the change */
+static void
+uh_ubus_session_invalidate(struct uh_ubus_state *state, struct blob_attr *msg)
+{
+	const char *id;
+	struct blob_attr *tb[__UH_UBUS_SI_MAX];
+	struct uh_ubus_session *ses;
+	struct uh_ubus_fetch *fetch;
+
+	blobmsg_parse(sid_policy, __UH_UBUS_SI_MAX, tb,
+				  blob_data(msg), blob_len(msg));
+
+	if (!state->remote || !tb[UH_UBUS_SI_SID])
+		return;
+
+	id = blobmsg_get_string(tb[UH_UBUS_SI_SID]);
+
+	if ((ses = avl_find_element(&state->sessions, id, ses, avl)) != NULL)
+		uh_ubus_session_destroy(state, ses);
+
+	list_for_each_entry(fetch, &state->fetches, list)
+		if (!strcmp(fetch->id, id))
+			fetch->stale = true;
+}
+
+static void
+uh_ubus_event_cb(struct ubus_context *ctx, struct ubus_event_handler *ev,
+				 const char *type, struct blob_attr *msg)
+{
+	struct blob_attr *tb[__UH_UBUS_OE_MAX];
+	struct uh_ubus_state *state = container_of(ev, struct uh_ubus_state, events);
+
+	if (!strcmp(type, "uhttpd.session"))
+	{
+		uh_ubus_session_invalidate(state, msg);
+		return;
+	}
+
+	blobmsg_parse(object_policy, __UH_UBUS_OE_MAX, tb,
+				  blob_data(msg), blob_len(msg));
+
+	if (!tb[UH_UBUS_OE_ID] || !tb[UH_UBUS_OE_PATH])
+		return;
+
+	if (!strcmp(type, "ubus.object.add"))
+		uh_ubus_object_add(state, blobmsg_get_string(tb[UH_UBUS_OE_PATH]),
+						   blobmsg_get_u32(tb[UH_UBUS_OE_ID]));
+	else if (!strcmp(type, "ubus.object.remove"))
+		uh_ubus_object_remove(state, blobmsg_get_string(tb[UH_UBUS_OE_PATH]),
+							  blobmsg_get_u32(tb[UH_UBUS_OE_ID]));
+}
+
+/* Follow the objects appearing and vanishing on the bus, then take the
+ * current list, so that requests resolve object names without waiting
+ * for ubusd. */
+static void
+uh_ubus_objects_init(struct uh_ubus_state *state)
+{
+	avl_init(&state->objects, uh_ubus_avlcmp, false, NULL);
+
+	memset(&state->events, 0, sizeof(state->events));
+	state->events.cb = uh_ubus_event_cb;
+
+	if (ubus_register_event_handler(state->ctx, &state->events,
+									"ubus.object.*") ||
+		ubus_lookup(state->ctx, NULL, uh_ubus_objects_cb, state))
+	{
+		fprintf(stderr, "Unable to list ubus objects\n");
+		exit(1);
+	}
+}
+
+
+enum {
+	UH_UBUS_SL_SID,
+	UH_UBUS_SL_TIMEOUT,
+	UH_UBUS_SL_ACLS,
+	__UH_UBUS_SL_MAX,
+};
+
+static const struct blobmsg_policy list_policy[__UH_UBUS_SL_MAX] = {
+	[UH_UBUS_SL_SID] = { .name = "sid", .type = BLOBMSG_TYPE_STRING },
+	[UH_UBUS_SL_TIMEOUT] = { .name = "timeout", .type = BLOBMSG_TYPE_INT32 },
+	[UH_UBUS_SL_ACLS] = { .name = "acls", .type = BLOBMSG_TYPE_TABLE },
+};
+
+static void
+uh_ubus_session_fetch_cb(struct ubus_request *req, int type,
+						 struct blob_attr *msg)
+{
+	int rem, frem;
+	struct blob_attr *obj, *fun;
+	struct blob_attr *tb[__UH_UBUS_SL_MAX];
+	struct uh_ubus_fetch *fetch = container_of(req, struct uh_ubus_fetch, req);
+	struct uh_ubus_session *ses = fetch->ses;
+
+	if (!msg)
+		return;
+
+	blobmsg_parse(list_policy, __UH_UBUS_SL_MAX, tb,
+				  blob_data(msg), blob_len(msg));
+
+	if (!tb[UH_UBUS_SL_SID] || !tb[UH_UBUS_SL_ACLS])
+		return;
+
+	snprintf(ses->id, sizeof(ses->id), "%s",
+			 blobmsg_get_string(tb[UH_UBUS_SL_SID]));
+
+	if (tb[UH_UBUS_SL_TIMEOUT])
+		ses->timeout = blobmsg_get_u32(tb[UH_UBUS_SL_TIMEOUT]);
+
+	blobmsg_for_each_attr(obj, tb[UH_UBUS_SL_ACLS], rem)
+	{
+		if (blob_id(obj) != BLOBMSG_TYPE_ARRAY)
+			continue;
+
+		blobmsg_for_each_attr(fun, obj, frem)
+			if (blob_id(fun) == BLOBMSG_TYPE_STRING)
+				uh_ubus_session_grant(ses, NULL, blobmsg_name(obj),
+									  blobmsg_data(fun));
+	}
+}
+
+static void uh_ubus_fetch_complete_cb(struct ubus_request *req, int ret);
+
+/* In worker processes the sessions are owned by the supervisor, request a
+ * copy of the session ACLs through its "session" object which is cached
+ * once it arrived. Calls for a session already being fetched join the
+ * outstanding request. */
+static struct uh_ubus_fetch *
+uh_ubus_session_fetch(struct uh_ubus_state *state, const char *id)
+{
+	uint32_t owner;
+	struct blob_buf b;
+	struct uh_ubus_fetch *fetch;
+
+	list_for_each_entry(fetch, &state->fetches, list)
+		if (!strcmp(fetch->id, id))
+			return fetch;
+
+	if (!uh_ubus_object_id(state, "session", &owner))
+		return NULL;
+
+	if (!(fetch = calloc(1, sizeof(*fetch))))
+		return NULL;
+
+	if (!(fetch->ses = calloc(1, sizeof(*fetch->ses))))
+	{
+		free(fetch);
+		return NULL;
+	}
+
+	fetch->state = state;
+	snprintf(fetch->id, sizeof(fetch->id), "%s", id);
+	INIT_LIST_HEAD(&fetch->waiters);
+
+	avl_init(&fetch->ses->acls, uh_ubus_avlcmp, true, NULL);
+	avl_init(&fetch->ses->data, uh_ubus_avlcmp, false, NULL);
+
+	memset(&b, 0, sizeof(b));
+	blob_buf_init(&b, 0);
+	blobmsg_add_string(&b, "sid", id);
+
+	if (ubus_invoke_async(state->ctx, owner, "list", b.head, &fetch->req))
+	{
+		blob_buf_free(&b);
+		uh_ubus_session_free(fetch->ses);
+		free(fetch);
+		return NULL;
+	}
+
+	blob_buf_free(&b);
+
+	fetch->req.data_cb = uh_ubus_session_fetch_cb;
+	fetch->req.complete_cb = uh_ubus_fetch_complete_cb;
+
+	ubus_complete_request_async(state->ctx, &fetch->req);
+	list_add(&fetch->list, &state->fetches);
+
+	return fetch;
+}
 
 static int
 uh_ubus_handle_grant(struct ubus_context *ctx, struct ubus_object *obj,
@@ -458,6 +923,8 @@ uh_ubus_handle_grant(struct ubus_context *ctx, struct ubus_object *obj,
 			uh_ubus_session_grant(ses, ctx, object, function);
 	}
 
+	uh_ubus_session_notify(state, ses);
+
 	return 0;
 }
 
@@ -515,6 +982,8 @@ uh_ubus_handle_revoke(struct ubus_context *ctx, struct ubus_object *obj,
 		}
 	}
 
+	uh_ubus_session_notify(state, ses);
+
 	return 0;
 }
 
@@ -697,23 +1166,117 @@ uh_ubus_handle_destroy(struct ubus_context *ctx, struct ubus_object *obj,
 	return 0;
 }
 
-
-struct uh_ubus_state *
-uh_ubus_init(const struct config *conf)
+static void
+uh_ubus_metrics_hist(struct blob_buf *b, const char *name,
+					 const struct uh_metrics_hist *h)
 {
-	int rv;
-	struct uh_ubus_state *state;
-	struct ubus_object *session_object;
+	int i;
+	void *c, *a;
 
-	static struct ubus_method session_methods[] = {
-		UBUS_METHOD("create",  uh_ubus_handle_create,  new_policy),
-		UBUS_METHOD("list",    uh_ubus_handle_list,    sid_policy),
-		UBUS_METHOD("grant",   uh_ubus_handle_grant,   acl_policy),
-		UBUS_METHOD("revoke",  uh_ubus_handle_revoke,  acl_policy),
-		UBUS_METHOD("set",     uh_ubus_handle_set,     set_policy),
+	c = blobmsg_open_table(b, name);
+	a = blobmsg_open_array(b, "buckets");
+
+	for (i = 0; i < UH_METRICS_BUCKETS; i++)
+		blobmsg_add_u64(b, NULL, h->count[i]);
+
+	blobmsg_close_array(b, a);
+	blobmsg_add_u64(b, "sum_us", h->sum);
+	blobmsg_close_table(b, c);
+}
+
+/* counters summed over the supervisor and the workers */
+static int
+uh_ubus_handle_metrics(struct ubus_context *ctx, struct ubus_object *obj,
+					   struct ubus_request_data *req, const char *method,
+					   struct blob_attr *msg)
+{
+	int i, j;
+	void *c, *h, *a;
+	char class[4];
+	struct blob_buf b;
+	struct uh_metrics m;
+
+	uh_metrics_sum(&m);
+
+	memset(&b, 0, sizeof(b));
+	blob_buf_init(&b, 0);
+
+	blobmsg_add_u64(&b, "accepts", m.accepts);
+	blobmsg_add_u64(&b, "accepts_deferred", m.accepts_deferred);
+	blobmsg_add_u64(&b, "accepts_refused", m.accepts_refused);
+	blobmsg_add_u32(&b, "clients", m.clients);
+	blobmsg_add_u64(&b, "bytes_in", m.bytes_in);
+	blobmsg_add_u64(&b, "bytes_out", m.bytes_out);
+	blobmsg_add_u64(&b, "tls_handshakes", m.tls_handshakes);
+	blobmsg_add_u64(&b, "tls_failures", m.tls_failures);
+
+	c = blobmsg_open_table(&b, "cgi");
+	blobmsg_add_u64(&b, "spawns", m.cgi_spawns);
+	blobmsg_add_u64(&b, "timeouts", m.cgi_timeouts);
+	blobmsg_add_u64(&b, "kills", m.cgi_kills);
+	uh_ubus_metrics_hist(&b, "spawn_time", &m.cgi_spawn);
+	blobmsg_close_table(&b, c);
+
+	c = blobmsg_open_table(&b, "path_cache");
+	blobmsg_add_u64(&b, "hits", m.path_cache_hits);
+	blobmsg_add_u64(&b, "misses", m.path_cache_misses);
+	blobmsg_add_u64(&b, "evictions", m.path_cache_evictions);
+	blobmsg_close_table(&b, c);
+
+	a = blobmsg_open_array(&b, "bucket_bounds_us");
+
+	for (i = 0; i < UH_METRICS_BUCKETS - 1; i++)
+		blobmsg_add_u32(&b, NULL, uh_metrics_bounds[i]);
+
+	blobmsg_close_array(&b, a);
+
+	c = blobmsg_open_table(&b, "handlers");
+
+	for (i = 0; i < __UH_METRICS_MAX; i++)
+	{
+		h = blobmsg_open_table(&b, uh_metrics_handlers[i]);
+		blobmsg_add_u64(&b, "requests", m.handlers[i].requests);
+
+		a = blobmsg_open_table(&b, "status");
+
+		for (j = 0; j < 5; j++)
+		{
+			snprintf(class, sizeof(class), "%dxx", j + 1);
+			blobmsg_add_u64(&b, class, m.handlers[i].status[j]);
+		}
+
+		blobmsg_close_table(&b, a);
+
+		uh_ubus_metrics_hist(&b, "ttfb", &m.handlers[i].ttfb);
+		blobmsg_close_table(&b, h);
+	}
+
+	blobmsg_close_table(&b, c);
+
+	ubus_send_reply(ctx, req, b.head);
+	blob_buf_free(&b);
+
+	return 0;
+}
+
+
+struct uh_ubus_state *
+uh_ubus_init(const struct config *conf)
+{
+	int i, rv;
+	struct uh_ubus_state *state;
+	struct ubus_object *session_object;
+
+	static struct ubus_method session_methods[] = {
+		UBUS_METHOD("create",  uh_ubus_handle_create,  new_policy),
+		UBUS_METHOD("list",    uh_ubus_handle_list,    sid_policy),
+		UBUS_METHOD("grant",   uh_ubus_handle_grant,   acl_policy),
+		UBUS_METHOD("revoke",  uh_ubus_handle_revoke,  acl_policy),
+		UBUS_METHOD("set",     uh_ubus_handle_set,     set_policy),
 		UBUS_METHOD("get",     uh_ubus_handle_get,     get_policy),
 		UBUS_METHOD("unset",   uh_ubus_handle_unset,   get_policy),
 		UBUS_METHOD("destroy", uh_ubus_handle_destroy, sid_policy),
+		UBUS_METHOD_NOARG("metrics", uh_ubus_handle_metrics),
 	};
 
 	static struct ubus_object_type session_type =
@@ -730,6 +1293,7 @@ uh_ubus_init(const struct config *conf)
 	memset(state, 0, sizeof(*state));
 	state->ctx = ubus_connect(conf->ubus_socket);
 	state->timeout = conf->script_timeout;
+	state->indent = conf->ubus_indent;
 
 	if (!state->ctx)
 	{
@@ -756,6 +1320,14 @@ uh_ubus_init(const struct config *conf)
 
 	blob_buf_init(&state->buf, 0);
 	avl_init(&state->sessions, uh_ubus_avlcmp, false, NULL);
+	INIT_LIST_HEAD(&state->fetches);
+
+	uh_ubus_objects_init(state);
+
+	for (i = 0; i < UH_UBUS_WHEEL_SLOTS; i++)
+		INIT_LIST_HEAD(&state->wheel[i]);
+
+	state->expire.cb = uh_ubus_session_expire_cb;
 
 	return state;
 }
@@ -779,35 +1351,25 @@ uh_ubus_request_parse_url(struct client *cl, char **sid, char **obj, char **fun)
 	return (*sid && *obj && *fun);
 }
 
-static bool
-uh_ubus_request_parse_post(struct client *cl, int len, struct blob_buf *b)
+/* Feed the request body to the tokener as it arrives, returns 1 once the
+ * JSON value is complete, 0 if more data has to arrive and -1 on errors */
+static int
+uh_ubus_request_parse_post(struct client *cl, struct uh_ubus_post *post)
 {
 	int rlen;
-	bool rv = false;
+	char *data;
 	char buf[UH_LIMIT_MSGHEAD];
 
-	struct json_object *obj = NULL;
-	struct json_tokener *tok = NULL;
-
-	if (!len)
-		return NULL;
-
-	memset(b, 0, sizeof(*b));
-	blob_buf_init(b, 0);
-
-	tok = json_tokener_new();
-
-	while (len > 0)
+	while (post->len > 0)
 	{
-		/* remaining data in http head buffer ... */
+		/* remaining data in http head buffer is parsed in place ... */
 		if (cl->httpbuf.len > 0)
 		{
-			rlen = min(len, cl->httpbuf.len);
+			rlen = min(post->len, cl->httpbuf.len);
+			data = cl->httpbuf.ptr;
 
 			D("ubus: feed %d HTTP buffer bytes\n", rlen);
 
-			memcpy(buf, cl->httpbuf.ptr, rlen);
-
 			cl->httpbuf.len -= rlen;
 			cl->httpbuf.ptr += rlen;
 		}
@@ -815,162 +1377,992 @@ uh_ubus_request_parse_post(struct client *cl, int len, struct blob_buf *b)
 		/* read it from socket ... */
 		else
 		{
-			ensure_out(rlen = uh_tcp_recv(cl, buf, min(len, sizeof(buf))));
+			rlen = uh_tcp_recv(cl, buf, min(post->len, sizeof(buf)));
 
 			if ((rlen < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
-				break;
+				return 0;
+
+			if (rlen <= 0)
+				return -1;
 
 			D("ubus: feed %d/%d TCP socket bytes\n",
-			  rlen, min(len, sizeof(buf)));
+			  rlen, min(post->len, sizeof(buf)));
+
+			data = buf;
 		}
 
-		obj = json_tokener_parse_ex(tok, buf, rlen);
-		len -= rlen;
+		post->obj = json_tokener_parse_ex(post->tok, data, rlen);
+		post->len -= rlen;
 
-		if (tok->err != json_tokener_continue && !is_error(obj))
+		if (post->tok->err != json_tokener_continue)
 			break;
 	}
 
-out:
-	if (!is_error(obj))
+	if (!post->obj || is_error(post->obj))
+	{
+		post->obj = NULL;
+		return -1;
+	}
+
+	return 1;
+}
+
+static bool
+uh_ubus_request_parse_args(struct json_object *obj, struct blob_buf *b)
+{
+	blob_buf_init(b, 0);
+
+	if (json_object_get_type(obj) != json_type_object)
+		return false;
+
+	json_object_object_foreach(obj, key, val)
+	{
+		if (!blobmsg_add_json_element(b, key, val))
+			return false;
+	}
+
+	return true;
+}
+
+static const struct {
+	int code;
+	const char *status;
+	const char *text;
+	int rpc_code;
+	const char *rpc_text;
+} uh_ubus_errors[] = {
+	[UH_UBUS_ERR_PARSE]   = { 400, "Bad Request",     "Invalid JSON data",
+	                          -32700, "Parse error" },
+	[UH_UBUS_ERR_REQUEST] = { 400, "Bad Request",     "Invalid Request",
+	                          -32600, "Invalid request" },
+	[UH_UBUS_ERR_SESSION] = { 404, "Not Found",       "No such session",
+	                          -32002, "Access denied" },
+	[UH_UBUS_ERR_ACCESS]  = { 403, "Denied",          "Access to object denied",
+	                          -32002, "Access denied" },
+	[UH_UBUS_ERR_OBJECT]  = { 500, "Internal Error",  "Unable to lookup object",
+	                          -32000, "Object not found" },
+	[UH_UBUS_ERR_INVOKE]  = { 500, "Internal Error",  "Unable to invoke function",
+	                          -32000, "Unable to invoke function" },
+	[UH_UBUS_ERR_TIMEOUT] = { 504, "Gateway Timeout", "Function did not reply in time",
+	                          -32000, "Timeout" },
+};
+
+static void
+uh_ubus_request_cb(struct ubus_request *req, int type, struct blob_attr *msg)
+{
+	struct uh_ubus_call *call = container_of(req, struct uh_ubus_call, req);
+
+	if (call->calls->aborted || !msg)
+		return;
+
+	free(call->data);
+	call->data = blob_memdup(msg);
+}
+
+static void
+uh_ubus_json_flush(struct uh_ubus_json *j)
+{
+	if (j->len > 0)
+	{
+		uh_http_send(j->cl, j->req, j->buf, j->len);
+		j->len = 0;
+	}
+
+	/* the header went out along with the first chunk */
+	if (j->corked)
+	{
+		uh_tcp_uncork(j->cl, false);
+		j->corked = false;
+	}
+}
+
+static void
+uh_ubus_json_write(struct uh_ubus_json *j, const char *str, int len)
+{
+	int n;
+
+	if (len < 0)
+		len = strlen(str);
+
+	while (len > 0)
+	{
+		if (j->len == sizeof(j->buf))
+			uh_ubus_json_flush(j);
+
+		n = min(len, sizeof(j->buf) - j->len);
+		memcpy(j->buf + j->len, str, n);
+
+		j->len += n;
+		str += n;
+		len -= n;
+	}
+}
+
+static void
+uh_ubus_json_newline(struct uh_ubus_json *j)
+{
+	int i;
+
+	if (!j->indent)
+		return;
+
+	uh_ubus_json_write(j, "\n", 1);
+
+	for (i = 0; i < j->level; i++)
+		uh_ubus_json_write(j, "\t", 1);
+}
+
+static void
+uh_ubus_json_string(struct uh_ubus_json *j, const char *str)
+{
+	int n;
+	char esc[7];
+
+	uh_ubus_json_write(j, "\"", 1);
+
+	while (*str)
 	{
-		if (json_object_get_type(obj) == json_type_object)
+		/* pass through runs of characters which need no escaping */
+		for (n = 0; str[n] && (str[n] != '"') && (str[n] != '\\') &&
+		            ((unsigned char)str[n] >= 0x20); n++);
+
+		uh_ubus_json_write(j, str, n);
+		str += n;
+
+		if (!*str)
+			break;
+
+		switch (*str)
 		{
-			rv = true;
-			json_object_object_foreach(obj, key, val)
-			{
-				if (!blobmsg_add_json_element(b, key, val))
-				{
-					rv = false;
-					break;
-				}
-			}
+		case '"':  uh_ubus_json_write(j, "\\\"", 2); break;
+		case '\\': uh_ubus_json_write(j, "\\\\", 2); break;
+		case '\n': uh_ubus_json_write(j, "\\n", 2);  break;
+		case '\r': uh_ubus_json_write(j, "\\r", 2);  break;
+		case '\t': uh_ubus_json_write(j, "\\t", 2);  break;
+		case '\b': uh_ubus_json_write(j, "\\b", 2);  break;
+		case '\f': uh_ubus_json_write(j, "\\f", 2);  break;
+		default:
+			uh_ubus_json_write(j, esc, snprintf(esc, sizeof(esc), "\\u%04x",
+			                                    (unsigned char)*str));
+			break;
 		}
 
-		json_object_put(obj);
+		str++;
 	}
 
-	json_tokener_free(tok);
+	uh_ubus_json_write(j, "\"", 1);
+}
 
-	if (!rv)
-		blob_buf_free(b);
+static void uh_ubus_json_list(struct uh_ubus_json *j, struct blob_attr *data,
+							  int len, bool table);
 
-	return rv;
+static void
+uh_ubus_json_attr(struct uh_ubus_json *j, struct blob_attr *attr, bool named)
+{
+	char *str, num[24];
+
+	switch (blobmsg_type(attr))
+	{
+	case BLOBMSG_TYPE_UNSPEC:
+	case BLOBMSG_TYPE_ARRAY:
+	case BLOBMSG_TYPE_TABLE:
+	case BLOBMSG_TYPE_STRING:
+	case BLOBMSG_TYPE_INT64:
+	case BLOBMSG_TYPE_INT32:
+	case BLOBMSG_TYPE_INT16:
+	case BLOBMSG_TYPE_INT8:
+		break;
+
+	/* leave types unknown to this writer to the library formatter, it
+	 * emits the name along with the value */
+	default:
+		if ((str = blobmsg_format_json(attr, false)) != NULL)
+		{
+			uh_ubus_json_write(j, str, -1);
+			free(str);
+		}
+
+		return;
+	}
+
+	if (named)
+	{
+		uh_ubus_json_string(j, blobmsg_name(attr));
+		uh_ubus_json_write(j, j->indent ? ": " : ":", -1);
+	}
+
+	switch (blobmsg_type(attr))
+	{
+	case BLOBMSG_TYPE_ARRAY:
+		uh_ubus_json_list(j, blobmsg_data(attr), blobmsg_data_len(attr), false);
+		break;
+
+	case BLOBMSG_TYPE_TABLE:
+		uh_ubus_json_list(j, blobmsg_data(attr), blobmsg_data_len(attr), true);
+		break;
+
+	case BLOBMSG_TYPE_STRING:
+		uh_ubus_json_string(j, blobmsg_get_string(attr));
+		break;
+
+	case BLOBMSG_TYPE_INT64:
+		uh_ubus_json_write(j, num, snprintf(num, sizeof(num), "%lld",
+		                   (long long)(int64_t)blobmsg_get_u64(attr)));
+		break;
+
+	case BLOBMSG_TYPE_INT32:
+		uh_ubus_json_write(j, num, snprintf(num, sizeof(num), "%d",
+		                   (int32_t)blobmsg_get_u32(attr)));
+		break;
+
+	case BLOBMSG_TYPE_INT16:
+		uh_ubus_json_write(j, num, snprintf(num, sizeof(num), "%d",
+		                   (int16_t)blobmsg_get_u16(attr)));
+		break;
+
+	case BLOBMSG_TYPE_INT8:
+		uh_ubus_json_write(j, blobmsg_get_u8(attr) ? "true" : "false", -1);
+		break;
+
+	default:
+		uh_ubus_json_write(j, "null", 4);
+		break;
+	}
 }
 
 static void
-uh_ubus_request_cb(struct ubus_request *req, int type, struct blob_attr *msg)
+uh_ubus_json_list(struct uh_ubus_json *j, struct blob_attr *data, int len,
+				  bool table)
 {
-	int len;
-	char *str;
-	struct client *cl = (struct client *)req->priv;
+	int rem = len;
+	bool first = true;
+	struct blob_attr *cur;
 
-	if (!msg)
+	uh_ubus_json_write(j, table ? "{" : "[", 1);
+	j->level++;
+
+	__blob_for_each_attr(cur, data, rem)
 	{
-		uh_http_sendhf(cl, 204, "No content", "Function did not return data\n");
-		return;
+		if (!first)
+			uh_ubus_json_write(j, ",", 1);
+
+		uh_ubus_json_newline(j);
+		uh_ubus_json_attr(j, cur, table);
+
+		first = false;
 	}
 
-	str = blobmsg_format_json_indent(msg, true, 0);
-	len = strlen(str);
+	j->level--;
 
-	ensure_out(uh_http_sendf(cl, NULL, "HTTP/1.0 200 OK\r\n"));
-	ensure_out(uh_http_sendf(cl, NULL, "Content-Type: application/json\r\n"));
-	ensure_out(uh_http_sendf(cl, NULL, "Content-Length: %i\r\n\r\n", len));
-	ensure_out(uh_http_send(cl, NULL, str, len));
+	if (!first)
+		uh_ubus_json_newline(j);
 
-out:
-	free(str);
+	uh_ubus_json_write(j, table ? "}" : "]", 1);
 }
 
-bool
-uh_ubus_request(struct client *cl, struct uh_ubus_state *state)
+/* send the response header, the document follows in chunks as it is
+ * generated, or delimited by the connection close for HTTP/1.0, size
+ * estimates the document from the length of the reply messages */
+static void
+uh_ubus_json_begin(struct uh_ubus_json *j, struct client *cl, int size)
 {
-	int i, len = 0;
-	bool access = false;
-	char *sid, *obj, *fun;
+	const char *coding = NULL;
+	struct uh_ubus_calls *calls = cl->priv;
 
-	struct blob_buf buf;
-	struct uh_ubus_session *ses;
-	struct uh_ubus_session_acl *acl;
+	memset(j, 0, sizeof(*j));
 
-	uint32_t obj_id;
+	j->cl = cl;
+	j->indent = calls->state->indent;
 
+	if (cl->request.version > UH_HTTP_VER_1_0)
+		j->req = &cl->request;
+	else
+		cl->keepalive = false;
 
-	memset(&buf, 0, sizeof(buf));
-	blob_buf_init(&buf, 0);
+	cl->response.statuscode = 200;
+
+#ifdef HAVE_ZLIB
+	coding = uh_deflate_start(cl, "application/json", size);
+#endif
+
+	uh_tcp_cork(cl);
+	j->corked = true;
 
-	if (!uh_ubus_request_parse_url(cl, &sid, &obj, &fun))
+	uh_http_sendf(cl, NULL,
+				  "%s 200 OK\r\n"
+				  "Connection: %s\r\n"
+				  "Content-Type: application/json\r\n"
+				  "%s",
+				  http_versions[cl->request.version],
+				  uh_http_connection(cl),
+				  j->req ? "Transfer-Encoding: chunked\r\n" : "");
+
+	if (coding)
+		uh_http_sendf(cl, NULL,
+					  "Content-Encoding: %s\r\n"
+					  "Vary: Accept-Encoding\r\n", coding);
+
+	uh_http_send(cl, NULL, "\r\n", -1);
+}
+
+static void
+uh_ubus_json_end(struct uh_ubus_json *j)
+{
+	if (j->indent)
+		uh_ubus_json_write(j, "\n", 1);
+
+	uh_ubus_json_flush(j);
+
+	if (j->req)
+		uh_http_send(j->cl, j->req, "", 0);
+}
+
+static void
+uh_ubus_reply_plain(struct client *cl, struct uh_ubus_call *call)
+{
+	struct uh_ubus_json j;
+
+	if (!call->error && call->status)
+		call->error = UH_UBUS_ERR_INVOKE;
+
+	if (call->error)
 	{
-		uh_http_sendhf(cl, 400, "Bad Request", "Invalid Request\n");
-		goto out;
+		uh_http_sendhf(cl, uh_ubus_errors[call->error].code,
+					   uh_ubus_errors[call->error].status, "%s\n",
+					   uh_ubus_errors[call->error].text);
+		return;
 	}
 
-	if (!(ses = uh_ubus_session_get(state, sid)))
+	if (!call->data)
 	{
-		uh_http_sendhf(cl, 404, "Not Found", "No such session\n");
-		goto out;
+		/* a 204 must not carry the body sent along */
+		cl->response.statuscode = 204;
+		cl->keepalive = false;
+		uh_http_sendhf(cl, 204, "No content", "Function did not return data\n");
+		return;
 	}
 
-	avl_for_each_element(&ses->acls, acl, avl)
+	uh_ubus_json_begin(&j, cl, blob_len(call->data));
+	uh_ubus_json_list(&j, blob_data(call->data), blob_len(call->data), true);
+	uh_ubus_json_end(&j);
+}
+
+/* write one JSON-RPC response object, ubus status codes are reported
+ * in the result like "ubus call" does, request errors as rpc errors */
+static void
+uh_ubus_reply_rpc(struct uh_ubus_json *j, struct uh_ubus_call *call)
+{
+	char num[16];
+
+	uh_ubus_json_write(j, "{\"jsonrpc\":\"2.0\"", -1);
+
+	if (call->id)
+	{
+		uh_ubus_json_write(j, ",\"id\":", -1);
+		uh_ubus_json_write(j, json_object_to_json_string(call->id), -1);
+	}
+
+	if (call->error)
+	{
+		uh_ubus_json_write(j, ",\"error\":{\"code\":", -1);
+		uh_ubus_json_write(j, num, snprintf(num, sizeof(num), "%d",
+		                   uh_ubus_errors[call->error].rpc_code));
+		uh_ubus_json_write(j, ",\"message\":", -1);
+		uh_ubus_json_string(j, uh_ubus_errors[call->error].rpc_text);
+		uh_ubus_json_write(j, "}", 1);
+	}
+	else
 	{
-		if (uh_ubus_strmatch(obj, acl->object) &&
-			uh_ubus_strmatch(fun, acl->function))
+		uh_ubus_json_write(j, num, snprintf(num, sizeof(num),
+		                   ",\"result\":[%d", call->status));
+
+		if (call->data)
 		{
-			access = true;
-			break;
+			uh_ubus_json_write(j, ",", 1);
+			uh_ubus_json_list(j, blob_data(call->data), blob_len(call->data),
+			                  true);
 		}
+
+		uh_ubus_json_write(j, "]", 1);
 	}
 
-	if (!access)
+	uh_ubus_json_write(j, "}", 1);
+}
+
+static void
+uh_ubus_reply(struct uh_ubus_calls *calls)
+{
+	int i, size = 0;
+	struct uh_ubus_json j;
+	struct client *cl = calls->cl;
+
+	if (!calls->jsonrpc)
 	{
-		uh_http_sendhf(cl, 403, "Denied", "Access to object denied\n");
-		goto out;
+		uh_ubus_reply_plain(cl, &calls->call[0]);
+		return;
 	}
 
-	/* find content length */
-	if (cl->request.method == UH_HTTP_MSG_POST)
+	for (i = 0; i < calls->n_calls; i++)
+		if (calls->call[i].data)
+			size += blob_len(calls->call[i].data);
+
+	uh_ubus_json_begin(&j, cl, size);
+
+	/* responses in request order, a batch yields an array */
+	if (calls->batch)
+		uh_ubus_json_write(&j, "[", 1);
+
+	for (i = 0; i < calls->n_calls; i++)
 	{
-		foreach_header(i, cl->request.headers)
+		if (i)
+			uh_ubus_json_write(&j, ",", 1);
+
+		uh_ubus_json_newline(&j);
+		uh_ubus_reply_rpc(&j, &calls->call[i]);
+	}
+
+	if (calls->batch)
+		uh_ubus_json_write(&j, "]", 1);
+
+	uh_ubus_json_end(&j);
+}
+
+static void
+uh_ubus_complete(struct uh_ubus_calls *calls)
+{
+	uloop_timeout_cancel(&calls->timeout);
+
+	uh_ubus_reply(calls);
+	calls->done = true;
+
+	/* let the server finish the request from the loop */
+	uh_client_yield(calls->cl);
+}
+
+static void
+uh_ubus_complete_cb(struct ubus_request *req, int ret)
+{
+	struct uh_ubus_call *call = container_of(req, struct uh_ubus_call, req);
+	struct uh_ubus_calls *calls = call->calls;
+
+	if (calls->aborted || !call->pending)
+		return;
+
+	D("ubus: Client(%d) call %d completed (%d)\n",
+	  calls->cl->fd.fd, (int)(call - calls->call), ret);
+
+	call->status = ret;
+	call->pending = false;
+
+	if (!--calls->n_pending)
+		uh_ubus_complete(calls);
+}
+
+static void
+uh_ubus_abort(struct uh_ubus_calls *calls, int error)
+{
+	int i;
+
+	calls->aborted = true;
+
+	for (i = 0; i < calls->n_calls; i++)
+	{
+		/* the session fetch continues for the other calls */
+		if (calls->call[i].waiting)
 		{
-			if (!strcasecmp(cl->request.headers[i], "Content-Length"))
-			{
-				len = atoi(cl->request.headers[i+1]);
-				break;
-			}
+			list_del(&calls->call[i].wait);
+
+			calls->call[i].waiting = false;
+			calls->call[i].error = error;
 		}
+
+		if (!calls->call[i].pending)
+			continue;
+
+		ubus_abort_request(calls->state->ctx, &calls->call[i].req);
+
+		calls->call[i].pending = false;
+		calls->call[i].error = error;
 	}
 
-	if (len > UH_UBUS_MAX_POST_SIZE)
+	calls->n_pending = 0;
+}
+
+static void
+uh_ubus_timeout_cb(struct uloop_timeout *t)
+{
+	struct uh_ubus_calls *calls = container_of(t, struct uh_ubus_calls, timeout);
+
+	D("ubus: Client(%d) %d calls timed out\n",
+	  calls->cl->fd.fd, calls->n_pending);
+
+	uh_ubus_abort(calls, UH_UBUS_ERR_TIMEOUT);
+	uh_ubus_complete(calls);
+}
+
+/* check the session ACLs and issue the call, returns an error code or
+ * zero once the call is outstanding */
+static int
+uh_ubus_call_invoke(struct uh_ubus_calls *calls, struct uh_ubus_call *call,
+					struct uh_ubus_session *ses, const char *obj,
+					const char *fun, struct blob_attr *args)
+{
+	uint32_t obj_id;
+	struct uh_ubus_state *state = calls->state;
+
+	if (!ses)
+		return UH_UBUS_ERR_SESSION;
+
+	if (!uh_ubus_session_acl_check(ses, obj, fun))
+		return UH_UBUS_ERR_ACCESS;
+
+	if (!uh_ubus_object_id(state, obj, &obj_id))
+		return UH_UBUS_ERR_OBJECT;
+
+	if (ubus_invoke_async(state->ctx, obj_id, fun, args, &call->req))
+		return UH_UBUS_ERR_INVOKE;
+
+	call->pending = true;
+	call->req.data_cb = uh_ubus_request_cb;
+	call->req.complete_cb = uh_ubus_complete_cb;
+
+	ubus_complete_request_async(state->ctx, &call->req);
+	calls->n_pending++;
+
+	return UH_UBUS_ERR_NONE;
+}
+
+/* the session arrived, or not, issue the calls queued on it */
+static void
+uh_ubus_fetch_complete_cb(struct ubus_request *req, int ret)
+{
+	struct uh_ubus_call *call, *ncall;
+	struct uh_ubus_calls *calls;
+	struct uh_ubus_session *cached;
+	struct uh_ubus_fetch *fetch = container_of(req, struct uh_ubus_fetch, req);
+	struct uh_ubus_session *ses = (!ret && fetch->ses->id[0]) ? fetch->ses : NULL;
+	struct uh_ubus_state *state = fetch->state;
+
+	list_del(&fetch->list);
+
+	/* keep the compiled ACLs for the following requests, each fetch also
+	 * touches the session in the supervisor which notifies us once it
+	 * changes or expires */
+	if (ses && !fetch->stale &&
+		!avl_find_element(&state->sessions, ses->id, cached, avl))
 	{
-		uh_http_sendhf(cl, 413, "Too Large", "Message too big\n");
-		goto out;
+		ses->timeout = UH_UBUS_CACHE_TTL;
+		uh_ubus_session_insert(state, ses);
+
+		fetch->ses = NULL;
 	}
 
-	if (len && !uh_ubus_request_parse_post(cl, len, &buf))
+	list_for_each_entry_safe(call, ncall, &fetch->waiters, wait)
 	{
-		uh_http_sendhf(cl, 400, "Bad Request", "Invalid JSON data\n");
-		goto out;
+		calls = call->calls;
+
+		list_del(&call->wait);
+		call->waiting = false;
+		calls->n_pending--;
+
+		call->error = uh_ubus_call_invoke(calls, call, ses, call->object,
+		                                  call->function, call->args);
+
+		if (!calls->n_pending)
+			uh_ubus_complete(calls);
 	}
 
-	if (ubus_lookup_id(state->ctx, obj, &obj_id))
+	if (fetch->ses)
+		uh_ubus_session_free(fetch->ses);
+
+	free(fetch);
+}
+
+/* queue the call until the session has been fetched from the supervisor,
+ * the strings and arguments of the request are gone by then */
+static int
+uh_ubus_call_defer(struct uh_ubus_calls *calls, struct uh_ubus_call *call,
+				   const char *sid, const char *obj, const char *fun,
+				   struct blob_attr *args)
+{
+	struct uh_ubus_fetch *fetch;
+
+	if (!(call->object = malloc(strlen(obj) + strlen(fun) + 2)) ||
+		!(call->args = blob_memdup(args)))
+		return UH_UBUS_ERR_INVOKE;
+
+	call->function = call->object + strlen(obj) + 1;
+
+	strcpy(call->object, obj);
+	strcpy(call->function, fun);
+
+	if (!(fetch = uh_ubus_session_fetch(calls->state, sid)))
+		return UH_UBUS_ERR_SESSION;
+
+	list_add_tail(&call->wait, &fetch->waiters);
+	call->waiting = true;
+	calls->n_pending++;
+
+	return UH_UBUS_ERR_NONE;
+}
+
+static void
+uh_ubus_call_start(struct uh_ubus_calls *calls, struct uh_ubus_call *call,
+				   const char *sid, const char *obj, const char *fun,
+				   struct blob_attr *args)
+{
+	struct uh_ubus_state *state = calls->state;
+
+	struct uh_ubus_session *ses;
+
+	call->calls = calls;
+
+	/* cached copies are not touched, they only live for the cache ttl */
+	if (state->remote)
+	{
+		if ((ses = avl_find_element(&state->sessions, sid, ses, avl)) != NULL)
+			call->error = uh_ubus_call_invoke(calls, call, ses, obj, fun, args);
+		else
+			call->error = uh_ubus_call_defer(calls, call, sid, obj, fun, args);
+	}
+	else
+		call->error = uh_ubus_call_invoke(calls, call,
+		                                  uh_ubus_session_get(state, sid),
+		                                  obj, fun, args);
+}
+
+/* start a JSON-RPC "call" request, its params are the session id, the
+ * object, the function and an optional argument object */
+static void
+uh_ubus_call_start_rpc(struct uh_ubus_calls *calls, struct uh_ubus_call *call,
+					   struct json_object *req, struct blob_buf *b)
+{
+	int i;
+	struct json_object *id, *method, *params, *tb[4] = { NULL };
+
+	call->calls = calls;
+	call->error = UH_UBUS_ERR_REQUEST;
+
+	if (json_object_get_type(req) != json_type_object)
+		return;
+
+	id     = json_object_object_get(req, "id");
+	method = json_object_object_get(req, "method");
+	params = json_object_object_get(req, "params");
+
+	if (id)
+		call->id = json_object_get(id);
+
+	if (!method || !params ||
+		strcmp(json_object_get_string(method), "call") ||
+		(json_object_get_type(params) != json_type_array))
+		return;
+
+	for (i = 0; (i < 4) && (i < json_object_array_length(params)); i++)
+		tb[i] = json_object_array_get_idx(params, i);
+
+	for (i = 0; i < 3; i++)
+		if (!tb[i] || (json_object_get_type(tb[i]) != json_type_string))
+			return;
+
+	if (tb[3] && !uh_ubus_request_parse_args(tb[3], b))
+		return;
+
+	if (!tb[3])
+		blob_buf_init(b, 0);
+
+	call->error = UH_UBUS_ERR_NONE;
+
+	uh_ubus_call_start(calls, call,
+					   json_object_get_string(tb[0]),
+					   json_object_get_string(tb[1]),
+					   json_object_get_string(tb[2]), b->head);
+}
+
+static void
+uh_ubus_calls_free(struct uh_ubus_calls *calls)
+{
+	int i;
+
+	for (i = 0; i < calls->n_calls; i++)
+	{
+		free(calls->call[i].data);
+		free(calls->call[i].object);
+		free(calls->call[i].args);
+
+		if (calls->call[i].id)
+			json_object_put(calls->call[i].id);
+	}
+
+	free(calls);
+}
+
+static bool
+uh_ubus_socket_cb(struct client *cl)
+{
+	char c;
+	struct uh_ubus_calls *calls = cl->priv;
+
+	if (calls->done)
+		return false;
+
+	/* the client went away, give up on the outstanding calls */
+	if (!recv(cl->fd.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT))
 	{
-		uh_http_sendhf(cl, 500, "Internal Error", "Unable to lookup object\n");
+		D("ubus: Client(%d) hung up with %d pending calls\n",
+		  cl->fd.fd, calls->n_pending);
+
+		cl->keepalive = false;
+		return false;
+	}
+
+	return true;
+}
+
+static void
+uh_ubus_socket_cleanup(struct client *cl)
+{
+	struct uh_ubus_calls *calls = cl->priv;
+
+	uloop_timeout_cancel(&calls->timeout);
+	uh_ubus_abort(calls, UH_UBUS_ERR_TIMEOUT);
+	uh_ubus_calls_free(calls);
+}
+
+static bool
+uh_ubus_request_dispatch(struct client *cl, struct uh_ubus_state *state,
+						 char *sid, char *obj, char *fun,
+						 struct json_object *post)
+{
+	int i, n = 1;
+	bool batch = false;
+
+	struct blob_buf buf;
+	struct uh_ubus_calls *calls = NULL;
+
+
+	memset(&buf, 0, sizeof(buf));
+	blob_buf_init(&buf, 0);
+
+	/* body consumed */
+	cl->request.content_length = 0;
+
+	if (!fun && (json_object_get_type(post) == json_type_array))
+	{
+		batch = true;
+		n = json_object_array_length(post);
+
+		if ((n < 1) || (n > UH_UBUS_MAX_BATCH))
+		{
+			uh_http_sendhf(cl, 400, "Bad Request", "Invalid Request\n");
+			goto out;
+		}
+	}
+
+	if (!(calls = calloc(1, sizeof(*calls) + n * sizeof(calls->call[0]))))
+	{
+		uh_http_sendhf(cl, 500, "Internal Error", "Out of memory\n");
 		goto out;
 	}
 
-	if (ubus_invoke(state->ctx, obj_id, fun, buf.head,
-					uh_ubus_request_cb, cl, state->timeout * 1000))
+	calls->cl = cl;
+	calls->state = state;
+	calls->n_calls = n;
+	calls->batch = batch;
+	calls->jsonrpc = !fun;
+	calls->timeout.cb = uh_ubus_timeout_cb;
+
+	/* issue all calls at once, the replies arrive in any order */
+	if (!fun)
+	{
+		for (i = 0; i < n; i++)
+			uh_ubus_call_start_rpc(calls, &calls->call[i],
+								   batch ? json_object_array_get_idx(post, i)
+								         : post, &buf);
+	}
+	else if (post && !uh_ubus_request_parse_args(post, &buf))
+	{
+		calls->call[0].error = UH_UBUS_ERR_PARSE;
+	}
+	else
+	{
+		uh_ubus_call_start(calls, &calls->call[0], sid, obj, fun, buf.head);
+	}
+
+	/* nothing outstanding, reply right away */
+	if (!calls->n_pending)
 	{
-		uh_http_sendhf(cl, 500, "Internal Error", "Unable to invoke function\n");
+		uh_ubus_reply(calls);
+		uh_ubus_calls_free(calls);
 		goto out;
 	}
 
+	D("ubus: Client(%d) waiting for %d calls\n", cl->fd.fd, calls->n_pending);
+
+	uloop_timeout_set(&calls->timeout, state->timeout * 1000);
+
+	cl->cb = uh_ubus_socket_cb;
+	cl->cleanup = uh_ubus_socket_cleanup;
+	cl->priv = calls;
+
+	blob_buf_free(&buf);
+	json_object_put(post);
+	return true;
+
 out:
 	blob_buf_free(&buf);
+
+	if (post)
+		json_object_put(post);
+
 	return false;
 }
 
+static void
+uh_ubus_post_cleanup(struct client *cl)
+{
+	struct uh_ubus_post *post = cl->priv;
+
+	if (post->obj)
+		json_object_put(post->obj);
+
+	json_tokener_free(post->tok);
+	free(post);
+}
+
+static bool
+uh_ubus_post_cb(struct client *cl)
+{
+	int rv;
+	struct json_object *obj;
+	struct uh_ubus_post *post = cl->priv;
+
+	/* wait for the next read event */
+	if (!(rv = uh_ubus_request_parse_post(cl, post)))
+		return true;
+
+	if (rv < 0)
+	{
+		uh_http_sendhf(cl, 400, "Bad Request", "Invalid JSON data\n");
+		return false;
+	}
+
+	/* trailing data after the JSON value cannot be told apart from
+	 * the next request */
+	if (post->len > 0)
+		cl->keepalive = false;
+
+	/* the calls take over the client */
+	obj = post->obj;
+	post->obj = NULL;
+
+	cl->cb = NULL;
+	cl->cleanup = NULL;
+	cl->priv = NULL;
+
+	rv = uh_ubus_request_dispatch(cl, post->state, post->sid, post->object,
+								  post->function, obj);
+
+	json_tokener_free(post->tok);
+	free(post);
+
+	return rv;
+}
+
+bool
+uh_ubus_request(struct client *cl, struct uh_ubus_state *state)
+{
+	int len = 0;
+	char *sid, *obj, *fun;
+
+	struct uh_ubus_post *post;
+
+
+	/* find content length */
+	if (cl->request.method == UH_HTTP_MSG_POST)
+		len = cl->request.content_length;
+
+	if (len > UH_UBUS_MAX_POST_SIZE)
+	{
+		uh_http_sendhf(cl, 413, "Too Large", "Message too big\n");
+		return false;
+	}
+
+	/* a post to the prefix itself carries one or more JSON-RPC calls */
+	if (!uh_ubus_request_parse_url(cl, &sid, &obj, &fun) &&
+		(!len || *sid))
+	{
+		uh_http_sendhf(cl, 400, "Bad Request", "Invalid Request\n");
+		return false;
+	}
+
+	if (!len)
+		return uh_ubus_request_dispatch(cl, state, sid, obj, fun, NULL);
+
+	/* the body is parsed as it arrives, without waiting for the socket */
+	if (!(post = calloc(1, sizeof(*post))) ||
+		!(post->tok = json_tokener_new()))
+	{
+		free(post);
+		uh_http_sendhf(cl, 500, "Internal Error", "Out of memory\n");
+		return false;
+	}
+
+	post->state = state;
+	post->sid = sid;
+	post->object = obj;
+	post->function = fun;
+	post->len = len;
+
+	cl->cb = uh_ubus_post_cb;
+	cl->cleanup = uh_ubus_post_cleanup;
+	cl->priv = post;
+
+	return true;
+}
+
+void
+uh_ubus_fork(struct uh_ubus_state *state, const struct config *conf)
+{
+	int i;
+	struct uh_ubus_session *ses, *nses;
+
+	/* the inherited connection and sessions belong to the supervisor,
+	 * freeing the context only closes our copy of the socket without
+	 * unregistering the objects it published */
+	uloop_timeout_cancel(&state->expire);
+	uloop_fd_delete(&state->ctx->sock);
+	ubus_free(state->ctx);
+
+	avl_remove_all_elements(&state->sessions, ses, avl, nses)
+		uh_ubus_session_free(ses);
+
+	for (i = 0; i < UH_UBUS_WHEEL_SLOTS; i++)
+		INIT_LIST_HEAD(&state->wheel[i]);
+
+	state->ctx = ubus_connect(conf->ubus_socket);
+	state->remote = true;
+
+	if (!state->ctx)
+	{
+		fprintf(stderr, "Unable to connect to ubus socket\n");
+		exit(1);
+	}
+
+	ubus_add_uloop(state->ctx);
+
+	/* the object list has to follow the events of our own connection */
+	uh_ubus_objects_free(state);
+	uh_ubus_objects_init(state);
+
+	if (ubus_register_event_handler(state->ctx, &state->events,
+									"uhttpd.session"))
+	{
+		fprintf(stderr, "Unable to follow ubus session changes\n");
+		exit(1);
+	}
+}
+
 void
 uh_ubus_close(struct uh_ubus_state *state)
 {
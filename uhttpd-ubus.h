@@ -27,22 +27,108 @@
 
 
 #define UH_UBUS_MAX_POST_SIZE	4096
+#define UH_UBUS_MAX_BATCH		32
+
+/* one second slots of the session expiry wheel */
+#define UH_UBUS_WHEEL_SLOTS		64
+
+#define UH_UBUS_ACL_HASH		16
+
+/* seconds a worker reuses the ACLs of a session fetched from the
+ * supervisor, grants, revokes and destroys invalidate them earlier */
+#define UH_UBUS_CACHE_TTL		10
+
+/* output collected by the JSON writer before it is sent as one chunk */
+#define UH_UBUS_JSON_CHUNK		2048
+
+enum {
+	UH_UBUS_ERR_NONE,
+	UH_UBUS_ERR_PARSE,
+	UH_UBUS_ERR_REQUEST,
+	UH_UBUS_ERR_SESSION,
+	UH_UBUS_ERR_ACCESS,
+	UH_UBUS_ERR_OBJECT,
+	UH_UBUS_ERR_INVOKE,
+	UH_UBUS_ERR_TIMEOUT,
+};
 
 
 struct uh_ubus_state {
 	struct ubus_context *ctx;
 	struct ubus_object ubus;
+	struct ubus_event_handler events;
 	struct blob_buf buf;
 	struct avl_tree sessions;
+	struct avl_tree objects;
+	struct list_head fetches;
+	struct list_head wheel[UH_UBUS_WHEEL_SLOTS];
+	struct uloop_timeout expire;
+	time_t wheel_time;
+	bool remote;
+	bool indent;
 	int timeout;
 };
 
+struct uh_ubus_json {
+	struct client *cl;
+	struct http_request *req;
+	bool indent;
+	bool corked;
+	int level;
+	int len;
+	char buf[UH_UBUS_JSON_CHUNK];
+};
+
 struct uh_ubus_request_data {
 	const char *sid;
 	const char *object;
 	const char *function;
 };
 
+/* request body collected across read events */
+struct uh_ubus_post {
+	struct uh_ubus_state *state;
+	struct json_tokener *tok;
+	struct json_object *obj;
+	char *sid;
+	char *object;
+	char *function;
+	int len;
+};
+
+struct uh_ubus_calls;
+
+struct uh_ubus_call {
+	struct ubus_request req;
+	struct uh_ubus_calls *calls;
+	struct json_object *id;
+	struct blob_attr *data;
+	struct list_head wait;
+	char *object;
+	char *function;
+	struct blob_attr *args;
+	bool waiting;
+	bool pending;
+	int status;
+	int error;
+};
+
+struct uh_ubus_calls {
+	struct client *cl;
+	struct uh_ubus_state *state;
+	struct uloop_timeout timeout;
+	bool jsonrpc;
+	bool batch;
+	bool aborted;
+	bool done;
+	int n_pending;
+	int n_calls;
+	struct uh_ubus_call call[];
+};
+
+struct uh_ubus_session_acl;
+struct uh_ubus_acl_node;
+
 struct uh_ubus_session {
 	char id[33];
 	int timeout;
@@ -50,6 +136,10 @@ struct uh_ubus_session {
 	struct avl_tree data;
 	struct avl_tree acls;
 	struct timespec touched;
+	struct list_head wheel;
+	bool acl_dirty;
+	struct uh_ubus_session_acl *acl_hash[UH_UBUS_ACL_HASH];
+	struct uh_ubus_acl_node *acl_trie;
 };
 
 struct uh_ubus_session_data {
@@ -59,11 +149,40 @@ struct uh_ubus_session_data {
 
 struct uh_ubus_session_acl {
 	struct avl_node avl;
+	struct uh_ubus_session_acl *chain;
 	char *function;
 	char object[];
 };
 
+/* wildcard ACLs indexed by the literal prefix of their object pattern */
+struct uh_ubus_acl_node {
+	struct uh_ubus_acl_node *child;
+	struct uh_ubus_acl_node *next;
+	struct uh_ubus_session_acl *acls;
+	char c;
+};
+
+/* ubus object ids by path, kept up to date from the object events */
+struct uh_ubus_object {
+	struct avl_node avl;
+	uint32_t id;
+	char path[];
+};
+
+/* session lookup in the supervisor, shared by all calls of that session
+ * issued while it is outstanding */
+struct uh_ubus_fetch {
+	struct ubus_request req;
+	struct uh_ubus_state *state;
+	struct uh_ubus_session *ses;
+	struct list_head list;
+	struct list_head waiters;
+	bool stale;
+	char id[33];
+};
+
 struct uh_ubus_state * uh_ubus_init(const struct config *conf);
+void uh_ubus_fork(struct uh_ubus_state *state, const struct config *conf);
 bool uh_ubus_request(struct client *cl, struct uh_ubus_state *state);
 void uh_ubus_close(struct uh_ubus_state *state);
 
@@ -16,13 +16,24 @@
  *  limitations under the License.
  */
 
+#define _GNU_SOURCE /* splice() */
+
 #include "uhttpd.h"
 #include "uhttpd-utils.h"
+#include "uhttpd-metrics.h"
 
 #ifdef HAVE_TLS
 #include "uhttpd-tls.h"
 #endif
 
+#ifdef HAVE_CGI
+#include "uhttpd-fcgi.h"
+#endif
+
+#ifdef HAVE_ZLIB
+#include "uhttpd-deflate.h"
+#endif
+
 
 const char * sa_straddr(void *sa)
 {
@@ -63,6 +74,21 @@ int sa_rfc1918(void *sa)
 	return 0;
 }
 
+int sa_same_host(void *a, void *b)
+{
+	struct sockaddr_in6 *v6a = (struct sockaddr_in6 *)a;
+	struct sockaddr_in6 *v6b = (struct sockaddr_in6 *)b;
+
+	if (v6a->sin6_family != v6b->sin6_family)
+		return 0;
+
+	if (v6a->sin6_family == AF_INET)
+		return ((struct sockaddr_in *)a)->sin_addr.s_addr ==
+		       ((struct sockaddr_in *)b)->sin_addr.s_addr;
+
+	return !memcmp(&v6a->sin6_addr, &v6b->sin6_addr, sizeof(v6a->sin6_addr));
+}
+
 /* Simple strstr() like function that takes len arguments for both haystack and needle. */
 char *strfind(char *haystack, int hslen, const char *needle, int ndlen)
 {
@@ -187,16 +213,436 @@ int uh_raw_send(int fd, const char *buf, int len, int sec)
 						 uh_tcp_send_lowlevel);
 }
 
+/* every client writes at most UH_LIMIT_QUANTUM bytes per loop iteration so
+ * a bulk transfer cannot hold back the responses of other clients, the
+ * round ends with the next timeout run and level triggered polling picks
+ * up whatever was left over */
+static unsigned int uh_output_round = 1;
+
+static void uh_output_round_cb(struct uloop_timeout *t)
+{
+	uh_output_round++;
+}
+
+static struct uloop_timeout uh_output_timer = { .cb = uh_output_round_cb };
+
+static int uh_client_budget(struct client *cl)
+{
+	if (cl->outbuf.round != uh_output_round)
+	{
+		cl->outbuf.round = uh_output_round;
+		cl->outbuf.sent  = 0;
+	}
+
+	return max(UH_LIMIT_QUANTUM - cl->outbuf.sent, 0);
+}
+
+static void uh_client_spend(struct client *cl, int len)
+{
+	uh_metrics_add(bytes_out, len);
+
+	uh_client_budget(cl);
+	cl->outbuf.sent += len;
+
+	if (!uh_output_timer.pending)
+		uloop_timeout_set(&uh_output_timer, 0);
+}
+
+static int uh_tcp_write(struct client *cl, const char *buf, int len,
+						bool more)
+{
+	ssize_t rv;
+	int sent = 0;
+	int budget = uh_client_budget(cl);
+
+	/* write as much as the socket and the budget allow without blocking */
+	while ((sent < len) && (sent < budget))
+	{
+#ifdef HAVE_TLS
+		/* a record that hit EAGAIN has to be retried with the same length,
+		 * so the budget only ends the loop but never shortens a write */
+		if (cl->tls)
+			rv = cl->server->conf->tls_send(cl, buf + sent, len - sent);
+		else
+#endif
+		/* more data follows, let the kernel coalesce it into full segments */
+		rv = send(cl->fd.fd, buf + sent, min(len, budget) - sent,
+				  (more || (len > budget)) ? MSG_MORE : 0);
+
+		if (rv < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			D("IO: FD(%d) write error: %s\n", cl->fd.fd, strerror(errno));
+			return -1;
+		}
+		else if (rv == 0)
+		{
+			D("IO: FD(%d) appears closed\n", cl->fd.fd);
+			return -1;
+		}
+
+		sent += rv;
+	}
+
+	uh_client_spend(cl, sent);
+
+	D("IO: FD(%d) sent %d/%d bytes\n", cl->fd.fd, sent, len);
+	return sent;
+}
+
+static void uh_client_poll(struct client *cl)
+{
+	unsigned int events = 0;
+
+	/* stop reading further requests while the peer does not keep up
+	 * with its responses or while a child does not keep up with the
+	 * request body, a closing client is not read at all unless a tls
+	 * renegotiation waits for input */
+	if (!cl->outbuf.closing && !cl->stalled &&
+		(!uh_client_congested(cl) || cl->outbuf.blocked))
+		events |= ULOOP_READ;
+
+	/* tls renegotiation stalled the queue until input arrives */
+	if (((cl->outbuf.len > 0) || cl->outbuf.wait) && !cl->outbuf.blocked)
+		events |= ULOOP_WRITE;
+
+	if (events != cl->outbuf.events)
+	{
+		D("IO: FD(%d) polling for%s%s\n", cl->fd.fd,
+		  (events & ULOOP_READ) ? " read" : "",
+		  (events & ULOOP_WRITE) ? " write" : "");
+
+		uloop_fd_add(&cl->fd, events | ULOOP_BLOCKING);
+		cl->outbuf.events = events;
+	}
+}
+
+static int uh_outbuf_append(struct client *cl, const char *buf, int len)
+{
+	char *new;
+	int size;
+
+	if ((cl->outbuf.off + cl->outbuf.len + len) > cl->outbuf.size)
+	{
+		/* reclaim the already sent head of the buffer first */
+		if (cl->outbuf.off > 0)
+		{
+			memmove(cl->outbuf.buf, cl->outbuf.buf + cl->outbuf.off,
+					cl->outbuf.len);
+
+			cl->outbuf.off = 0;
+		}
+
+		if ((cl->outbuf.len + len) > cl->outbuf.size)
+		{
+			size = max(cl->outbuf.size * 2, UH_LIMIT_MSGHEAD);
+
+			while (size < (cl->outbuf.len + len))
+				size *= 2;
+
+			if (!(new = realloc(cl->outbuf.buf, size)))
+			{
+				D("IO: FD(%d) cannot grow output buffer\n", cl->fd.fd);
+				return -1;
+			}
+
+			cl->outbuf.buf  = new;
+			cl->outbuf.size = size;
+		}
+	}
+
+	memcpy(cl->outbuf.buf + cl->outbuf.off + cl->outbuf.len, buf, len);
+	cl->outbuf.len += len;
+
+	return len;
+}
+
+static int uh_outbuf_flush(struct client *cl, bool more)
+{
+	int rv;
+
+	if (cl->outbuf.len > 0)
+	{
+		if ((rv = uh_tcp_write(cl, cl->outbuf.buf + cl->outbuf.off,
+							   cl->outbuf.len, more)) < 0)
+			return -1;
+
+		cl->outbuf.off += rv;
+		cl->outbuf.len -= rv;
+
+		/* release the buffer of idle connections */
+		if (!cl->outbuf.len)
+		{
+			free(cl->outbuf.buf);
+
+			cl->outbuf.buf  = NULL;
+			cl->outbuf.off  = 0;
+			cl->outbuf.size = 0;
+		}
+	}
+
+	return 0;
+}
+
+int uh_tcp_sendv(struct client *cl, struct iovec *iov, int iovcnt)
+{
+	int i, len;
+	ssize_t rv = 0;
+
+	/* first data of the response */
+	if (cl->metrics.start)
+		uh_metrics_response(cl, iov[0].iov_base, iov[0].iov_len);
+
+	for (i = 0, len = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	/* plain connection with nothing queued, hand the data to the socket
+	 * directly, tls records are assembled in the queue instead and so is
+	 * anything exceeding the output budget of this round */
+	if (!cl->outbuf.len && !cl->outbuf.cork &&
+		(len <= uh_client_budget(cl))
+#ifdef HAVE_TLS
+		&& !cl->tls
+#endif
+		)
+	{
+		while (((rv = writev(cl->fd.fd, iov, iovcnt)) < 0) && (errno == EINTR))
+			continue;
+
+		if ((rv < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+		{
+			D("IO: FD(%d) write error: %s\n", cl->fd.fd, strerror(errno));
+			goto err;
+		}
+
+		rv = max(rv, 0);
+		uh_client_spend(cl, rv);
+	}
+
+	/* queue the remainder, it is flushed once the socket is writable */
+	for (i = 0; i < iovcnt; i++)
+	{
+		if (rv >= iov[i].iov_len)
+		{
+			rv -= iov[i].iov_len;
+			continue;
+		}
+
+		if (uh_outbuf_append(cl, (char *)iov[i].iov_base + rv,
+							 iov[i].iov_len - rv) < 0)
+			goto err;
+
+		rv = 0;
+	}
+
+	if (!cl->outbuf.cork && (uh_outbuf_flush(cl, false) < 0))
+		goto err;
+
+	uh_client_poll(cl);
+	return 0;
+
+err:
+	/* response is incomplete, the connection must not be reused */
+	cl->keepalive = false;
+	return -1;
+}
+
 int uh_tcp_send(struct client *cl, const char *buf, int len)
 {
-	int seconds = cl->server->conf->network_timeout;
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+	ensure_ret(uh_tcp_sendv(cl, &iov, 1));
+
+	return len;
+}
+
+void uh_tcp_cork(struct client *cl)
+{
+	cl->outbuf.cork++;
+}
+
+int uh_tcp_uncork(struct client *cl, bool more)
+{
+	/* send everything collected since the outermost uh_tcp_cork() in as
+	 * few segments or tls records as possible */
+	if ((cl->outbuf.cork > 0) && !--cl->outbuf.cork)
+	{
+		if (uh_outbuf_flush(cl, more) < 0)
+		{
+			cl->keepalive = false;
+			return -1;
+		}
+
+		uh_client_poll(cl);
+	}
+
+	return 0;
+}
+
+#ifndef __APPLE__
+int uh_tcp_sendfile(struct client *cl, int fd, off_t *offset, int len)
+{
+	ssize_t rv;
+
+	/* headers and other queued data must go out first, the budget of
+	 * this round may be used up as well */
+	if ((cl->outbuf.len > 0) || !(len = min(len, uh_client_budget(cl))))
+	{
+		uh_client_yield(cl);
+		return 0;
+	}
+
 #ifdef HAVE_TLS
+	/* kernel tls, records are encrypted on the way out */
 	if (cl->tls)
-		return __uh_raw_send(cl, buf, len, seconds,
-							 cl->server->conf->tls_send);
+		rv = cl->server->conf->tls_sendfile(cl, fd, offset, len);
+	else
+#endif
+	while (((rv = sendfile(cl->fd.fd, fd, offset, len)) < 0) &&
+		   (errno == EINTR))
+		continue;
+
+	if ((rv < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+	{
+		rv = 0;
+	}
+
+	/* write error or the file shrunk below the announced length */
+	else if (rv <= 0)
+	{
+		D("IO: FD(%d) sendfile error: %s\n", cl->fd.fd,
+		  rv ? strerror(errno) : "unexpected EOF");
+
+		cl->keepalive = false;
+		return -1;
+	}
+
+	D("IO: FD(%d) sendfile %d/%d bytes\n", cl->fd.fd, (int)rv, len);
+
+	uh_client_spend(cl, rv);
+
+	/* continue with the next chunk once the socket is writable again,
+	 * other clients are served in the meantime */
+	uh_client_yield(cl);
+
+	return rv;
+}
 #endif
-	return __uh_raw_send(cl, buf, len, seconds, uh_tcp_send_lowlevel);
+
+#ifdef HAVE_SPLICE
+int uh_tcp_splice(struct client *cl, int len)
+{
+	ssize_t rv;
+	int avail = 0;
+
+	/* headers and other queued data must go out first, the budget of
+	 * this round may be used up as well */
+	if ((cl->outbuf.len > 0) || !(len = min(len, uh_client_budget(cl))))
+		goto wait;
+
+	while (((rv = splice(cl->rpipe.fd, NULL, cl->fd.fd, NULL, len,
+						 SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) &&
+		   (errno == EINTR))
+		continue;
+
+	if (rv >= 0)
+	{
+		D("IO: FD(%d) spliced %d/%d bytes\n", cl->fd.fd, (int)rv, len);
+		uh_client_spend(cl, rv);
+		return rv;
+	}
+
+	if (errno != EAGAIN)
+	{
+		D("IO: FD(%d) splice error: %s\n", cl->fd.fd, strerror(errno));
+
+		cl->keepalive = false;
+		return -1;
+	}
+
+	/* pipe drained, the rpipe callback fires once there is more output */
+	if ((ioctl(cl->rpipe.fd, FIONREAD, &avail) < 0) || (avail <= 0))
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+wait:
+	/* socket is full, stop watching the pipe until it is writable again */
+	uloop_fd_delete(&cl->rpipe);
+	cl->paused = true;
+
+	uh_client_yield(cl);
+
+	errno = EAGAIN;
+	return -1;
+}
+
+int uh_tcp_splice_in(struct client *cl, int len)
+{
+	ssize_t rv;
+	int avail = 0;
+
+	/* body data received along with the headers goes first */
+	if (cl->httpbuf.len > 0)
+	{
+		while (((rv = write(cl->wpipe.fd, cl->httpbuf.ptr,
+							min(len, cl->httpbuf.len))) < 0) &&
+			   (errno == EINTR))
+			continue;
+
+		if (rv > 0)
+		{
+			cl->httpbuf.ptr += rv;
+			cl->httpbuf.len -= rv;
+		}
+	}
+	else
+	{
+		while (((rv = splice(cl->fd.fd, NULL, cl->wpipe.fd, NULL, len,
+							 SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) &&
+			   (errno == EINTR))
+			continue;
+	}
+
+	if (rv >= 0)
+	{
+		D("IO: FD(%d) spliced %d/%d body bytes\n", cl->fd.fd, (int)rv, len);
+		uh_metrics_add(bytes_in, rv);
+
+		uh_client_poll(cl);
+		return rv;
+	}
+
+	if (errno != EAGAIN)
+	{
+		D("IO: FD(%d) body splice error: %s\n", cl->fd.fd, strerror(errno));
+		return -1;
+	}
+
+	/* nothing received yet, the socket callback fires on more input */
+	if (!cl->httpbuf.len &&
+		((ioctl(cl->fd.fd, FIONREAD, &avail) < 0) || (avail <= 0)))
+	{
+		uh_client_poll(cl);
+
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* pipe is full, stop reading the socket until the child caught up */
+	uloop_fd_add(&cl->wpipe, ULOOP_WRITE);
+	uh_client_stall(cl, true);
+
+	errno = EAGAIN;
+	return -1;
 }
+#endif
 
 static int __uh_raw_recv(struct client *cl, char *buf, int len, int sec,
 						 int (*rfn) (struct client *, char *, int))
@@ -212,9 +658,10 @@ static int __uh_raw_recv(struct client *cl, char *buf, int len, int sec,
 			{
 				continue;
 			}
-			else if ((sec > 0) && (errno == EAGAIN || errno == EWOULDBLOCK))
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
 			{
-				if (!uh_socket_wait(fd, sec, false))
+				/* nonblocking callers continue on the next read event */
+				if ((sec <= 0) || !uh_socket_wait(fd, sec, false))
 					return -1;
 			}
 			else
@@ -248,15 +695,23 @@ int uh_raw_recv(int fd, char *buf, int len, int sec)
 						 uh_tcp_recv_lowlevel);
 }
 
+/* Never waits for the socket, fails with EAGAIN if nothing is available so
+ * that the caller returns to the loop; a slow client is bounded by the
+ * deadline of its connection rather than blocking the others. */
 int uh_tcp_recv(struct client *cl, char *buf, int len)
 {
-	int seconds = cl->server->conf->network_timeout;
+	int rv;
 #ifdef HAVE_TLS
 	if (cl->tls)
-		return __uh_raw_recv(cl, buf, len, seconds,
-							 cl->server->conf->tls_recv);
+		rv = __uh_raw_recv(cl, buf, len, 0, cl->server->conf->tls_recv);
+	else
 #endif
-	return __uh_raw_recv(cl, buf, len, seconds, uh_tcp_recv_lowlevel);
+	rv = __uh_raw_recv(cl, buf, len, 0, uh_tcp_recv_lowlevel);
+
+	if (rv > 0)
+		uh_metrics_add(bytes_in, rv);
+
+	return rv;
 }
 
 
@@ -268,12 +723,19 @@ int uh_http_sendhf(struct client *cl, int code, const char *summary,
 	char buffer[UH_LIMIT_MSGHEAD];
 	int len;
 
+	/* the body is sent regardless of the method, a HEAD client would
+	 * misinterpret it as the beginning of the next response */
+	if (cl->request.method == UH_HTTP_MSG_HEAD)
+		cl->keepalive = false;
+
+	uh_tcp_cork(cl);
+
 	len = snprintf(buffer, sizeof(buffer),
 		"HTTP/1.1 %03i %s\r\n"
-		"Connection: close\r\n"
+		"Connection: %s\r\n"
 		"Content-Type: text/plain\r\n"
 		"Transfer-Encoding: chunked\r\n\r\n",
-			code, summary
+			code, summary, uh_http_connection(cl)
 	);
 
 	ensure_ret(uh_tcp_send(cl, buffer, len));
@@ -282,27 +744,30 @@ int uh_http_sendhf(struct client *cl, int code, const char *summary,
 	len = vsnprintf(buffer, sizeof(buffer), fmt, ap);
 	va_end(ap);
 
-	ensure_ret(uh_http_sendc(cl, buffer, len));
-	ensure_ret(uh_http_sendc(cl, NULL, 0));
-
+	/* the message is never compressed */
+	ensure_ret(uh_http_chunk(cl, buffer, len));
+	ensure_ret(uh_http_chunk(cl, NULL, 0));
+	ensure_ret(uh_tcp_uncork(cl, false));
 	return 0;
 }
 
 
-int uh_http_sendc(struct client *cl, const char *data, int len)
+int uh_http_chunk(struct client *cl, const char *data, int len)
 {
 	char chunk[8];
-	int clen;
-
-	if (len == -1)
-		len = strlen(data);
+	struct iovec iov[3];
 
 	if (len > 0)
 	{
-		clen = snprintf(chunk, sizeof(chunk), "%X\r\n", len);
-		ensure_ret(uh_tcp_send(cl, chunk, clen));
-		ensure_ret(uh_tcp_send(cl, data, len));
-		ensure_ret(uh_tcp_send(cl, "\r\n", 2));
+		/* size line, data and trailing newline in one go */
+		iov[0].iov_base = chunk;
+		iov[0].iov_len  = snprintf(chunk, sizeof(chunk), "%X\r\n", len);
+		iov[1].iov_base = (void *)data;
+		iov[1].iov_len  = len;
+		iov[2].iov_base = "\r\n";
+		iov[2].iov_len  = 2;
+
+		ensure_ret(uh_tcp_sendv(cl, iov, 3));
 	}
 	else
 	{
@@ -312,6 +777,51 @@ int uh_http_sendc(struct client *cl, const char *data, int len)
 	return 0;
 }
 
+int uh_http_sendc(struct client *cl, const char *data, int len)
+{
+	if (len == -1)
+		len = strlen(data);
+
+#ifdef HAVE_ZLIB
+	/* the response handler chose to compress the body */
+	if (cl->deflate)
+		return uh_deflate_sendc(cl, data, len);
+#endif
+
+	return uh_http_chunk(cl, data, len);
+}
+
+bool uh_accept_encoding(const char *hdr, const char *name)
+{
+	int len;
+	bool match;
+	const char *p, *q;
+
+	for (p = hdr; *p; p += strcspn(p, ","))
+	{
+		while (isspace(*p) || (*p == ','))
+			p++;
+
+		for (len = strcspn(p, ",;"); (len > 0) && isspace(p[len-1]); len--);
+
+		match = ((len == strlen(name)) && !strncasecmp(p, name, len));
+		p += len;
+
+		if (!match)
+			continue;
+
+		/* a zero quality value refuses the coding */
+		for (q = p; *q == ';' || isspace(*q); q++);
+
+		if (!strncasecmp(q, "q=", 2))
+			return (strtod(&q[2], NULL) > 0);
+
+		return true;
+	}
+
+	return false;
+}
+
 int uh_http_sendf(struct client *cl, struct http_request *req,
 				  const char *fmt, ...)
 {
@@ -588,16 +1098,174 @@ struct index_file * uh_index_add(const char *filename)
 }
 
 
-/* Returns NULL on error.
-** NB: improperly encoded URL should give client 400 [Bad Syntax]; returning
-** NULL here causes 404 [Not Found], but that's not too unreasonable. */
-struct path_info * uh_path_lookup(struct client *cl, const char *url)
+/* Resolved paths are kept for a few seconds, keyed on the decoded url,
+ * to spare the realpath() walk and index file stat() calls of hot urls. */
+struct path_cache_entry {
+	struct list_head list;
+	unsigned int hash;
+	time_t expires;
+	bool redirect;
+	int encodings;
+	struct stat stat;
+	char *phys;
+	char *info;
+	char key[];
+};
+
+static LIST_HEAD(uh_path_cache);
+static int uh_path_cache_entries = 0;
+
+static unsigned int uh_path_cache_hash(const char *key)
 {
-	static char path_phys[PATH_MAX];
-	static char path_info[PATH_MAX];
-	static struct path_info p;
+	unsigned int h = 5381;
 
-	char buffer[UH_LIMIT_MSGHEAD];
+	while (*key)
+		h = ((h << 5) + h) ^ (unsigned char)*key++;
+
+	return h;
+}
+
+static void uh_path_cache_free(struct path_cache_entry *e)
+{
+	list_del(&e->list);
+	free(e);
+
+	uh_path_cache_entries--;
+}
+
+static struct path_cache_entry * uh_path_cache_get(const char *key)
+{
+	struct path_cache_entry *e;
+	unsigned int hash = uh_path_cache_hash(key);
+
+	list_for_each_entry(e, &uh_path_cache, list)
+	{
+		if ((e->hash != hash) || strcmp(e->key, key))
+			continue;
+
+		if (e->expires < time(NULL))
+		{
+			uh_path_cache_free(e);
+			break;
+		}
+
+		/* most recently used entries stay at the head */
+		list_del(&e->list);
+		list_add(&e->list, &uh_path_cache);
+
+		uh_metrics_inc(path_cache_hits);
+		return e;
+	}
+
+	uh_metrics_inc(path_cache_misses);
+	return NULL;
+}
+
+static void uh_path_cache_put(const char *key, struct path_info *p)
+{
+	struct path_cache_entry *e;
+	int klen = strlen(key) + 1;
+	int plen = strlen(p->phys) + 1;
+	int ilen = p->info ? strlen(p->info) + 1 : 0;
+
+	/* drop the least recently used entry */
+	if (uh_path_cache_entries >= UH_PATHCACHE_SIZE)
+	{
+		uh_path_cache_free(list_entry(uh_path_cache.prev,
+									  struct path_cache_entry, list));
+
+		uh_metrics_inc(path_cache_evictions);
+	}
+
+	if (!(e = malloc(sizeof(*e) + klen + plen + ilen)))
+		return;
+
+	e->hash = uh_path_cache_hash(key);
+	e->expires = time(NULL) + UH_PATHCACHE_TTL;
+	e->redirect = p->redirected;
+	e->encodings = p->encodings;
+
+	memcpy(&e->stat, &p->stat, sizeof(e->stat));
+	memcpy(e->key, key, klen);
+
+	e->phys = e->key + klen;
+	memcpy(e->phys, p->phys, plen);
+
+	e->info = ilen ? e->phys + plen : NULL;
+	if (ilen)
+		memcpy(e->info, p->info, ilen);
+
+	list_add(&e->list, &uh_path_cache);
+	uh_path_cache_entries++;
+}
+
+/* precompressed variants in order of preference */
+const struct path_encoding uh_path_encodings[] = {
+	{ 1 << 0, "br",   ".br" },
+	{ 1 << 1, "gzip", ".gz" },
+	{ 0, NULL, NULL }
+};
+
+static int uh_path_sidecars(struct path_info *p, int no_sym)
+{
+	int rv = 0;
+	char path[PATH_MAX];
+	char real[PATH_MAX];
+	struct stat s;
+	const struct path_encoding *enc;
+	int rlen = strlen(p->root);
+
+	for (enc = uh_path_encodings; enc->name; enc++)
+	{
+		snprintf(path, sizeof(path), "%s%s", p->phys, enc->extn);
+
+		/* a variant must not lead out of the docroot either */
+		if (no_sym &&
+			(!uh_realpath(path, real) || strncmp(real, p->root, rlen) ||
+			 ((real[rlen] != 0) && (real[rlen] != '/'))))
+			continue;
+
+		/* outdated variants are ignored */
+		if (!stat(path, &s) && S_ISREG(s.st_mode) &&
+			(s.st_mtime >= p->stat.st_mtime))
+		{
+			rv |= enc->flag;
+		}
+	}
+
+	return rv;
+}
+
+static void uh_path_redirect(struct client *cl, struct path_info *p)
+{
+	/* if requested url resolves to a directory and a trailing slash
+	   is missing in the request url, redirect the client to the same
+	   url with trailing slash appended */
+	uh_http_sendf(cl, NULL,
+		"HTTP/1.1 302 Found\r\n"
+		"Location: %s%s%s\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: %s\r\n\r\n",
+			p->name,
+			p->query ? "?" : "",
+			p->query ? p->query : "",
+			uh_http_connection(cl)
+	);
+
+	p->redirected = 1;
+}
+
+/* Returns NULL on error.
+** NB: improperly encoded URL should give client 400 [Bad Syntax]; returning
+** NULL here causes 404 [Not Found], but that's not too unreasonable. */
+struct path_info * uh_path_lookup(struct client *cl, const char *url)
+{
+	static char path_phys[PATH_MAX];
+	static char path_info[PATH_MAX];
+	static struct path_info p;
+
+	char buffer[UH_LIMIT_MSGHEAD];
+	char key[UH_LIMIT_MSGHEAD];
 	char *docroot = cl->server->conf->docroot;
 	char *pathptr = NULL;
 
@@ -606,6 +1274,7 @@ struct path_info * uh_path_lookup(struct client *cl, const char *url)
 	int i = 0;
 	struct stat s;
 	struct index_file *idx;
+	struct path_cache_entry *e;
 
 	/* back out early if url is undefined */
 	if (url == NULL)
@@ -648,6 +1317,30 @@ struct path_info * uh_path_lookup(struct client *cl, const char *url)
 		}
 	}
 
+	/* known url, the docroot and symlink checks were done on insertion */
+	if ((e = uh_path_cache_get(buffer)) != NULL)
+	{
+		memcpy(path_phys, e->phys, strlen(e->phys) + 1);
+
+		if (e->info)
+			memcpy(path_info, e->info, strlen(e->info) + 1);
+
+		memcpy(&p.stat, &e->stat, sizeof(p.stat));
+
+		p.root = docroot;
+		p.phys = path_phys;
+		p.name = &path_phys[strlen(docroot)];
+		p.info = path_info[0] ? path_info : NULL;
+		p.encodings = e->encodings;
+
+		if (e->redirect)
+			uh_path_redirect(cl, &p);
+
+		return &p;
+	}
+
+	memcpy(key, buffer, strlen(buffer) + 1);
+
 	/* create canon path */
 	for (i = strlen(buffer), slash = (buffer[max(0, i-1)] == '/'); i >= 0; i--)
 	{
@@ -700,21 +1393,13 @@ struct path_info * uh_path_lookup(struct client *cl, const char *url)
 			memcpy(buffer, path_phys, sizeof(buffer) - 1);
 			pathptr = &buffer[strlen(buffer)];
 
-			/* if requested url resolves to a directory and a trailing slash
-			   is missing in the request url, redirect the client to the same
-			   url with trailing slash appended */
+			p.root = docroot;
+			p.phys = path_phys;
+			p.name = &path_phys[strlen(docroot)];
+
 			if (!slash)
 			{
-				uh_http_sendf(cl, NULL,
-					"HTTP/1.1 302 Found\r\n"
-					"Location: %s%s%s\r\n"
-					"Connection: close\r\n\r\n",
-						&path_phys[strlen(docroot)],
-						p.query ? "?" : "",
-						p.query ? p.query : ""
-				);
-
-				p.redirected = 1;
+				uh_path_redirect(cl, &p);
 			}
 			else
 			{
@@ -732,11 +1417,13 @@ struct path_info * uh_path_lookup(struct client *cl, const char *url)
 					*pathptr = 0;
 				}
 			}
-
-			p.root = docroot;
-			p.phys = path_phys;
-			p.name = &path_phys[strlen(docroot)];
 		}
+
+		if (p.phys && (p.stat.st_mode & S_IFREG))
+			p.encodings = uh_path_sidecars(&p, no_sym);
+
+		if (p.phys)
+			uh_path_cache_put(key, &p);
 	}
 
 	return p.phys ? &p : NULL;
@@ -745,6 +1432,36 @@ struct path_info * uh_path_lookup(struct client *cl, const char *url)
 
 static struct auth_realm *uh_realms = NULL;
 
+/* realms ordered by descending path length, so the first one covering
+ * an url is the longest match, realms of equal length in reverse order
+ * of their definition */
+static struct auth_realm **uh_realm_index = NULL;
+static int uh_realm_count = 0;
+
+static struct auth_cache_entry uh_auth_cache[UH_AUTHCACHE_SIZE];
+static struct auth_failure uh_auth_failures[UH_AUTHFAIL_SLOTS];
+
+static bool uh_auth_index(struct auth_realm *realm)
+{
+	int i;
+	struct auth_realm **new;
+
+	if (!(new = realloc(uh_realm_index,
+						(uh_realm_count + 1) * sizeof(*uh_realm_index))))
+		return false;
+
+	uh_realm_index = new;
+
+	for (i = uh_realm_count; (i > 0) &&
+	     (uh_realm_index[i - 1]->pathlen <= realm->pathlen); i--)
+		uh_realm_index[i] = uh_realm_index[i - 1];
+
+	uh_realm_index[i] = realm;
+	uh_realm_count++;
+
+	return true;
+}
+
 struct auth_realm * uh_auth_add(char *path, char *user, char *pass)
 {
 	struct auth_realm *new = NULL;
@@ -764,6 +1481,8 @@ struct auth_realm * uh_auth_add(char *path, char *user, char *pass)
 		memcpy(new->user, user,
 			   min(strlen(user), sizeof(new->user) - 1));
 
+		new->pathlen = strlen(new->path);
+
 		/* given password refers to a passwd entry */
 		if ((strlen(pass) > 3) && !strncmp(pass, "$p$", 3))
 		{
@@ -794,7 +1513,7 @@ struct auth_realm * uh_auth_add(char *path, char *user, char *pass)
 				min(strlen(pass), sizeof(new->pass) - 1));
 		}
 
-		if (new->pass[0])
+		if (new->pass[0] && uh_auth_index(new))
 		{
 			new->next = uh_realms;
 			uh_realms = new;
@@ -808,70 +1527,188 @@ struct auth_realm * uh_auth_add(char *path, char *user, char *pass)
 	return NULL;
 }
 
+static bool uh_auth_covers(struct auth_realm *realm, const char *url, int len)
+{
+	return ((len >= realm->pathlen) &&
+			!strncasecmp(url, realm->path, realm->pathlen));
+}
+
+/* digest of the given credentials keyed with random bytes drawn once,
+ * verified passwords are not kept in plain text */
+static void uh_auth_digest(const char *user, const char *pass,
+						   unsigned char *digest)
+{
+	int fd;
+	md5_ctx_t md5;
+	static bool keyed = false;
+	static unsigned char key[16];
+
+	if (!keyed)
+	{
+		if (((fd = open("/dev/urandom", O_RDONLY)) < 0) ||
+			(read(fd, key, sizeof(key)) != sizeof(key)))
+		{
+			*(pid_t *)key ^= getpid();
+			*(time_t *)(key + 8) ^= time(NULL);
+		}
+
+		if (fd > -1)
+			close(fd);
+
+		keyed = true;
+	}
+
+	md5_begin(&md5);
+	md5_hash(key, sizeof(key), &md5);
+	md5_hash(user, strlen(user) + 1, &md5);
+	md5_hash(pass, strlen(pass), &md5);
+	md5_end(digest, &md5);
+}
+
+static struct auth_cache_entry * uh_auth_cache_find(struct auth_realm *realm,
+													const char *user,
+													const unsigned char *digest)
+{
+	int i;
+	time_t now = time(NULL);
+	struct auth_cache_entry *e;
+
+	for (i = 0; i < UH_AUTHCACHE_SIZE; i++)
+	{
+		e = &uh_auth_cache[i];
+
+		if ((e->expires > now) && (e->realm == realm) &&
+			!strcmp(e->user, user) &&
+			!memcmp(e->digest, digest, sizeof(e->digest)))
+			return e;
+	}
+
+	return NULL;
+}
+
+static void uh_auth_cache_put(struct auth_realm *realm, const char *user,
+							  const unsigned char *digest)
+{
+	int i;
+	struct auth_cache_entry *e = &uh_auth_cache[0];
+
+	/* the least recently verified entry is replaced */
+	for (i = 1; i < UH_AUTHCACHE_SIZE; i++)
+		if (uh_auth_cache[i].expires < e->expires)
+			e = &uh_auth_cache[i];
+
+	e->realm = realm;
+	e->expires = time(NULL) + UH_AUTHCACHE_TTL;
+
+	memset(e->user, 0, sizeof(e->user));
+	memcpy(e->user, user, min(strlen(user), sizeof(e->user) - 1));
+	memcpy(e->digest, digest, sizeof(e->digest));
+}
+
+/* failed attempts of a peer within the window, a peer exceeding the limit
+ * is refused until the window passed without its password being tried */
+static struct auth_failure * uh_auth_failure(struct client *cl, bool add)
+{
+	int i;
+	time_t now = time(NULL);
+	struct in6_addr addr;
+	struct auth_failure *f, *old = &uh_auth_failures[0];
+
+	memset(&addr, 0, sizeof(addr));
+
+	if (cl->peeraddr.sin6_family == AF_INET)
+		memcpy(&addr, &((struct sockaddr_in *)&cl->peeraddr)->sin_addr, 4);
+	else
+		memcpy(&addr, &cl->peeraddr.sin6_addr, sizeof(addr));
+
+	for (i = 0; i < UH_AUTHFAIL_SLOTS; i++)
+	{
+		f = &uh_auth_failures[i];
+
+		if (f->count && !memcmp(&f->addr, &addr, sizeof(addr)))
+		{
+			if ((now - f->since) >= UH_AUTHFAIL_WINDOW)
+			{
+				f->count = 0;
+
+				if (!add)
+					return NULL;
+			}
+
+			if (add && !f->count++)
+				f->since = now;
+
+			return f;
+		}
+
+		if (!f->count || ((old->count > 0) && (f->since < old->since)))
+			old = f;
+	}
+
+	if (!add)
+		return NULL;
+
+	old->addr = addr;
+	old->count = 1;
+	old->since = now;
+
+	return old;
+}
+
 int uh_auth_check(struct client *cl, struct http_request *req,
 				  struct path_info *pi)
 {
-	int i, plen, rlen, protected;
+	int i, plen;
 	char buffer[UH_LIMIT_MSGHEAD];
+	char *auth;
 	char *user = NULL;
 	char *pass = NULL;
+	char *hash;
+	unsigned char digest[16];
 
 	struct auth_realm *realm = NULL;
+	struct auth_failure *fail;
 
 	plen = strlen(pi->name);
-	protected = 0;
 
-	/* check whether at least one realm covers the requested url */
-	for (realm = uh_realms; realm; realm = realm->next)
+	/* find the longest realm covering the requested url */
+	for (i = 0; i < uh_realm_count; i++)
 	{
-		rlen = strlen(realm->path);
-
-		if ((plen >= rlen) && !strncasecmp(pi->name, realm->path, rlen))
+		if (uh_auth_covers(uh_realm_index[i], pi->name, plen))
 		{
-			req->realm = realm;
-			protected = 1;
+			req->realm = uh_realm_index[i];
 			break;
 		}
 	}
 
 	/* requested resource is covered by a realm */
-	if (protected)
+	if (i < uh_realm_count)
 	{
 		/* try to get client auth info */
-		foreach_header(i, req->headers)
+		if ((auth = req->fields[UH_HTTP_HDR_AUTHORIZATION]) &&
+			(strlen(auth) > 6) && !strncasecmp(auth, "Basic ", 6))
 		{
-			if (!strcasecmp(req->headers[i], "Authorization") &&
-				(strlen(req->headers[i+1]) > 6) &&
-				!strncasecmp(req->headers[i+1], "Basic ", 6))
-			{
-				memset(buffer, 0, sizeof(buffer));
-				uh_b64decode(buffer, sizeof(buffer) - 1,
-					(unsigned char *) &req->headers[i+1][6],
-					strlen(req->headers[i+1]) - 6);
-
-				if ((pass = strchr(buffer, ':')) != NULL)
-				{
-					user = buffer;
-					*pass++ = 0;
-				}
+			memset(buffer, 0, sizeof(buffer));
+			uh_b64decode(buffer, sizeof(buffer) - 1,
+				(unsigned char *) &auth[6], strlen(auth) - 6);
 
-				break;
+			if ((pass = strchr(buffer, ':')) != NULL)
+			{
+				user = buffer;
+				*pass++ = 0;
 			}
 		}
 
 		/* have client auth */
 		if (user && pass)
 		{
-			/* find matching realm */
-			for (realm = uh_realms; realm; realm = realm->next)
+			/* find matching realm, the longest first */
+			for (; i < uh_realm_count; i++)
 			{
-				rlen = strlen(realm->path);
-
-				if ((plen >= rlen) &&
-					!strncasecmp(pi->name, realm->path, rlen) &&
-					!strcmp(user, realm->user))
+				if (uh_auth_covers(uh_realm_index[i], pi->name, plen) &&
+					!strcmp(user, uh_realm_index[i]->user))
 				{
-					req->realm = realm;
+					realm = req->realm = uh_realm_index[i];
 					break;
 				}
 			}
@@ -879,10 +1716,30 @@ int uh_auth_check(struct client *cl, struct http_request *req,
 			/* found a realm matching the username */
 			if (realm)
 			{
-				/* check user pass */
-				if (!strcmp(pass, realm->pass) ||
-				    !strcmp(crypt(pass, realm->pass), realm->pass))
+				uh_auth_digest(user, pass, digest);
+
+				/* verified recently */
+				if (uh_auth_cache_find(realm, user, digest))
 					return 1;
+
+				fail = uh_auth_failure(cl, false);
+
+				/* check user pass unless the peer is rate limited */
+				if (!fail || (fail->count < UH_AUTHFAIL_LIMIT))
+				{
+					if (!strcmp(pass, realm->pass) ||
+					    (((hash = crypt(pass, realm->pass)) != NULL) &&
+					     !strcmp(hash, realm->pass)))
+					{
+						if (fail)
+							fail->count = 0;
+
+						uh_auth_cache_put(realm, user, digest);
+						return 1;
+					}
+
+					uh_auth_failure(cl, true);
+				}
 			}
 		}
 
@@ -890,11 +1747,13 @@ int uh_auth_check(struct client *cl, struct http_request *req,
 		uh_http_sendf(cl, NULL,
 		              "%s 401 Authorization Required\r\n"
 		              "WWW-Authenticate: Basic realm=\"%s\"\r\n"
+		              "Connection: %s\r\n"
 		              "Content-Type: text/plain\r\n"
 		              "Content-Length: 23\r\n\r\n"
 		              "Authorization Required\n",
 		              http_versions[req->version],
-		              cl->server->conf->realm);
+		              cl->server->conf->realm,
+		              uh_http_connection(cl));
 
 		return 0;
 	}
@@ -903,8 +1762,96 @@ int uh_auth_check(struct client *cl, struct http_request *req,
 }
 
 
-static struct listener *uh_listeners = NULL;
-static struct client *uh_clients = NULL;
+struct listener *uh_listeners = NULL;
+static LIST_HEAD(uh_clients);
+
+/* preallocated client objects and header buffers, the spare lists are
+ * refilled on removal, demand beyond the pool falls back to malloc() */
+static struct client *uh_client_slab = NULL;
+static int uh_client_slab_size = 0;
+static LIST_HEAD(uh_client_spare);
+
+static char *uh_client_bufs = NULL;
+static int uh_client_nbufs = 0;
+
+/* clients indexed by their socket descriptor */
+static struct client **uh_client_fds = NULL;
+static int uh_client_nfds = 0;
+
+void uh_client_pool_init(int count)
+{
+	int i;
+
+	if (!(uh_client_slab = calloc(count, sizeof(*uh_client_slab))))
+		return;
+
+	uh_client_slab_size = count;
+
+	for (i = 0; i < count; i++)
+		list_add_tail(&uh_client_slab[i].list, &uh_client_spare);
+}
+
+static bool uh_client_fd_set(int fd, struct client *cl)
+{
+	int n = uh_client_nfds ? uh_client_nfds : 64;
+	struct client **fds;
+
+	if (fd >= uh_client_nfds)
+	{
+		while (n <= fd)
+			n *= 2;
+
+		if (!(fds = realloc(uh_client_fds, n * sizeof(*fds))))
+			return false;
+
+		memset(fds + uh_client_nfds, 0, (n - uh_client_nfds) * sizeof(*fds));
+
+		uh_client_fds = fds;
+		uh_client_nfds = n;
+	}
+
+	uh_client_fds[fd] = cl;
+	return true;
+}
+
+char * uh_client_buffer(struct client *cl)
+{
+	if (uh_client_bufs)
+	{
+		cl->httpbuf.buf = uh_client_bufs;
+		uh_client_bufs = *(char **)uh_client_bufs;
+		uh_client_nbufs--;
+	}
+	else
+	{
+		cl->httpbuf.buf = malloc(UH_LIMIT_MSGHEAD);
+	}
+
+	cl->httpbuf.ptr = cl->httpbuf.buf;
+	return cl->httpbuf.buf;
+}
+
+static void uh_client_buffer_free(struct client *cl)
+{
+	char *buf = cl->httpbuf.buf;
+
+	if (!buf)
+		return;
+
+	/* keep as many spare buffers as there are pooled clients */
+	if (uh_client_nbufs < uh_client_slab_size)
+	{
+		*(char **)buf = uh_client_bufs;
+		uh_client_bufs = buf;
+		uh_client_nbufs++;
+	}
+	else
+	{
+		free(buf);
+	}
+
+	cl->httpbuf.buf = cl->httpbuf.ptr = NULL;
+}
 
 struct listener * uh_listener_add(int sock, struct config *conf)
 {
@@ -945,13 +1892,37 @@ struct listener * uh_listener_lookup(int sock)
 }
 
 
+static void uh_client_release(struct client *cl)
+{
+	if ((cl >= uh_client_slab) && (cl < uh_client_slab + uh_client_slab_size))
+		list_add(&cl->list, &uh_client_spare);
+	else
+		free(cl);
+}
+
 struct client * uh_client_add(int sock, struct listener *serv,
                               struct sockaddr_in6 *peer)
 {
 	struct client *new = NULL;
 	socklen_t sl;
 
-	if ((new = (struct client *)malloc(sizeof(struct client))) != NULL)
+	if (!list_empty(&uh_client_spare))
+	{
+		new = list_first_entry(&uh_client_spare, struct client, list);
+		list_del(&new->list);
+	}
+	else
+	{
+		new = malloc(sizeof(struct client));
+	}
+
+	if (new && !uh_client_fd_set(sock, new))
+	{
+		uh_client_release(new);
+		new = NULL;
+	}
+
+	if (new != NULL)
 	{
 		memset(new, 0, sizeof(struct client));
 		memcpy(&new->peeraddr, peer, sizeof(new->peeraddr));
@@ -966,10 +1937,10 @@ struct client * uh_client_add(int sock, struct listener *serv,
 		sl = sizeof(struct sockaddr_in6);
 		getsockname(sock, (struct sockaddr *) &(new->servaddr), &sl);
 
-		new->next = uh_clients;
-		uh_clients = new;
+		list_add(&new->list, &uh_clients);
 
 		serv->n_clients++;
+		uh_metrics_inc(clients);
 
 		D("IO: Client(%d) allocated\n", new->fd.fd);
 	}
@@ -979,16 +1950,83 @@ struct client * uh_client_add(int sock, struct listener *serv,
 
 struct client * uh_client_lookup(int sock)
 {
+	if ((sock < 0) || (sock >= uh_client_nfds))
+		return NULL;
+
+	return uh_client_fds[sock];
+}
+
+int uh_client_count(struct sockaddr_in6 *peer)
+{
+	int n = 0;
 	struct client *cur = NULL;
 
-	for (cur = uh_clients; cur; cur = cur->next)
-		if (cur->fd.fd == sock)
-			return cur;
+	list_for_each_entry(cur, &uh_clients, list)
+		if (sa_same_host(&cur->peeraddr, peer))
+			n++;
 
-	return NULL;
+	return n;
 }
 
-void uh_client_shutdown(struct client *cl)
+int uh_client_reap(struct listener *serv, struct sockaddr_in6 *peer)
+{
+	struct client *cur = NULL;
+
+	/* persistent connections waiting for their next request have the idle
+	 * timer running and no data buffered, the least recently added one
+	 * is at the end of the list, with a peer given only connections of
+	 * that address are considered regardless of the listener */
+	struct client *idle = NULL;
+
+	list_for_each_entry(cur, &uh_clients, list)
+		if ((peer ? sa_same_host(&cur->peeraddr, peer)
+		          : (cur->server == serv)) &&
+			(cur->requests > 0) && !cur->dispatched && cur->timeout.pending && !cur->httpbuf.len &&
+			!cur->outbuf.closing)
+			idle = cur;
+
+	if (idle)
+	{
+		D("IO: Client(%d) idle, closing to accept new connection\n",
+		  idle->fd.fd);
+
+		uh_client_shutdown(idle);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void uh_client_cleanup(struct client *cl)
+{
+	if (cl->timeout.pending)
+		uloop_timeout_cancel(&cl->timeout);
+
+	if (cl->proc.pid)
+		uloop_process_delete(&cl->proc);
+
+	if (cl->cleanup)
+		cl->cleanup(cl);
+
+#ifdef HAVE_ZLIB
+	uh_deflate_free(cl);
+#endif
+
+	uh_ufd_remove(&cl->rpipe);
+	uh_ufd_remove(&cl->wpipe);
+
+	memset(&cl->proc, 0, sizeof(cl->proc));
+
+	cl->cb = NULL;
+	cl->cleanup = NULL;
+	cl->priv = NULL;
+	cl->paused = false;
+	cl->stalled = false;
+	cl->outbuf.wait = false;
+	cl->outbuf.cork = 0;
+}
+
+static void uh_client_close(struct client *cl)
 {
 #ifdef HAVE_TLS
 	/* free client tls context */
@@ -1000,38 +2038,138 @@ void uh_client_shutdown(struct client *cl)
 	uh_client_remove(cl);
 }
 
-void uh_client_remove(struct client *cl)
+static void uh_linger_cb(struct uloop_timeout *t)
 {
-	struct client *cur = NULL;
-	struct client *prv = NULL;
+	struct client *cl = container_of(t, struct client, timeout);
+
+	D("IO: Client(%d) output not flushed in time, dropping %d bytes\n",
+	  cl->fd.fd, cl->outbuf.len);
+
+	uh_client_close(cl);
+}
+
+bool uh_client_flush(struct client *cl)
+{
+	cl->outbuf.wait = false;
 
-	for (cur = uh_clients; cur; prv = cur, cur = cur->next)
+	if (uh_outbuf_flush(cl, false) < 0)
 	{
-		if (cur == cl)
-		{
-			if (prv)
-				prv->next = cur->next;
-			else
-				uh_clients = cur->next;
+		D("IO: Client(%d) dropping %d queued bytes\n",
+		  cl->fd.fd, cl->outbuf.len);
+
+		uh_client_close(cl);
+		return false;
+	}
+
+	/* deferred shutdown, the response is out now */
+	if (cl->outbuf.closing && !cl->outbuf.len)
+	{
+		uh_client_close(cl);
+		return false;
+	}
+
+	uh_client_poll(cl);
+	return true;
+}
+
+void uh_client_yield(struct client *cl)
+{
+	/* resume the response handler on the next writable event */
+	cl->outbuf.wait = true;
+	uh_client_poll(cl);
+}
 
-			if (cur->timeout.pending)
-				uloop_timeout_cancel(&cur->timeout);
+void uh_client_stall(struct client *cl, bool stall)
+{
+	/* stop reading while the consumer of the request body is backed up */
+	cl->stalled = stall;
+	uh_client_poll(cl);
+}
 
-			if (cur->proc.pid)
-				uloop_process_delete(&cur->proc);
+void uh_client_shutdown(struct client *cl)
+{
+	/* output is still queued, stop the request processing and close the
+	 * connection once everything has been written */
+	if (cl->outbuf.len > 0)
+	{
+		D("IO: Client(%d) lingering to flush %d bytes\n",
+		  cl->fd.fd, cl->outbuf.len);
 
-			D("IO: Client(%d) freeing\n", cur->fd.fd);
+		uh_client_cleanup(cl);
 
-			uh_ufd_remove(&cur->rpipe);
-			uh_ufd_remove(&cur->wpipe);
-			uh_ufd_remove(&cur->fd);
+		cl->dispatched = false;
+		cl->keepalive = false;
+		cl->outbuf.closing = true;
 
-			cur->server->n_clients--;
+		cl->timeout.cb = uh_linger_cb;
+		uloop_timeout_set(&cl->timeout,
+						  cl->server->conf->network_timeout * 1000);
 
-			free(cur);
-			break;
-		}
+		uh_client_poll(cl);
+		return;
 	}
+
+	uh_client_close(cl);
+}
+
+void uh_client_reset(struct client *cl)
+{
+	D("IO: Client(%d) resetting for request #%d\n",
+	  cl->fd.fd, cl->requests + 1);
+
+	uh_client_cleanup(cl);
+
+	memset(&cl->request, 0, sizeof(cl->request));
+	memset(&cl->response, 0, sizeof(cl->response));
+
+	cl->dispatched = false;
+	cl->keepalive = false;
+	cl->metrics.start = 0;
+	cl->requests++;
+
+	/* move pipelined data of the next request to the buffer start,
+	 * otherwise give the buffer back while waiting for the next request */
+	if (cl->httpbuf.len > 0)
+	{
+		memmove(cl->httpbuf.buf, cl->httpbuf.ptr, cl->httpbuf.len);
+		cl->httpbuf.ptr = cl->httpbuf.buf;
+	}
+	else
+	{
+		cl->httpbuf.len = 0;
+		uh_client_buffer_free(cl);
+	}
+
+	cl->httpbuf.scan = 0;
+	cl->httpbuf.hdrcount = 0;
+}
+
+void uh_client_remove(struct client *cl)
+{
+	D("IO: Client(%d) freeing\n", cl->fd.fd);
+
+	list_del(&cl->list);
+	uh_client_fds[cl->fd.fd] = NULL;
+
+	uh_client_cleanup(cl);
+	uh_ufd_remove(&cl->fd);
+
+	cl->server->n_clients--;
+	uh_metrics->clients--;
+
+	/* resume accepting on a listener paused at capacity */
+	if (cl->server->paused &&
+		(cl->server->n_clients < cl->server->conf->max_requests))
+	{
+		D("IO: Server(%d) resuming\n", cl->server->fd.fd);
+
+		cl->server->paused = false;
+		uloop_fd_add(&cl->server->fd, ULOOP_READ);
+	}
+
+	uh_client_buffer_free(cl);
+	free(cl->outbuf.buf);
+	uh_client_release(cl);
 }
 
 
@@ -1077,6 +2215,13 @@ struct interpreter * uh_interpreter_add(const char *extn, const char *path)
 		memcpy(new->extn, extn, min(strlen(extn), sizeof(new->extn)-1));
 		memcpy(new->path, path, min(strlen(path), sizeof(new->path)-1));
 
+		/* "fcgi:" selects a persistent FastCGI application */
+		if (!strncmp(path, "fcgi:", 5) && !(new->fcgi = uh_fcgi_add(NULL, path + 5)))
+		{
+			free(new);
+			return NULL;
+		}
+
 		new->next = uh_interpreters;
 		uh_interpreters = new;
 
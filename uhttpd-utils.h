@@ -17,13 +17,21 @@
  */
 
 #ifndef _UHTTPD_UTILS_
+#define _UHTTPD_UTILS_
 
 #include <stdarg.h>
 #include <fcntl.h>
 #include <pwd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+
+#ifndef __APPLE__
+#include <sys/sendfile.h>
+#endif
 
 #include <libubox/uloop.h>
+#include <libubox/md5.h>
 
 #ifdef __APPLE__
 static inline void clearenv(void)
@@ -59,6 +67,19 @@ static inline void clearenv(void)
 	do { if((x) < 0) return -1; } while(0)
 
 
+struct auth_cache_entry {
+	struct auth_realm *realm;
+	char user[32];
+	unsigned char digest[16];
+	time_t expires;
+};
+
+struct auth_failure {
+	struct in6_addr addr;
+	int count;
+	time_t since;
+};
+
 struct path_info {
 	char *root;
 	char *phys;
@@ -66,14 +87,24 @@ struct path_info {
 	char *info;
 	char *query;
 	int redirected;
+	int encodings;
 	struct stat stat;
 };
 
+struct path_encoding {
+	int flag;
+	const char *name;
+	const char *extn;
+};
+
+extern const struct path_encoding uh_path_encodings[];
+
 
 const char * sa_straddr(void *sa);
 const char * sa_strport(void *sa);
 int sa_port(void *sa);
 int sa_rfc1918(void *sa);
+int sa_same_host(void *a, void *b);
 
 char *strfind(char *haystack, int hslen, const char *needle, int ndlen);
 
@@ -82,16 +113,39 @@ bool uh_socket_wait(int fd, int sec, bool write);
 int uh_raw_send(int fd, const char *buf, int len, int seconds);
 int uh_raw_recv(int fd, char *buf, int len, int seconds);
 int uh_tcp_send(struct client *cl, const char *buf, int len);
+int uh_tcp_sendv(struct client *cl, struct iovec *iov, int iovcnt);
+void uh_tcp_cork(struct client *cl);
+int uh_tcp_uncork(struct client *cl, bool more);
 int uh_tcp_send_lowlevel(struct client *cl, const char *buf, int len);
+#ifndef __APPLE__
+int uh_tcp_sendfile(struct client *cl, int fd, off_t *offset, int len);
+#endif
+#ifdef HAVE_SPLICE
+int uh_tcp_splice(struct client *cl, int len);
+int uh_tcp_splice_in(struct client *cl, int len);
+#endif
 int uh_tcp_recv(struct client *cl, char *buf, int len);
 int uh_tcp_recv_lowlevel(struct client *cl, char *buf, int len);
 
+/* pipes of plain connections can be relayed within the kernel */
+#if defined(HAVE_SPLICE) && defined(HAVE_TLS)
+#define uh_tcp_can_splice(cl) (!(cl)->tls)
+#elif defined(HAVE_SPLICE)
+#define uh_tcp_can_splice(cl) true
+#else
+#define uh_tcp_can_splice(cl) false
+#endif
+
+#define uh_http_connection(cl) \
+	((cl)->keepalive ? "keep-alive" : "close")
+
 int uh_http_sendhf(struct client *cl, int code, const char *summary,
 				   const char *fmt, ...);
 
 #define uh_http_response(cl, code, message) \
 	uh_http_sendhf(cl, code, message, message)
 
+int uh_http_chunk(struct client *cl, const char *data, int len);
 int uh_http_sendc(struct client *cl, const char *data, int len);
 
 int uh_http_sendf(
@@ -104,6 +158,8 @@ int uh_http_send(
 	const char *buf, int len
 );
 
+bool uh_accept_encoding(const char *hdr, const char *name);
+
 
 int uh_urldecode(char *buf, int blen, const char *src, int slen);
 int uh_urlencode(char *buf, int blen, const char *src, int slen);
@@ -125,20 +181,35 @@ struct index_file * uh_index_add(const char *filename);
 
 struct path_info * uh_path_lookup(struct client *cl, const char *url);
 
+extern struct listener *uh_listeners;
 struct listener * uh_listener_add(int sock, struct config *conf);
 struct listener * uh_listener_lookup(int sock);
 
+void uh_client_pool_init(int count);
+char * uh_client_buffer(struct client *cl);
+
 struct client * uh_client_add(int sock, struct listener *serv,
                               struct sockaddr_in6 *peer);
 
 struct client * uh_client_lookup(int sock);
 
+int uh_client_count(struct sockaddr_in6 *peer);
+int uh_client_reap(struct listener *serv, struct sockaddr_in6 *peer);
+
+#define uh_client_congested(cl) \
+	((cl)->outbuf.len >= UH_LIMIT_OUTBUF)
+
+bool uh_client_flush(struct client *cl);
+void uh_client_yield(struct client *cl);
+void uh_client_stall(struct client *cl, bool stall);
+
 #define uh_client_error(cl, code, status, ...) do { \
 	uh_http_sendhf(cl, code, status, __VA_ARGS__);  \
 	uh_client_shutdown(cl);                         \
 } while(0)
 
 void uh_client_shutdown(struct client *cl);
+void uh_client_reset(struct client *cl);
 void uh_client_remove(struct client *cl);
 
 void uh_ufd_add(struct uloop_fd *u, uloop_fd_handler h, unsigned int ev);
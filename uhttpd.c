@@ -16,12 +16,16 @@
  *  limitations under the License.
  */
 
+#define _GNU_SOURCE /* accept4() */
+
 #include "uhttpd.h"
 #include "uhttpd-utils.h"
 #include "uhttpd-file.h"
+#include "uhttpd-metrics.h"
 
 #ifdef HAVE_CGI
 #include "uhttpd-cgi.h"
+#include "uhttpd-fcgi.h"
 #endif
 
 #ifdef HAVE_LUA
@@ -32,10 +36,42 @@
 #include "uhttpd-tls.h"
 #endif
 
+#ifdef HAVE_ZLIB
+#include "uhttpd-deflate.h"
+#endif
+
 
 const char * http_methods[] = { "GET", "POST", "HEAD", };
 const char * http_versions[] = { "HTTP/0.9", "HTTP/1.0", "HTTP/1.1", };
 
+#define H(name) { name, sizeof(name) - 1 }
+static const struct {
+	const char *name;
+	int len;
+} http_fields[__UH_HTTP_HDR_MAX] = {
+	[UH_HTTP_HDR_HOST]                = H("Host"),
+	[UH_HTTP_HDR_CONTENT_LENGTH]      = H("Content-Length"),
+	[UH_HTTP_HDR_CONTENT_TYPE]        = H("Content-Type"),
+	[UH_HTTP_HDR_AUTHORIZATION]       = H("Authorization"),
+	[UH_HTTP_HDR_IF_MATCH]            = H("If-Match"),
+	[UH_HTTP_HDR_IF_MODIFIED_SINCE]   = H("If-Modified-Since"),
+	[UH_HTTP_HDR_IF_NONE_MATCH]       = H("If-None-Match"),
+	[UH_HTTP_HDR_IF_RANGE]            = H("If-Range"),
+	[UH_HTTP_HDR_IF_UNMODIFIED_SINCE] = H("If-Unmodified-Since"),
+	[UH_HTTP_HDR_RANGE]               = H("Range"),
+	[UH_HTTP_HDR_ACCEPT_ENCODING]     = H("Accept-Encoding"),
+	[UH_HTTP_HDR_CONNECTION]          = H("Connection"),
+	[UH_HTTP_HDR_EXPECT]              = H("Expect"),
+	[UH_HTTP_HDR_COOKIE]              = H("Cookie"),
+	[UH_HTTP_HDR_ACCEPT]              = H("Accept"),
+	[UH_HTTP_HDR_ACCEPT_CHARSET]      = H("Accept-Charset"),
+	[UH_HTTP_HDR_ACCEPT_LANGUAGE]     = H("Accept-Language"),
+	[UH_HTTP_HDR_REFERER]             = H("Referer"),
+	[UH_HTTP_HDR_USER_AGENT]          = H("User-Agent"),
+	[UH_HTTP_HDR_TRANSFER_ENCODING]   = H("Transfer-Encoding"),
+};
+#undef H
+
 static int run = 1;
 
 static void uh_sigterm(int sig)
@@ -103,6 +139,23 @@ static void uh_config_parse(struct config *conf)
 
 				conf->error_handler = strdup(col1);
 			}
+			else if (!strncmp(line, "M:", 2))
+			{
+				if (!(col1 = strchr(line, ':')) || (*col1++ = 0) ||
+				    !(col2 = strchr(col1, ':')) || (*col2++ = 0) ||
+				    !(eol = strchr(col2, '\n')) || (*eol++  = 0))
+				{
+					continue;
+				}
+
+				if (!uh_file_mime_add(col1, col2))
+				{
+					fprintf(stderr,
+					        "Unable to add mime type %s for extension %s: "
+					        "Out of memory\n", col2, col1
+					);
+				}
+			}
 #ifdef HAVE_CGI
 			else if ((line[0] == '*') && (strchr(line, ':') != NULL))
 			{
@@ -130,19 +183,120 @@ static void uh_config_parse(struct config *conf)
 
 static void uh_listener_cb(struct uloop_fd *u, unsigned int events);
 
+/* apply the listening socket options shared by all bound addresses */
+static int uh_socket_setup(int sock, int family, struct config *conf)
+{
+	int yes = 1;
+
+#ifdef linux
+	int tcp_ka_idl, tcp_ka_int, tcp_ka_cnt;
+#endif
+
+	/* "address already in use" */
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)))
+	{
+		perror("setsockopt()");
+		return -1;
+	}
+
+#ifdef SO_REUSEPORT
+	/* let the kernel balance connections across the worker sockets */
+	if ((conf->workers > 1) &&
+		setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)))
+	{
+		perror("setsockopt()");
+		return -1;
+	}
+#endif
+
+	/* responses are already coalesced by uh_tcp_cork() and MSG_MORE, the
+	 * last partial segment or tls record of one must not wait for the
+	 * delayed ack of the previous one; inherited by accepted sockets */
+	if (setsockopt(sock, SOL_TCP, TCP_NODELAY, &yes, sizeof(yes)))
+	{
+		perror("setsockopt()");
+		return -1;
+	}
+
+	/* TCP keep-alive */
+	if (conf->tcp_keepalive > 0)
+	{
+#ifdef linux
+		tcp_ka_idl = 1;
+		tcp_ka_cnt = 3;
+		tcp_ka_int = conf->tcp_keepalive;
+#endif
+
+		if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes))
+#ifdef linux
+		    || setsockopt(sock, SOL_TCP, TCP_KEEPIDLE,  &tcp_ka_idl, sizeof(tcp_ka_idl))
+		    || setsockopt(sock, SOL_TCP, TCP_KEEPINTVL, &tcp_ka_int, sizeof(tcp_ka_int))
+		    || setsockopt(sock, SOL_TCP, TCP_KEEPCNT,   &tcp_ka_cnt, sizeof(tcp_ka_cnt))
+#endif
+			)
+		{
+		    fprintf(stderr, "Notice: Unable to enable TCP keep-alive: %s\n",
+		    	strerror(errno));
+		}
+	}
+
+	/* required to get parallel v4 + v6 working */
+	if (family == AF_INET6)
+	{
+		if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes)) == -1)
+		{
+			perror("setsockopt()");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* start listening and apply the accept queue tuning */
+static int uh_socket_listen(int sock, struct config *conf)
+{
+	int backlog = (conf->tcp_backlog > 0) ? conf->tcp_backlog
+	                                      : UH_LIMIT_CLIENTS;
+
+	if (listen(sock, backlog) == -1)
+	{
+		perror("listen()");
+		return -1;
+	}
+
+#ifdef TCP_DEFER_ACCEPT
+	/* only wake up once the first request data arrived */
+	if ((conf->tcp_defer_accept > 0) &&
+		setsockopt(sock, SOL_TCP, TCP_DEFER_ACCEPT,
+				   &conf->tcp_defer_accept, sizeof(conf->tcp_defer_accept)))
+	{
+		fprintf(stderr, "Notice: Unable to enable deferred accept: %s\n",
+			strerror(errno));
+	}
+#endif
+
+#ifdef TCP_FASTOPEN
+	if ((conf->tcp_fastopen > 0) &&
+		setsockopt(sock, SOL_TCP, TCP_FASTOPEN,
+				   &conf->tcp_fastopen, sizeof(conf->tcp_fastopen)))
+	{
+		fprintf(stderr, "Notice: Unable to enable TCP fast open: %s\n",
+			strerror(errno));
+	}
+#endif
+
+	return 0;
+}
+
 static int uh_socket_bind(const char *host, const char *port,
                           struct addrinfo *hints, int do_tls,
                           struct config *conf)
 {
 	int sock = -1;
-	int yes = 1;
 	int status;
 	int bound = 0;
 
-#ifdef linux
-	int tcp_ka_idl, tcp_ka_int, tcp_ka_cnt;
-#endif
-
 	struct listener *l = NULL;
 	struct addrinfo *addrs = NULL, *p = NULL;
 
@@ -161,44 +315,8 @@ static int uh_socket_bind(const char *host, const char *port,
 			goto error;
 		}
 
-		/* "address already in use" */
-		if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)))
-		{
-			perror("setsockopt()");
+		if (uh_socket_setup(sock, p->ai_family, conf))
 			goto error;
-		}
-
-		/* TCP keep-alive */
-		if (conf->tcp_keepalive > 0)
-		{
-#ifdef linux
-			tcp_ka_idl = 1;
-			tcp_ka_cnt = 3;
-			tcp_ka_int = conf->tcp_keepalive;
-#endif
-
-			if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes))
-#ifdef linux
-			    || setsockopt(sock, SOL_TCP, TCP_KEEPIDLE,  &tcp_ka_idl, sizeof(tcp_ka_idl))
-			    || setsockopt(sock, SOL_TCP, TCP_KEEPINTVL, &tcp_ka_int, sizeof(tcp_ka_int))
-			    || setsockopt(sock, SOL_TCP, TCP_KEEPCNT,   &tcp_ka_cnt, sizeof(tcp_ka_cnt))
-#endif
-				)
-			{
-			    fprintf(stderr, "Notice: Unable to enable TCP keep-alive: %s\n",
-			    	strerror(errno));
-			}
-		}
-
-		/* required to get parallel v4 + v6 working */
-		if (p->ai_family == AF_INET6)
-		{
-			if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(yes)) == -1)
-			{
-				perror("setsockopt()");
-				goto error;
-			}
-		}
 
 		/* bind */
 		if (bind(sock, p->ai_addr, p->ai_addrlen) == -1)
@@ -208,11 +326,8 @@ static int uh_socket_bind(const char *host, const char *port,
 		}
 
 		/* listen */
-		if (listen(sock, UH_LIMIT_CLIENTS) == -1)
-		{
-			perror("listen()");
+		if (uh_socket_listen(sock, conf))
 			goto error;
-		}
 
 		/* add listener to global list */
 		if (!(l = uh_listener_add(sock, conf)))
@@ -243,203 +358,303 @@ static int uh_socket_bind(const char *host, const char *port,
 	return bound;
 }
 
-static struct http_request * uh_http_header_parse(struct client *cl,
-												  char *buffer, int buflen)
+static bool uh_http_header_check_method(const char *buf, int len)
 {
-	char *method  = buffer;
-	char *path    = NULL;
-	char *version = NULL;
+	int i, n;
+
+	/* a partially received method only has to be a prefix of a known one,
+	 * a complete one must be followed by the separating space */
+	for (i = 0; i < sizeof(http_methods)/sizeof(http_methods[0]); i++)
+	{
+		n = strlen(http_methods[i]);
 
-	char *headers = NULL;
-	char *hdrname = NULL;
-	char *hdrdata = NULL;
+		if (!strncmp(buf, http_methods[i], min(len, n)) &&
+			((len <= n) || (buf[n] == ' ')))
+			return true;
+	}
 
-	int i;
-	int hdrcount = 0;
+	return false;
+}
 
+/* Parse the request line, returns false after sending an error response */
+static bool uh_http_header_request(struct client *cl, char *line, int len)
+{
+	char *path, *version;
 	struct http_request *req = &cl->request;
 
+	line[len] = 0;
+
+	/* find request path */
+	if ((path = memchr(line, ' ', len)) != NULL)
+		*path++ = 0;
+
+	/* find http version */
+	if ((path != NULL) && ((version = strchr(path, ' ')) != NULL))
+		*version++ = 0;
+	else
+		version = NULL;
+
+	/* check method */
+	if (!strcmp(line, "GET"))
+		req->method = UH_HTTP_MSG_GET;
+	else if (!strcmp(line, "POST"))
+		req->method = UH_HTTP_MSG_POST;
+	else if (!strcmp(line, "HEAD"))
+		req->method = UH_HTTP_MSG_HEAD;
+	else
+	{
+		/* invalid method */
+		uh_http_response(cl, 405, "Method Not Allowed");
+		return false;
+	}
 
-	/* terminate initial header line */
-	if ((headers = strfind(buffer, buflen, "\r\n", 2)) != NULL)
+	/* check path */
+	if (!path || !*path)
 	{
-		buffer[buflen-1] = 0;
+		/* malformed request */
+		uh_http_response(cl, 400, "Bad Request");
+		return false;
+	}
 
-		*headers++ = 0;
-		*headers++ = 0;
+	req->url = path;
 
-		/* find request path */
-		if ((path = strchr(buffer, ' ')) != NULL)
-			*path++ = 0;
+	/* check version */
+	if (version && !strcmp(version, "HTTP/0.9"))
+		req->version = UH_HTTP_VER_0_9;
+	else if (version && !strcmp(version, "HTTP/1.0"))
+		req->version = UH_HTTP_VER_1_0;
+	else if (version && !strcmp(version, "HTTP/1.1"))
+		req->version = UH_HTTP_VER_1_1;
+	else
+	{
+		/* unsupported version */
+		uh_http_response(cl, 400, "Bad Request");
+		return false;
+	}
 
-		/* find http version */
-		if ((path != NULL) && ((version = strchr(path, ' ')) != NULL))
-			*version++ = 0;
+	D("SRV: %s %s %s\n",
+	  http_methods[req->method], req->url, http_versions[req->version]);
 
+	return true;
+}
 
-		/* check method */
-		if (method && !strcmp(method, "GET"))
-			req->method = UH_HTTP_MSG_GET;
-		else if (method && !strcmp(method, "POST"))
-			req->method = UH_HTTP_MSG_POST;
-		else if (method && !strcmp(method, "HEAD"))
-			req->method = UH_HTTP_MSG_HEAD;
-		else
-		{
-			/* invalid method */
-			uh_http_response(cl, 405, "Method Not Allowed");
-			return NULL;
-		}
+/* Remember well-known headers by index and parse the content length once,
+ * returns false after sending an error response */
+static bool uh_http_header_classify(struct client *cl, char *name, int len,
+									char *data)
+{
+	int i;
+	long n;
+	char *end;
+	struct http_request *req = &cl->request;
 
-		/* check path */
-		if (!path || !strlen(path))
-		{
-			/* malformed request */
-			uh_http_response(cl, 400, "Bad Request");
-			return NULL;
-		}
-		else
-		{
-			req->url = path;
-		}
+	for (i = 0; i < __UH_HTTP_HDR_MAX; i++)
+		if ((http_fields[i].len == len) &&
+			!strncasecmp(http_fields[i].name, name, len))
+			break;
 
-		/* check version */
-		if (version && !strcmp(version, "HTTP/0.9"))
-			req->version = UH_HTTP_VER_0_9;
-		else if (version && !strcmp(version, "HTTP/1.0"))
-			req->version = UH_HTTP_VER_1_0;
-		else if (version && !strcmp(version, "HTTP/1.1"))
-			req->version = UH_HTTP_VER_1_1;
-		else
+	if (i == __UH_HTTP_HDR_MAX)
+		return true;
+
+	if (i == UH_HTTP_HDR_CONTENT_LENGTH)
+	{
+		n = strtol(data, &end, 10);
+
+		/* a malformed or conflicting length would desync the stream */
+		if ((end == data) || *end || (n < 0) || (n > INT_MAX) ||
+			(req->fields[i] && (n != req->content_length)))
 		{
-			/* unsupported version */
 			uh_http_response(cl, 400, "Bad Request");
-			return NULL;
+			return false;
 		}
 
-		D("SRV: %s %s %s\n",
-		  http_methods[req->method], req->url, http_versions[req->version]);
+		/* any method may carry a body, it frames the request even if
+		 * the handler ignores it */
+		req->content_length = n;
+	}
 
-		/* process header fields */
-		for (i = (int)(headers - buffer); i < buflen; i++)
-		{
-			/* found eol and have name + value, push out header tuple */
-			if (hdrname && hdrdata && (buffer[i] == '\r' || buffer[i] == '\n'))
-			{
-				buffer[i] = 0;
+	/* the first occurence wins */
+	if (!req->fields[i])
+		req->fields[i] = data;
 
-				/* store */
-				if ((hdrcount + 1) < array_size(req->headers))
-				{
-					D("SRV: HTTP: %s: %s\n", hdrname, hdrdata);
+	return true;
+}
 
-					req->headers[hdrcount++] = hdrname;
-					req->headers[hdrcount++] = hdrdata;
+/* Parse a header field line, returns false after sending an error response */
+static bool uh_http_header_field(struct client *cl, char *line, int len)
+{
+	char *name = line;
+	char *data, *end = line + len;
+	int nlen;
+	struct http_request *req = &cl->request;
 
-					hdrname = hdrdata = NULL;
-				}
+	/* skip lines without a field name, like obsolete line folding */
+	if (!(data = memchr(line, ':', len)) || (data == line) || isspace(*line))
+		return true;
 
-				/* too large */
-				else
-				{
-					D("SRV: HTTP: header too big (too many headers)\n");
-					uh_http_response(cl, 413, "Request Entity Too Large");
-					return NULL;
-				}
-			}
+	nlen = data - name;
+	*data++ = 0;
 
-			/* have name but no value and found a colon, start of value */
-			else if (hdrname && !hdrdata &&
-					 ((i+1) < buflen) && (buffer[i] == ':'))
-			{
-				buffer[i] = 0;
-				hdrdata = &buffer[i+1];
+	while ((data < end) && ((*data == ' ') || (*data == '\t')))
+		data++;
 
-				while ((hdrdata + 1) < (buffer + buflen) && *hdrdata == ' ')
-					hdrdata++;
-			}
+	while ((end > data) && ((end[-1] == ' ') || (end[-1] == '\t')))
+		end--;
 
-			/* have no name and found [A-Za-z], start of name */
-			else if (!hdrname && isalpha(buffer[i]))
-			{
-				hdrname = &buffer[i];
-			}
-		}
+	*end = 0;
 
-		/* valid enough */
-		req->redirect_status = 200;
-		return req;
+	/* store */
+	if ((cl->httpbuf.hdrcount + 2) >= array_size(req->headers))
+	{
+		D("SRV: HTTP: header too big (too many headers)\n");
+		uh_http_response(cl, 413, "Request Entity Too Large");
+		return false;
 	}
 
-	/* Malformed request */
-	uh_http_response(cl, 400, "Bad Request");
-	return NULL;
+	D("SRV: HTTP: %s: %s\n", name, data);
+
+	req->headers[cl->httpbuf.hdrcount++] = name;
+	req->headers[cl->httpbuf.hdrcount++] = data;
+
+	return uh_http_header_classify(cl, name, nlen, data);
 }
 
-static bool uh_http_header_check_method(const char *buf, ssize_t rlen)
+/* Consume the complete lines received since the last call. Lines are
+ * located with memchr() which scans word- or vector-wise, the terminating
+ * CR/LF and the field colons are replaced by NULs in place so that the
+ * request line and headers can be referenced directly.
+ * Returns 1 once the empty line ending the header was seen, 0 if more data
+ * is required and -1 after an error response was sent. */
+static int uh_http_header_parse(struct client *cl)
 {
-	int i;
+	char *buf = cl->httpbuf.buf;
+	char *line, *eol;
+	int len;
 
-	for (i = 0; i < sizeof(http_methods)/sizeof(http_methods[0]); i++)
-		if (!strncmp(buf, http_methods[i], min(rlen, strlen(http_methods[i]))))
-			return true;
+	while (cl->httpbuf.scan < cl->httpbuf.len)
+	{
+		line = buf + cl->httpbuf.scan;
+		len = cl->httpbuf.len - cl->httpbuf.scan;
 
-	return false;
-}
+		/* reject garbage early instead of waiting for a full line, no
+		 * matter how much of the method the first reads returned */
+		if (!cl->request.url && (*line != '\r') && (*line != '\n') &&
+			!uh_http_header_check_method(line, len))
+		{
+			D("SRV: Client(%d) no valid HTTP method, abort\n", cl->fd.fd);
+			uh_http_response(cl, 400, "Bad Request");
+			return -1;
+		}
 
+		if (!(eol = memchr(line, '\n', len)))
+			return 0;
 
-static struct http_request * uh_http_header_recv(struct client *cl)
-{
-	char *bufptr = cl->httpbuf.buf;
-	char *idxptr = NULL;
+		cl->httpbuf.scan += eol - line + 1;
+		len = eol - line;
 
-	ssize_t blen = sizeof(cl->httpbuf.buf)-1;
-	ssize_t rlen = 0;
+		if ((len > 0) && (line[len-1] == '\r'))
+			len--;
 
-	memset(bufptr, 0, sizeof(cl->httpbuf.buf));
+		/* empty line, end of header, but ignore leading ones */
+		if (len == 0)
+		{
+			if (!cl->request.url)
+				continue;
 
-	while (blen > 0)
-	{
-		/* receive data */
-		ensure_out(rlen = uh_tcp_recv(cl, bufptr, blen));
-		D("SRV: Client(%d) peek(%d) = %d\n", cl->fd.fd, blen, rlen);
+			cl->httpbuf.ptr = buf + cl->httpbuf.scan;
+			cl->httpbuf.len -= cl->httpbuf.scan;
+			cl->request.redirect_status = 200;
+			return 1;
+		}
 
-		if (rlen <= 0)
+		if (!cl->request.url)
 		{
-			D("SRV: Client(%d) dead [%s]\n", cl->fd.fd, strerror(errno));
-			return NULL;
+			if (!uh_http_header_request(cl, line, len))
+				return -1;
 		}
-
-		/* first read attempt, check for valid method signature */
-		if ((bufptr == cl->httpbuf.buf) &&
-		    !uh_http_header_check_method(bufptr, rlen))
+		else if (!uh_http_header_field(cl, line, len))
 		{
-			D("SRV: Client(%d) no valid HTTP method, abort\n", cl->fd.fd);
-			uh_http_response(cl, 400, "Bad Request");
-			return NULL;
+			return -1;
 		}
+	}
 
-		blen -= rlen;
-		bufptr += rlen;
+	return 0;
+}
+
+/* Accumulate the header from whatever the socket delivers right now,
+ * returns 1 once the request is complete, 0 if more data has to arrive
+ * and -1 if the connection has to be closed. */
+static int uh_http_header_recv(struct client *cl)
+{
+	int rv, rlen;
+	int blen = UH_LIMIT_MSGHEAD - 1;
+
+	/* idle connections do not keep a header buffer around */
+	if (!cl->httpbuf.buf && !uh_client_buffer(cl))
+	{
+		uh_http_response(cl, 503, "Service Unavailable");
+		return -1;
+	}
 
-		if ((idxptr = strfind(cl->httpbuf.buf, sizeof(cl->httpbuf.buf),
-							  "\r\n\r\n", 4)))
+	/* pipelined data left over by the previous request is parsed first,
+	 * each received chunk is only scanned once */
+	while ((rv = uh_http_header_parse(cl)) == 0)
+	{
+		if (cl->httpbuf.len >= blen)
 		{
-			/* header read complete ... */
-			cl->httpbuf.ptr = idxptr + 4;
-			cl->httpbuf.len = bufptr - cl->httpbuf.ptr;
+			/* request entity too large */
+			D("SRV: HTTP: header too big (buffer exceeded)\n");
+			uh_http_response(cl, 413, "Request Entity Too Large");
+			return -1;
+		}
+
+		rlen = uh_tcp_recv(cl, cl->httpbuf.buf + cl->httpbuf.len,
+						   blen - cl->httpbuf.len);
+
+		D("SRV: Client(%d) peek(%d) = %d\n",
+		  cl->fd.fd, blen - cl->httpbuf.len, rlen);
+
+		/* rest of the header did not arrive yet, wait for the socket */
+		if ((rlen < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+			return 0;
 
-			return uh_http_header_parse(cl, cl->httpbuf.buf,
-										(cl->httpbuf.ptr - cl->httpbuf.buf));
+		if (rlen <= 0)
+		{
+			D("SRV: Client(%d) dead [%s]\n", cl->fd.fd, strerror(errno));
+			return -1;
 		}
+
+		cl->httpbuf.len += rlen;
 	}
 
-	/* request entity too large */
-	D("SRV: HTTP: header too big (buffer exceeded)\n");
-	uh_http_response(cl, 413, "Request Entity Too Large");
+	return rv;
+}
+
+static bool uh_http_keepalive(struct client *cl, struct http_request *req)
+{
+	struct config *conf = cl->server->conf;
+
+	/* disabled or request limit of this connection reached */
+	if ((conf->http_keepalive <= 0) ||
+		((conf->max_conn_requests > 0) &&
+		 ((cl->requests + 1) >= conf->max_conn_requests)))
+		return false;
+
+	/* only HTTP/1.1 responses are reliably delimited, HEAD responses to
+	 * errors and directory listings carry a body */
+	if ((req->version < UH_HTTP_VER_1_1) || (req->method == UH_HTTP_MSG_HEAD))
+		return false;
+
+	/* chunked request bodies are not decoded, where the body ends is
+	 * unknown and the rest of the stream can not be trusted */
+	if (req->fields[UH_HTTP_HDR_TRANSFER_ENCODING])
+		return false;
 
-out:
-	return NULL;
+	if (req->fields[UH_HTTP_HDR_CONNECTION] &&
+		!strcasecmp(req->fields[UH_HTTP_HDR_CONNECTION], "close"))
+		return false;
+
+	return true;
 }
 
 #if defined(HAVE_LUA) || defined(HAVE_CGI)
@@ -457,19 +672,65 @@ static int uh_path_match(const char *prefix, const char *url)
 }
 #endif
 
+#ifdef HAVE_CGI
+static bool uh_script_request(struct client *cl, struct path_info *pin,
+                              struct interpreter *ipr)
+{
+	cl->metrics.handler = UH_METRICS_CGI;
+
+	if (ipr && ipr->fcgi)
+		return uh_fcgi_request(cl, pin, ipr->fcgi);
+
+	return uh_cgi_request(cl, pin, ipr);
+}
+#endif
+
 static bool uh_dispatch_request(struct client *cl, struct http_request *req)
 {
-	struct path_info *pin;
+	struct path_info *pin, pimg;
+	const struct uh_image_entry *ent;
+	char name[UH_LIMIT_MSGHEAD];
 #ifdef HAVE_CGI
 	struct interpreter *ipr = NULL;
+	struct uh_fcgi_app *app;
 #endif
 	struct config *conf = cl->server->conf;
+	int n = conf->status_url ? strlen(conf->status_url) : 0;
+
+	/* static handler unless a script or plugin takes the request */
+	uh_metrics_start(cl, UH_METRICS_FILE);
+
+	/* server status? */
+	if (n && !strncmp(req->url, conf->status_url, n) &&
+		(!req->url[n] || (req->url[n] == '?')))
+	{
+		memset(&pimg, 0, sizeof(pimg));
+		pimg.name = conf->status_url;
+
+		if (uh_auth_check(cl, req, &pimg))
+			return uh_metrics_request(cl);
+
+		return false;
+	}
+
+#ifdef HAVE_CGI
+	/* FastCGI application mounted at a prefix? */
+	for (app = uh_fcgi_apps; app; app = app->next)
+	{
+		if (app->prefix && uh_path_match(app->prefix, req->url))
+		{
+			cl->metrics.handler = UH_METRICS_CGI;
+			return uh_fcgi_request(cl, NULL, app);
+		}
+	}
+#endif
 
 #ifdef HAVE_LUA
 	/* Lua request? */
 	if (conf->lua_state &&
 		uh_path_match(conf->lua_prefix, req->url))
 	{
+		cl->metrics.handler = UH_METRICS_LUA;
 		return conf->lua_request(cl, conf->lua_state);
 	}
 	else
@@ -480,13 +741,30 @@ static bool uh_dispatch_request(struct client *cl, struct http_request *req)
 	if (conf->ubus_state &&
 		uh_path_match(conf->ubus_prefix, req->url))
 	{
+		cl->metrics.handler = UH_METRICS_UBUS;
 		return conf->ubus_request(cl, conf->ubus_state);
 	}
 	else
 #endif
 
+	/* docroot image hit, scripts and misses are left to the filesystem */
+	if (conf->image &&
+		(ent = uh_image_lookup(conf->image, req->url, name, sizeof(name)))
+#ifdef HAVE_CGI
+		&& !uh_path_match(conf->cgi_prefix, name) &&
+		!uh_interpreter_lookup(name)
+#endif
+		)
+	{
+		memset(&pimg, 0, sizeof(pimg));
+		pimg.name = name;
+
+		if (uh_auth_check(cl, req, &pimg))
+			return uh_file_image_request(cl, conf->image, ent);
+	}
+
 	/* dispatch request */
-	if ((pin = uh_path_lookup(cl, req->url)) != NULL)
+	else if ((pin = uh_path_lookup(cl, req->url)) != NULL)
 	{
 		/* auth ok? */
 		if (!pin->redirected && uh_auth_check(cl, req, pin))
@@ -495,7 +773,7 @@ static bool uh_dispatch_request(struct client *cl, struct http_request *req)
 			if (uh_path_match(conf->cgi_prefix, pin->name) ||
 				(ipr = uh_interpreter_lookup(pin->phys)) != NULL)
 			{
-				return uh_cgi_request(cl, pin, ipr);
+				return uh_script_request(cl, pin, ipr);
 			}
 #endif
 			return uh_file_request(cl, pin);
@@ -516,7 +794,7 @@ static bool uh_dispatch_request(struct client *cl, struct http_request *req)
 				if (uh_path_match(conf->cgi_prefix, pin->name) ||
 					(ipr = uh_interpreter_lookup(pin->phys)) != NULL)
 				{
-					return uh_cgi_request(cl, pin, ipr);
+					return uh_script_request(cl, pin, ipr);
 				}
 #endif
 				return uh_file_request(cl, pin);
@@ -534,6 +812,30 @@ static bool uh_dispatch_request(struct client *cl, struct http_request *req)
 }
 
 static void uh_socket_cb(struct uloop_fd *u, unsigned int events);
+static void uh_header_deadline(struct client *cl);
+
+#ifdef HAVE_TLS
+static void uh_tls_handshake(struct client *cl);
+#endif
+
+static int uh_socket_accept(int sock, struct sockaddr_in6 *sa)
+{
+	int fd;
+	socklen_t sl = sizeof(*sa);
+
+#ifdef SOCK_NONBLOCK
+	fd = accept4(sock, (struct sockaddr *)sa, &sl,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	if ((fd = accept(sock, (struct sockaddr *)sa, &sl)) != -1)
+	{
+		fd_cloexec(fd);
+		fd_nonblock(fd);
+	}
+#endif
+
+	return fd;
+}
 
 static void uh_listener_cb(struct uloop_fd *u, unsigned int events)
 {
@@ -543,71 +845,323 @@ static void uh_listener_cb(struct uloop_fd *u, unsigned int events)
 	struct config *conf;
 
 	struct sockaddr_in6 sa;
-	socklen_t sl = sizeof(sa);
 
 	serv = container_of(u, struct listener, fd);
 	conf = serv->conf;
 
-	/* defer client if maximum number of requests is exceeded */
-	if (serv->n_clients >= conf->max_requests)
-		return;
-
-	/* handle new connections */
-	if ((new_fd = accept(u->fd, (struct sockaddr *)&sa, &sl)) != -1)
+	/* handle all pending connections */
+	while (true)
 	{
+		/* try to make room by closing an idle persistent connection,
+		 * stop polling the listener if the maximum number of requests is
+		 * still exceeded, it is resumed once a client went away */
+		if ((serv->n_clients >= conf->max_requests) &&
+			!uh_client_reap(serv, NULL))
+		{
+			D("SRV: Server(%d) at capacity, pausing\n", u->fd);
+
+			uh_metrics_inc(accepts_deferred);
+
+			uloop_fd_delete(&serv->fd);
+			serv->paused = true;
+			break;
+		}
+
+		if ((new_fd = uh_socket_accept(u->fd, &sa)) == -1)
+		{
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+				continue;
+
+			/* out of descriptors, retry once a client is closed */
+			if (((errno == EMFILE) || (errno == ENFILE)) && serv->n_clients)
+			{
+				uloop_fd_delete(&serv->fd);
+				serv->paused = true;
+			}
+
+			break;
+		}
+
 		D("SRV: Server(%d) accept => Client(%d)\n", u->fd, new_fd);
 
+		uh_metrics_inc(accepts);
+
+		/* a single address must not occupy all the slots, make room by
+		 * closing one of its idle connections or refuse the new one */
+		if ((conf->max_peer_conns > 0) &&
+			(uh_client_count(&sa) >= conf->max_peer_conns) &&
+			!uh_client_reap(NULL, &sa))
+		{
+			D("SRV: Server(%d) refusing Client(%d), %s has %d connections\n",
+			  u->fd, new_fd, sa_straddr(&sa), conf->max_peer_conns);
+
+			uh_metrics_inc(accepts_refused);
+
+			close(new_fd);
+			continue;
+		}
+
 		/* add to global client list */
 		if ((cl = uh_client_add(new_fd, serv, &sa)) != NULL)
 		{
-			/* add client socket to global fdset */
-			uh_ufd_add(&cl->fd, uh_socket_cb, ULOOP_READ);
-			fd_cloexec(cl->fd.fd);
+			/* add client socket to global fdset, accepted sockets are
+			 * non-blocking already */
+			uh_ufd_add(&cl->fd, uh_socket_cb, ULOOP_READ | ULOOP_BLOCKING);
+
+			cl->outbuf.events = ULOOP_READ;
+
+#ifdef HAVE_TLS
+			/* setup client tls context, the handshake is resumed from the
+			 * socket callback */
+			if (conf->tls)
+				uh_tls_handshake(cl);
+			else
+#endif
+			uh_header_deadline(cl);
+		}
+
+		/* insufficient resources */
+		else
+		{
+			fprintf(stderr, "uh_client_add(): Cannot allocate memory\n");
+			close(new_fd);
+		}
+	}
+}
+
+static void uh_client_cb(struct client *cl, unsigned int events);
+
+static void uh_keepalive_cb(struct uloop_timeout *t)
+{
+	struct client *cl = container_of(t, struct client, timeout);
+
+	D("SRV: Client(%d) idle timeout after %d requests\n",
+	  cl->fd.fd, cl->requests);
+
+	uh_client_shutdown(cl);
+}
+
+/* the header of a request has to be complete within the network timeout,
+ * counted from the accept or from the first read after an idle period, so
+ * clients trickling it in cannot hold a connection slot indefinitely */
+static void uh_header_timeout_cb(struct uloop_timeout *t)
+{
+	struct client *cl = container_of(t, struct client, timeout);
+
+	D("SRV: Client(%d) request header timed out\n", cl->fd.fd);
+
+	/* answer a partial request, just close a silent connection */
+	if (cl->httpbuf.len > 0)
+		uh_http_response(cl, 408, "Request Timeout");
+
+	uh_client_shutdown(cl);
+}
+
+static void uh_header_deadline(struct client *cl)
+{
+	if (cl->timeout.pending && (cl->timeout.cb == uh_header_timeout_cb))
+		return;
+
+	cl->timeout.cb = uh_header_timeout_cb;
+	uloop_timeout_set(&cl->timeout, cl->server->conf->network_timeout * 1000);
+}
+
+/* handlers without a child of their own read the request body from the
+ * loop as well, the same bound applies to it */
+static void uh_body_timeout_cb(struct uloop_timeout *t)
+{
+	struct client *cl = container_of(t, struct client, timeout);
+
+	D("SRV: Client(%d) request body timed out\n", cl->fd.fd);
+
+	cl->keepalive = false;
+	uh_client_shutdown(cl);
+}
+
+static void uh_pipeline_cb(struct uloop_timeout *t)
+{
+	struct client *cl = container_of(t, struct client, timeout);
+
+	D("SRV: Client(%d) processing pipelined request\n", cl->fd.fd);
+
+	uh_client_cb(cl, ULOOP_READ);
+}
+
+#ifdef HAVE_TLS
+static void uh_handshake_timeout_cb(struct uloop_timeout *t)
+{
+	struct client *cl = container_of(t, struct client, timeout);
+
+	D("SRV: Client(%d) SSL handshake timed out\n", cl->fd.fd);
+
+	uh_client_shutdown(cl);
+}
+
+static void uh_tls_handshake(struct client *cl)
+{
+	struct config *conf = cl->server->conf;
+	int rv = conf->tls_accept(cl);
+
+	if (rv < 0)
+	{
+		D("SRV: Client(%d) SSL handshake failed, drop\n", cl->fd.fd);
+
+		uh_metrics_inc(tls_failures);
+
+		uh_http_response(cl, 400, "Bad Request");
+		uh_client_shutdown(cl);
+		return;
+	}
+
+	/* wait for the socket to become ready, bounded by the network timeout */
+	if (rv == 0)
+	{
+		if (!cl->handshake)
+		{
+			cl->handshake = true;
+			cl->timeout.cb = uh_handshake_timeout_cb;
+			uloop_timeout_set(&cl->timeout,
+							  conf->network_timeout * 1000);
+		}
+
+		return;
+	}
+
+	D("SRV: Client(%d) SSL handshake complete\n", cl->fd.fd);
+
+	uh_metrics_inc(tls_handshakes);
+
+	/* the request header is due next */
+	cl->handshake = false;
+	uh_header_deadline(cl);
+
+	/* the request arrived along with the last handshake message and is
+	 * buffered in the tls layer already, the socket will not signal it */
+	if (conf->tls_pending(cl) > 0)
+	{
+		cl->timeout.cb = uh_pipeline_cb;
+		uloop_timeout_set(&cl->timeout, 0);
+	}
+}
+#endif
+
+static void uh_client_done(struct client *cl)
+{
+	struct config *conf = cl->server->conf;
+
+	/* handlers reset the content length once they consumed the body,
+	 * otherwise it would be parsed as the next request */
+	if (cl->request.content_length > 0)
+		cl->keepalive = false;
+
+	if (!cl->keepalive)
+	{
+		uh_client_shutdown(cl);
+		return;
+	}
 
-#ifdef HAVE_TLS
-			/* setup client tls context */
-			if (conf->tls)
-			{
-				if (conf->tls_accept(cl) < 1)
-				{
-					D("SRV: Client(%d) SSL handshake failed, drop\n", new_fd);
+	uh_client_reset(cl);
 
-					/* remove from global client list */
-					uh_http_response(cl, 400, "Bad Request");
-					uh_client_remove(cl);
-					return;
-				}
-			}
+	/* next request is already buffered, process it from the loop rather
+	 * than recursing into the callback */
+	if ((cl->httpbuf.len > 0)
+#ifdef HAVE_TLS
+		|| (cl->tls && (conf->tls_pending(cl) > 0))
 #endif
-		}
+		)
+	{
+		cl->timeout.cb = uh_pipeline_cb;
+		uloop_timeout_set(&cl->timeout, 0);
+	}
 
-		/* insufficient resources */
-		else
-		{
-			fprintf(stderr, "uh_client_add(): Cannot allocate memory\n");
-			close(new_fd);
-		}
+	/* wait for the next request */
+	else
+	{
+		cl->timeout.cb = uh_keepalive_cb;
+		uloop_timeout_set(&cl->timeout, conf->http_keepalive * 1000);
 	}
 }
 
-static void uh_client_cb(struct client *cl, unsigned int events);
-
 static void uh_rpipe_cb(struct uloop_fd *u, unsigned int events)
 {
 	struct client *cl = container_of(u, struct client, rpipe);
 
 	D("SRV: Client(%d) rpipe readable\n", cl->fd.fd);
 
+	/* do not read more output than the client accepts, resume once
+	 * the queued data has been flushed */
+	if (uh_client_congested(cl))
+	{
+		D("SRV: Client(%d) output congested, pausing rpipe\n", cl->fd.fd);
+
+		uloop_fd_delete(&cl->rpipe);
+		cl->paused = true;
+		return;
+	}
+
 	uh_client_cb(cl, ULOOP_WRITE);
 }
 
+static void uh_wpipe_cb(struct uloop_fd *u, unsigned int events)
+{
+	struct client *cl = container_of(u, struct client, wpipe);
+
+	D("SRV: Client(%d) wpipe writable\n", cl->fd.fd);
+
+	/* the child consumed input, continue reading the request body */
+	uloop_fd_delete(&cl->wpipe);
+	cl->stalled = false;
+
+	uh_client_cb(cl, ULOOP_READ);
+}
+
 static void uh_socket_cb(struct uloop_fd *u, unsigned int events)
 {
 	struct client *cl = container_of(u, struct client, fd);
 
-	D("SRV: Client(%d) socket readable\n", cl->fd.fd);
+	/* input for a stalled tls write arrived, retry it */
+	if ((events & ULOOP_READ) && cl->outbuf.blocked)
+	{
+		cl->outbuf.blocked = false;
+		events |= ULOOP_WRITE;
+	}
 
-	uh_client_cb(cl, ULOOP_READ);
+#ifdef HAVE_TLS
+	/* resume pending handshake */
+	if (cl->handshake)
+	{
+		if ((events & ULOOP_WRITE) && !uh_client_flush(cl))
+			return;
+
+		uh_tls_handshake(cl);
+		return;
+	}
+#endif
+
+	if (events & ULOOP_WRITE)
+	{
+		D("SRV: Client(%d) socket writable\n", cl->fd.fd);
+
+		/* client is gone after an error or a completed shutdown */
+		if (!uh_client_flush(cl))
+			return;
+
+		/* let the response handler continue after the queue drained */
+		if (cl->outbuf.len > 0)
+			events &= ~ULOOP_WRITE;
+
+		else if (cl->paused)
+		{
+			uloop_fd_add(&cl->rpipe, ULOOP_READ);
+			cl->paused = false;
+		}
+	}
+
+	if (events & ULOOP_READ)
+		D("SRV: Client(%d) socket readable\n", cl->fd.fd);
+
+	if (events && !cl->outbuf.closing)
+		uh_client_cb(cl, events);
 }
 
 #if defined(HAVE_CGI) || defined(HAVE_LUA) || defined(HAVE_UBUS)
@@ -629,6 +1183,8 @@ static void uh_kill9_cb(struct uloop_timeout *t)
 		D("SRV: Client(%d) child(%d) kill(SIGKILL)...\n",
 		  cl->fd.fd, cl->proc.pid);
 
+		uh_metrics_inc(cgi_kills);
+
 		kill(cl->proc.pid, SIGKILL);
 	}
 }
@@ -639,6 +1195,8 @@ static void uh_timeout_cb(struct uloop_timeout *t)
 
 	D("SRV: Client(%d) child(%d) timed out\n", cl->fd.fd, cl->proc.pid);
 
+	uh_metrics_inc(cgi_timeouts);
+
 	if (!kill(cl->proc.pid, 0))
 	{
 		D("SRV: Client(%d) child(%d) kill(SIGTERM)...\n",
@@ -654,7 +1212,8 @@ static void uh_timeout_cb(struct uloop_timeout *t)
 
 static void uh_client_cb(struct client *cl, unsigned int events)
 {
-	int i;
+	int rv;
+	char *hdr;
 	struct config *conf;
 	struct http_request *req;
 
@@ -672,24 +1231,33 @@ static void uh_client_cb(struct client *cl, unsigned int events)
 			return;
 		}
 
-		/* attempt to receive and parse headers */
-		if (!(req = uh_http_header_recv(cl)))
+		/* replace the idle or pipeline timer of a persistent connection */
+		uh_header_deadline(cl);
+
+		/* attempt to receive and parse headers, continue on the next
+		 * read event if they are incomplete */
+		if ((rv = uh_http_header_recv(cl)) == 0)
+			return;
+
+		if (rv < 0)
 		{
 			D("SRV: Client(%d) failed to receive header\n", cl->fd.fd);
 			uh_client_shutdown(cl);
 			return;
 		}
 
+		uloop_timeout_cancel(&cl->timeout);
+		req = &cl->request;
+
+		cl->keepalive = uh_http_keepalive(cl, req);
+
 		/* process expect headers */
-		foreach_header(i, req->headers)
+		if ((hdr = req->fields[UH_HTTP_HDR_EXPECT]) != NULL)
 		{
-			if (strcasecmp(req->headers[i], "Expect"))
-				continue;
-
-			if (strcasecmp(req->headers[i+1], "100-continue"))
+			if (strcasecmp(hdr, "100-continue"))
 			{
 				D("SRV: Client(%d) unknown expect header (%s)\n",
-				  cl->fd.fd, req->headers[i+1]);
+				  cl->fd.fd, hdr);
 
 				uh_http_response(cl, 417, "Precondition Failed");
 				uh_client_shutdown(cl);
@@ -701,7 +1269,6 @@ static void uh_client_cb(struct client *cl, unsigned int events)
 
 				uh_http_sendf(cl, NULL, "HTTP/1.1 100 Continue\r\n\r\n");
 				cl->httpbuf.len = 0; /* client will re-send the body */
-				break;
 			}
 		}
 
@@ -720,8 +1287,8 @@ static void uh_client_cb(struct client *cl, unsigned int events)
 		/* dispatch request */
 		if (!uh_dispatch_request(cl, req))
 		{
-			D("SRV: Client(%d) failed to dispach request\n", cl->fd.fd);
-			uh_client_shutdown(cl);
+			D("SRV: Client(%d) request handled synchronously\n", cl->fd.fd);
+			uh_client_done(cl);
 			return;
 		}
 
@@ -733,6 +1300,10 @@ static void uh_client_cb(struct client *cl, unsigned int events)
 			uh_ufd_add(&cl->rpipe, uh_rpipe_cb, ULOOP_READ);
 		}
 
+		/* a body relay registers the input pipe once it fills up */
+		if (cl->wpipe.fd > -1)
+			cl->wpipe.cb = uh_wpipe_cb;
+
 		/* request handler spawned a child, register handler */
 #if defined(HAVE_CGI) || defined(HAVE_LUA) || defined(HAVE_UBUS)
 		if (cl->proc.pid)
@@ -755,9 +1326,215 @@ static void uh_client_cb(struct client *cl, unsigned int events)
 	if (!cl->cb(cl))
 	{
 		D("SRV: Client(%d) response callback signalized EOF\n", cl->fd.fd);
-		uh_client_shutdown(cl);
+		uh_client_done(cl);
 		return;
 	}
+
+#ifdef HAVE_ZLIB
+	/* the handler waits for its backend, send what has been compressed
+	 * so far instead of holding it back until the next output, a failed
+	 * write surfaces with the next one */
+	uh_deflate_flush(cl);
+#endif
+
+	/* bound the wait for the rest of the body unless a script timeout
+	 * already covers the request, stop once it has been consumed */
+	if ((cl->request.content_length > 0) && !cl->timeout.pending)
+	{
+		cl->timeout.cb = uh_body_timeout_cb;
+		uloop_timeout_set(&cl->timeout, conf->network_timeout * 1000);
+	}
+	else if (!cl->request.content_length &&
+			 (cl->timeout.cb == uh_body_timeout_cb))
+	{
+		uloop_timeout_cancel(&cl->timeout);
+	}
+}
+
+/* rebind a listener inherited from the supervisor to a socket of our own
+ * so that the kernel distributes new connections among the workers */
+static int uh_socket_reopen(struct listener *l, struct config *conf)
+{
+	int sock;
+	int family = l->addr.sin6_family;
+	socklen_t sl = (family == AF_INET6) ? sizeof(struct sockaddr_in6)
+	                                    : sizeof(struct sockaddr_in);
+
+	if ((sock = socket(family, SOCK_STREAM, 0)) == -1)
+	{
+		perror("socket()");
+		return -1;
+	}
+
+	if (uh_socket_setup(sock, family, conf) ||
+		bind(sock, (struct sockaddr *)&l->addr, sl))
+	{
+		perror("bind()");
+		close(sock);
+		return -1;
+	}
+
+	if (uh_socket_listen(sock, conf))
+	{
+		close(sock);
+		return -1;
+	}
+
+	fd_cloexec(sock);
+	l->fd.fd = sock;
+
+	return 0;
+}
+
+struct worker {
+	struct uloop_process proc;
+	struct uloop_timeout restart;
+	struct config *conf;
+	time_t started;
+};
+
+static struct worker *uh_workers;
+
+static void uh_cleanup(struct config *conf)
+{
+#ifdef HAVE_LUA
+	/* destroy the Lua state */
+	if (conf->lua_state != NULL)
+		conf->lua_close(conf->lua_state);
+#endif
+
+#ifdef HAVE_UBUS
+	/* destroy the ubus state */
+	if (conf->ubus_state != NULL)
+		conf->ubus_close(conf->ubus_state);
+#endif
+
+#ifdef HAVE_CGI
+	/* stop the FastCGI applications */
+	uh_fcgi_cleanup();
+#endif
+}
+
+static void uh_worker_run(struct config *conf)
+{
+	int i;
+	struct listener *l;
+
+	/* forget about the supervisor state, the poll set is shared with the
+	 * parent and must be replaced by one of our own */
+	for (i = 0; i < conf->workers; i++)
+	{
+		uloop_process_delete(&uh_workers[i].proc);
+		uloop_timeout_cancel(&uh_workers[i].restart);
+	}
+
+	uloop_done();
+	uloop_init();
+
+	for (l = uh_listeners; l; l = l->next)
+	{
+		if (uh_socket_reopen(l, conf))
+			exit(1);
+
+		uh_ufd_add(&l->fd, uh_listener_cb, ULOOP_READ);
+	}
+
+#ifdef HAVE_UBUS
+	/* sessions stay with the supervisor, talk to it through our own bus
+	 * connection */
+	if (conf->ubus_state != NULL)
+		conf->ubus_fork(conf->ubus_state, conf);
+#endif
+
+	uloop_run();
+	uh_cleanup(conf);
+
+	exit(0);
+}
+
+static void uh_worker_spawn(struct worker *w)
+{
+	pid_t pid;
+
+	switch ((pid = fork()))
+	{
+		case -1:
+			perror("fork()");
+			uloop_timeout_set(&w->restart, 1000);
+			break;
+
+		case 0:
+			uh_metrics_attach(w - uh_workers + 1);
+			uh_worker_run(w->conf);
+			break;
+
+		default:
+			D("Worker: started pid %d\n", pid);
+
+			w->started = time(NULL);
+			w->proc.pid = pid;
+			uloop_process_add(&w->proc);
+			break;
+	}
+}
+
+static void uh_worker_restart_cb(struct uloop_timeout *t)
+{
+	uh_worker_spawn(container_of(t, struct worker, restart));
+}
+
+static void uh_worker_exit_cb(struct uloop_process *p, int ret)
+{
+	struct worker *w = container_of(p, struct worker, proc);
+
+	D("Worker: pid %d exited with status %d\n", p->pid, ret);
+
+	/* respawn, but do not spin on workers dying right after startup */
+	uloop_timeout_set(&w->restart, (time(NULL) - w->started < 1) ? 1000 : 0);
+}
+
+static void uh_workers_run(struct config *conf)
+{
+	int i;
+	struct listener *l;
+
+	if (!(uh_workers = calloc(conf->workers, sizeof(*uh_workers))) ||
+		!uh_metrics_init(conf->workers + 1))
+	{
+		fprintf(stderr, "Error: Failed to allocate worker state\n");
+		exit(1);
+	}
+
+	/* the workers bind their own sockets, ours would receive a share of
+	 * the connections without ever accepting them */
+	for (l = uh_listeners; l; l = l->next)
+	{
+		uloop_fd_delete(&l->fd);
+		close(l->fd.fd);
+	}
+
+	/* the TLS context was set up before, every worker and every respawn
+	 * inherits the ticket secret and accepts the tickets of the others,
+	 * the session ID cache however starts out empty in each of them */
+	for (i = 0; i < conf->workers; i++)
+	{
+		uh_workers[i].conf = conf;
+		uh_workers[i].proc.cb = uh_worker_exit_cb;
+		uh_workers[i].restart.cb = uh_worker_restart_cb;
+
+		uh_worker_spawn(&uh_workers[i]);
+	}
+
+	/* serve the ubus session object until terminated */
+	uloop_run();
+
+	for (i = 0; i < conf->workers; i++)
+		if (uh_workers[i].proc.pending)
+			kill(uh_workers[i].proc.pid, SIGTERM);
+
+	for (i = 0; i < conf->workers; i++)
+		if (uh_workers[i].proc.pending)
+			waitpid(uh_workers[i].proc.pid, NULL, 0);
 }
 
 #ifdef HAVE_TLS
@@ -786,11 +1563,16 @@ static int uh_inittls(struct config *conf)
 		if (!(conf->tls_init   = dlsym(lib, "uh_tls_ctx_init"))      ||
 		    !(conf->tls_cert   = dlsym(lib, "uh_tls_ctx_cert"))      ||
 		    !(conf->tls_key    = dlsym(lib, "uh_tls_ctx_key"))       ||
+		    !(conf->tls_session = dlsym(lib, "uh_tls_ctx_session"))  ||
+		    !(conf->tls_ctx_ktls = dlsym(lib, "uh_tls_ctx_ktls"))    ||
 		    !(conf->tls_free   = dlsym(lib, "uh_tls_ctx_free"))      ||
 		    !(conf->tls_accept = dlsym(lib, "uh_tls_client_accept")) ||
 		    !(conf->tls_close  = dlsym(lib, "uh_tls_client_close"))  ||
 		    !(conf->tls_recv   = dlsym(lib, "uh_tls_client_recv"))   ||
-		    !(conf->tls_send   = dlsym(lib, "uh_tls_client_send")))
+		    !(conf->tls_send   = dlsym(lib, "uh_tls_client_send"))   ||
+		    !(conf->tls_ktls   = dlsym(lib, "uh_tls_client_ktls"))   ||
+		    !(conf->tls_sendfile = dlsym(lib, "uh_tls_client_sendfile")) ||
+		    !(conf->tls_pending = dlsym(lib, "uh_tls_client_pending")))
 		{
 			fprintf(stderr,
 					"Error: Failed to lookup required symbols "
@@ -883,6 +1665,7 @@ static int uh_initubus(struct config *conf)
 		/* resolve functions */
 		if (!(conf->ubus_init    = dlsym(lib, "uh_ubus_init"))    ||
 		    !(conf->ubus_close   = dlsym(lib, "uh_ubus_close"))   ||
+		    !(conf->ubus_fork    = dlsym(lib, "uh_ubus_fork"))    ||
 		    !(conf->ubus_request = dlsym(lib, "uh_ubus_request")))
 		{
 			fprintf(stderr,
@@ -906,6 +1689,7 @@ int main (int argc, char **argv)
 	struct addrinfo hints;
 	struct sigaction sa;
 	struct config conf;
+	struct listener *l;
 
 	/* maximum file descriptor number */
 	int cur_fd = 0;
@@ -942,11 +1726,16 @@ int main (int argc, char **argv)
 
 	/* parse args */
 	memset(&conf, 0, sizeof(conf));
+	conf.http_keepalive = -1;
+#ifdef HAVE_TLS
+	conf.tls_sessions = -1;
+	conf.tls_tickets = -1;
+#endif
 
 	uloop_init();
 
 	while ((opt = getopt(argc, argv,
-						 "fSDRC:K:E:I:p:s:h:c:l:L:d:r:m:n:x:i:t:T:A:u:U:")) > 0)
+						 "fSDRgoyjO:P:Q:C:K:Z:z:E:I:M:p:s:h:c:l:L:d:r:m:n:N:w:x:i:X:W:t:T:k:A:B:a:F:u:U:")) > 0)
 	{
 		switch(opt)
 		{
@@ -1024,9 +1813,27 @@ int main (int argc, char **argv)
 				}
 
 				break;
+
+			/* session cache size */
+			case 'Z':
+				conf.tls_sessions = atoi(optarg);
+				break;
+
+			/* session ticket key lifetime */
+			case 'z':
+				conf.tls_tickets = atoi(optarg);
+				break;
+
+			/* kernel tls offload */
+			case 'o':
+				conf.tls_offload = 1;
+				break;
 #else
 			case 'C':
 			case 'K':
+			case 'Z':
+			case 'z':
+			case 'o':
 				fprintf(stderr,
 				        "Notice: TLS support not compiled, ignoring -%c\n",
 				        opt);
@@ -1043,6 +1850,27 @@ int main (int argc, char **argv)
 				}
 				break;
 
+			/* docroot image */
+			case 'P':
+				if (!(conf.image = uh_image_open(optarg)))
+				{
+					fprintf(stderr, "Error: Invalid image %s: %s\n",
+							optarg, strerror(errno));
+					exit(1);
+				}
+				break;
+
+			/* status url */
+			case 'Q':
+				if ((strlen(optarg) == 0) || (optarg[0] != '/'))
+				{
+					fprintf(stderr, "Error: Invalid status URL: %s\n",
+							optarg);
+					exit(1);
+				}
+				conf.status_url = optarg;
+				break;
+
 			/* error handler */
 			case 'E':
 				if ((strlen(optarg) == 0) || (optarg[0] != '/'))
@@ -1079,10 +1907,31 @@ int main (int argc, char **argv)
 				conf.rfc1918_filter = 1;
 				break;
 
+#ifdef HAVE_ZLIB
+			/* compress dynamic responses */
+			case 'g':
+				conf.deflate = 1;
+				break;
+#else
+			case 'g':
+				fprintf(stderr,
+				        "Notice: Compression support not compiled, ignoring -%c\n",
+				        opt);
+				break;
+#endif
+
 			case 'n':
 				conf.max_requests = atoi(optarg);
 				break;
 
+			case 'N':
+				conf.max_conn_requests = atoi(optarg);
+				break;
+
+			case 'O':
+				conf.max_peer_conns = atoi(optarg);
+				break;
+
 #ifdef HAVE_CGI
 			/* cgi prefix */
 			case 'x':
@@ -1103,9 +1952,31 @@ int main (int argc, char **argv)
 					exit(1);
 				}
 				break;
+
+			/* fastcgi application */
+			case 'X':
+				if ((optarg[0] == '/') && (port = strchr(optarg, '=')))
+				{
+					*port++ = 0;
+					uh_fcgi_add(optarg, port);
+				}
+				else
+				{
+					fprintf(stderr, "Error: Invalid FastCGI application: %s\n",
+							optarg);
+					exit(1);
+				}
+				break;
+
+			/* fastcgi processes */
+			case 'W':
+				conf.fcgi_procs = atoi(optarg);
+				break;
 #else
 			case 'x':
 			case 'i':
+			case 'X':
+			case 'W':
 				fprintf(stderr,
 				        "Notice: CGI support not compiled, ignoring -%c\n",
 				        opt);
@@ -1122,9 +1993,15 @@ int main (int argc, char **argv)
 			case 'L':
 				conf.lua_handler = optarg;
 				break;
+
+			/* lua in-process */
+			case 'y':
+				conf.lua_inproc = 1;
+				break;
 #else
 			case 'l':
 			case 'L':
+			case 'y':
 				fprintf(stderr,
 				        "Notice: Lua support not compiled, ignoring -%c\n",
 				        opt);
@@ -1141,9 +2018,15 @@ int main (int argc, char **argv)
 			case 'U':
 				conf.ubus_socket = optarg;
 				break;
+
+			/* indented ubus replies */
+			case 'j':
+				conf.ubus_indent = 1;
+				break;
 #else
 			case 'u':
 			case 'U':
+			case 'j':
 				fprintf(stderr,
 				        "Notice: UBUS support not compiled, ignoring -%c\n",
 				        opt);
@@ -1162,16 +2045,57 @@ int main (int argc, char **argv)
 				conf.network_timeout = atoi(optarg);
 				break;
 
+			/* http keep-alive */
+			case 'k':
+				conf.http_keepalive = atoi(optarg);
+				break;
+
 			/* tcp keep-alive */
 			case 'A':
 				conf.tcp_keepalive = atoi(optarg);
 				break;
 
+			/* listen backlog */
+			case 'B':
+				conf.tcp_backlog = atoi(optarg);
+				break;
+
+			/* deferred accept */
+			case 'a':
+				conf.tcp_defer_accept = atoi(optarg);
+				break;
+
+			/* tcp fast open */
+			case 'F':
+				conf.tcp_fastopen = atoi(optarg);
+				break;
+
+			/* worker processes */
+			case 'w':
+				conf.workers = atoi(optarg);
+				break;
+
 			/* no fork */
 			case 'f':
 				nofork = 1;
 				break;
 
+			/* mime type */
+			case 'M':
+				if ((port = strchr(optarg, '=')) && (port > optarg) && port[1])
+				{
+					*port++ = 0;
+					uh_file_mime_add((optarg[0] == '.') ? &optarg[1] : optarg,
+									 port);
+				}
+				else
+				{
+					fprintf(stderr, "Error: Invalid mime type: %s\n",
+							optarg);
+					exit(1);
+				}
+				break;
+
 			/* urldecode */
 			case 'd':
 				if ((port = malloc(strlen(optarg)+1)) != NULL)
@@ -1217,30 +2141,51 @@ int main (int argc, char **argv)
 					"	-s [addr:]port  Like -p but provide HTTPS on this port\n"
 					"	-C file         ASN.1 server certificate file\n"
 					"	-K file         ASN.1 server private key file\n"
+					"	-Z count        TLS session cache size per worker, 0 to disable, default is 256\n"
+					"	-z seconds      TLS session ticket key lifetime, 0 to disable, default is 3600\n"
+					"	-o              Use kernel TLS offload if available\n"
 #endif
 					"	-h directory    Specify the document root, default is '.'\n"
+					"	-P file         Serve files from the given docroot image first\n"
 					"	-E string       Use given virtual URL as 404 error handler\n"
+					"	-Q string       Serve server metrics as plain text at given virtual URL\n"
 					"	-I string       Use given filename as index for directories, multiple allowed\n"
 					"	-S              Do not follow symbolic links outside of the docroot\n"
+					"	-M ext=type     Serve files with the given extension as type, multiple allowed\n"
 					"	-D              Do not allow directory listings, send 403 instead\n"
 					"	-R              Enable RFC1918 filter\n"
+#ifdef HAVE_ZLIB
+					"	-g              Compress CGI and ubus responses with gzip or deflate\n"
+#endif
 					"	-n count        Maximum allowed number of concurrent requests\n"
+					"	-N count        Maximum number of requests per connection, default is 100\n"
+					"	-O count        Maximum concurrent connections per client address\n"
+					"	-w count        Number of worker processes, default is 1\n"
 #ifdef HAVE_LUA
 					"	-l string       URL prefix for Lua handler, default is '/lua'\n"
 					"	-L file         Lua handler script, omit to disable Lua\n"
+					"	-y              Run the Lua handler within the server process\n"
 #endif
 #ifdef HAVE_UBUS
 					"	-u string       URL prefix for HTTP/JSON handler\n"
 					"	-U file         Override ubus socket path\n"
+					"	-j              Indent JSON replies of the ubus handler\n"
 #endif
 #ifdef HAVE_CGI
 					"	-x string       URL prefix for CGI handler, default is '/cgi-bin'\n"
-					"	-i .ext=path    Use interpreter at path for files with the given extension\n"
+					"	-i .ext=path    Use interpreter at path for files with the given extension,\n"
+					"	                prefix path with 'fcgi:' to use a FastCGI application\n"
+					"	-X /url=path    Serve URL prefix by the FastCGI application at path\n"
+					"	-W count        FastCGI processes per application, default is 2\n"
 #endif
 #if defined(HAVE_CGI) || defined(HAVE_LUA) || defined(HAVE_UBUS)
 					"	-t seconds      CGI, Lua and UBUS script timeout in seconds, default is 60\n"
 #endif
 					"	-T seconds      Network timeout in seconds, default is 30\n"
+					"	-k seconds      HTTP keep-alive idle timeout, 0 to disable, default is 20\n"
+					"	-B count        Listen backlog, default is 64\n"
+					"	-a seconds      Defer accept until request data arrived\n"
+					"	-F count        Enable TCP fast open with the given queue length\n"
 					"	-d string       URL decode given string\n"
 					"	-r string       Specify basic auth realm\n"
 					"	-m string       MD5 crypt given string\n"
@@ -1257,6 +2202,26 @@ int main (int argc, char **argv)
 		fprintf(stderr, "Error: Missing private key or certificate file\n");
 		exit(1);
 	}
+
+	if (conf.tls)
+	{
+		/* default session cache size */
+		if (conf.tls_sessions < 0)
+			conf.tls_sessions = 256;
+
+		/* default session ticket key lifetime */
+		if (conf.tls_tickets < 0)
+			conf.tls_tickets = 3600;
+
+		conf.tls_session(conf.tls, conf.tls_sessions, conf.tls_tickets);
+
+		if (conf.tls_offload && !conf.tls_ctx_ktls(conf.tls))
+		{
+			fprintf(stderr,
+			        "Notice: TLS library lacks kernel offload, ignoring -o\n");
+			conf.tls_offload = 0;
+		}
+	}
 #endif
 
 	if (bound < 1)
@@ -1265,6 +2230,15 @@ int main (int argc, char **argv)
 		exit(1);
 	}
 
+	/* the accept queue options may follow -p, reapply them to all
+	 * bound sockets */
+	if ((conf.tcp_backlog > 0) || (conf.tcp_defer_accept > 0) ||
+		(conf.tcp_fastopen > 0))
+	{
+		for (l = uh_listeners; l; l = l->next)
+			uh_socket_listen(l->fd.fd, &conf);
+	}
+
 	/* default docroot */
 	if (!conf.docroot[0] && !uh_realpath(".", conf.docroot))
 	{
@@ -1284,10 +2258,22 @@ int main (int argc, char **argv)
 	if (conf.max_requests <= 0)
 		conf.max_requests = 3;
 
+	/* preallocate the client objects for the concurrent requests of all
+	 * listeners */
+	uh_client_pool_init(conf.max_requests * bound);
+
 	/* default network timeout */
 	if (conf.network_timeout <= 0)
 		conf.network_timeout = 30;
 
+	/* default http keep-alive timeout */
+	if (conf.http_keepalive < 0)
+		conf.http_keepalive = 20;
+
+	/* default max requests per connection */
+	if (conf.max_conn_requests <= 0)
+		conf.max_conn_requests = 100;
+
 	/* default index files */
 	if (!uh_index_files)
 	{
@@ -1307,6 +2293,10 @@ int main (int argc, char **argv)
 	/* default cgi prefix */
 	if (!conf.cgi_prefix)
 		conf.cgi_prefix = "/cgi-bin";
+
+	/* default fastcgi processes per application */
+	if (conf.fcgi_procs <= 0)
+		conf.fcgi_procs = 2;
 #endif
 
 #ifdef HAVE_LUA
@@ -1351,20 +2341,13 @@ int main (int argc, char **argv)
 		}
 	}
 
-	/* server main loop */
-	uloop_run();
-
-#ifdef HAVE_LUA
-	/* destroy the Lua state */
-	if (conf.lua_state != NULL)
-		conf.lua_close(conf.lua_state);
-#endif
+	/* server main loop, either here or in the worker processes */
+	if (conf.workers > 1)
+		uh_workers_run(&conf);
+	else
+		uloop_run();
 
-#ifdef HAVE_UBUS
-	/* destroy the ubus state */
-	if (conf.ubus_state != NULL)
-		conf.ubus_close(conf.ubus_state);
-#endif
+	uh_cleanup(&conf);
 
 	return 0;
 }
@@ -17,6 +17,7 @@
  */
 
 #ifndef _UHTTPD_
+#define _UHTTPD_
 
 #define _BSD_SOURCE
 #define _XOPEN_SOURCE 700
@@ -24,6 +25,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
@@ -68,6 +70,21 @@
 #define UH_LIMIT_MSGHEAD	4096
 #define UH_LIMIT_HEADERS	64
 #define UH_LIMIT_CLIENTS	64
+#define UH_LIMIT_OUTBUF		32768
+#define UH_LIMIT_SENDFILE	65536
+#define UH_LIMIT_SPLICE		65536
+#define UH_LIMIT_QUANTUM	65536
+#define UH_LIMIT_RANGES		16
+
+#define UH_PATHCACHE_SIZE	64
+#define UH_PATHCACHE_TTL	2
+
+#define UH_AUTHCACHE_SIZE	32
+#define UH_AUTHCACHE_TTL	300
+
+#define UH_AUTHFAIL_SLOTS	16
+#define UH_AUTHFAIL_LIMIT	5
+#define UH_AUTHFAIL_WINDOW	60
 
 
 struct listener;
@@ -75,24 +92,41 @@ struct client;
 struct interpreter;
 struct http_request;
 struct uh_ubus_state;
+struct uh_fcgi_app;
+struct uh_image;
+struct uh_deflate;
 
 struct config {
 	char docroot[PATH_MAX];
+	struct uh_image *image;
 	char *realm;
 	char *file;
 	char *error_handler;
+	char *status_url;
 	int no_symlinks;
 	int no_dirlists;
 	int network_timeout;
+	int http_keepalive;
+	int max_conn_requests;
 	int rfc1918_filter;
 	int tcp_keepalive;
+	int tcp_backlog;
+	int tcp_defer_accept;
+	int tcp_fastopen;
 	int max_requests;
+	int max_peer_conns;
+	int workers;
+#ifdef HAVE_ZLIB
+	int deflate;
+#endif
 #ifdef HAVE_CGI
 	char *cgi_prefix;
+	int fcgi_procs;
 #endif
 #ifdef HAVE_LUA
 	char *lua_prefix;
 	char *lua_handler;
+	int lua_inproc;
 	lua_State *lua_state;
 	lua_State * (*lua_init) (const struct config *conf);
 	void (*lua_close) (lua_State *L);
@@ -101,9 +135,11 @@ struct config {
 #ifdef HAVE_UBUS
 	char *ubus_prefix;
 	char *ubus_socket;
+	int ubus_indent;
 	void *ubus_state;
 	struct uh_ubus_state * (*ubus_init) (const struct config *conf);
 	void (*ubus_close) (struct uh_ubus_state *state);
+	void (*ubus_fork) (struct uh_ubus_state *state, const struct config *conf);
 	bool (*ubus_request) (struct client *cl, struct uh_ubus_state *state);
 #endif
 #if defined(HAVE_CGI) || defined(HAVE_LUA) || defined(HAVE_UBUS)
@@ -112,15 +148,23 @@ struct config {
 #ifdef HAVE_TLS
 	char *cert;
 	char *key;
+	int tls_sessions;
+	int tls_tickets;
+	int tls_offload;
 	SSL_CTX *tls;
 	SSL_CTX * (*tls_init) (void);
 	int (*tls_cert) (SSL_CTX *c, const char *file);
 	int (*tls_key) (SSL_CTX *c, const char *file);
+	void (*tls_session) (SSL_CTX *c, int cache_size, int lifetime);
+	int (*tls_ctx_ktls) (SSL_CTX *c);
 	void (*tls_free) (struct listener *l);
 	int (*tls_accept) (struct client *c);
 	void (*tls_close) (struct client *c);
 	int (*tls_recv) (struct client *c, char *buf, int len);
 	int (*tls_send) (struct client *c, const char *buf, int len);
+	int (*tls_ktls) (struct client *c);
+	int (*tls_sendfile) (struct client *c, int fd, off_t *offset, int len);
+	int (*tls_pending) (struct client *c);
 #endif
 };
 
@@ -140,12 +184,40 @@ enum http_version {
 
 extern const char *http_versions[];
 
+/* request headers classified by the parser, the values are additionally
+ * available by index in http_request.fields */
+enum http_header {
+	UH_HTTP_HDR_HOST,
+	UH_HTTP_HDR_CONTENT_LENGTH,
+	UH_HTTP_HDR_CONTENT_TYPE,
+	UH_HTTP_HDR_AUTHORIZATION,
+	UH_HTTP_HDR_IF_MATCH,
+	UH_HTTP_HDR_IF_MODIFIED_SINCE,
+	UH_HTTP_HDR_IF_NONE_MATCH,
+	UH_HTTP_HDR_IF_RANGE,
+	UH_HTTP_HDR_IF_UNMODIFIED_SINCE,
+	UH_HTTP_HDR_RANGE,
+	UH_HTTP_HDR_ACCEPT_ENCODING,
+	UH_HTTP_HDR_CONNECTION,
+	UH_HTTP_HDR_EXPECT,
+	UH_HTTP_HDR_COOKIE,
+	UH_HTTP_HDR_ACCEPT,
+	UH_HTTP_HDR_ACCEPT_CHARSET,
+	UH_HTTP_HDR_ACCEPT_LANGUAGE,
+	UH_HTTP_HDR_REFERER,
+	UH_HTTP_HDR_USER_AGENT,
+	UH_HTTP_HDR_TRANSFER_ENCODING,
+	__UH_HTTP_HDR_MAX
+};
+
 struct http_request {
 	enum http_method method;
 	enum http_version version;
 	int redirect_status;
+	int content_length;
 	char *url;
 	char *headers[UH_LIMIT_HEADERS];
+	char *fields[__UH_HTTP_HDR_MAX];
 	struct auth_realm *realm;
 };
 
@@ -159,6 +231,7 @@ struct listener {
 	struct uloop_fd fd;
 	int socket;
 	int n_clients;
+	bool paused;
 	struct sockaddr_in6 addr;
 	struct config *conf;
 #ifdef HAVE_TLS
@@ -177,19 +250,49 @@ struct client {
 	struct uloop_process proc;
 	struct uloop_timeout timeout;
 	bool (*cb)(struct client *);
+	void (*cleanup)(struct client *);
 	void *priv;
+#ifdef HAVE_ZLIB
+	struct uh_deflate *deflate;
+#endif
 	bool dispatched;
+	bool keepalive;
+	bool paused;
+	bool stalled;
+#ifdef HAVE_TLS
+	bool handshake;
+#endif
+	int requests;
 	struct {
-		char buf[UH_LIMIT_MSGHEAD];
+		uint64_t start;
+		int handler;
+	} metrics;
+	struct {
+		char *buf;
 		char *ptr;
 		int len;
+		int scan;
+		int hdrcount;
 	} httpbuf;
+	struct {
+		char *buf;
+		int off;
+		int len;
+		int size;
+		unsigned int events;
+		int cork;
+		int sent;
+		unsigned int round;
+		bool closing;
+		bool wait;
+		bool blocked;
+	} outbuf;
 	struct listener *server;
 	struct http_request request;
 	struct http_response response;
 	struct sockaddr_in6 servaddr;
 	struct sockaddr_in6 peeraddr;
-	struct client *next;
+	struct list_head list;
 };
 
 struct client_light {
@@ -203,6 +306,7 @@ struct auth_realm {
 	char path[PATH_MAX];
 	char user[32];
 	char pass[128];
+	int pathlen;
 	struct auth_realm *next;
 };
 
@@ -215,6 +319,7 @@ struct index_file {
 struct interpreter {
 	char path[PATH_MAX];
 	char extn[32];
+	struct uh_fcgi_app *fcgi;
 	struct interpreter *next;
 };
 #endif